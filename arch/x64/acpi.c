@@ -110,6 +110,58 @@ typedef enum {
     APIC_ENTRY_LOCAL_X2APIC                      = 9,
 } APIC_Entry_Type;
 
+typedef struct __attribute__((packed)) {
+    u32 reserved1;
+    u64 reserved2;
+} ACPI_SRAT_Header;
+
+typedef struct __attribute__((packed)) {
+    u8  type;
+    u8  length;
+    u8  proximity_lo;
+    u8  apic_id;
+    u32 flags;
+    u8  sapic_eid;
+    u8  proximity_hi[3];
+    u32 clock_domain;
+} ACPI_SRAT_LAPIC_Entry;
+
+typedef struct __attribute__((packed)) {
+    u8  type;
+    u8  length;
+    u32 proximity;
+    u16 reserved1;
+    u64 base;
+    u64 size;
+    u32 reserved2;
+    u32 flags;
+    u64 reserved3;
+} ACPI_SRAT_Mem_Entry;
+
+typedef struct __attribute__((packed)) {
+    u8  type;
+    u8  length;
+    u16 reserved1;
+    u32 proximity;
+    u32 x2apic_id;
+    u32 flags;
+    u32 clock_domain;
+    u32 reserved2;
+} ACPI_SRAT_X2APIC_Entry;
+
+typedef enum {
+    SRAT_ENTRY_LAPIC  = 0,
+    SRAT_ENTRY_MEMORY = 1,
+    SRAT_ENTRY_X2APIC = 2,
+} SRAT_Entry_Type;
+
+#define SRAT_ENABLED 1
+
+typedef struct __attribute__((packed)) {
+    u64 locality_count;
+    u8  distances[];
+} ACPI_SLIT_Header;
+
 const char* entry_to_string(int type) {
     switch (type) {
         case APIC_ENTRY_LAPIC:                            return "Local APIC";
@@ -122,6 +174,78 @@ const char* entry_to_string(int type) {
         default:                                          return "(unknown)";
     }
 }
+
+// proximity domains can be any 32bit number, we just want small indices
+static int numa_node_for(u32* domains, u32 domain) {
+    FOR_N(i, 0, boot_info->numa_node_count) {
+        if (domains[i] == domain) {
+            return i;
+        }
+    }
+
+    if (boot_info->numa_node_count == MAX_NUMA_NODES) {
+        kprintf("[acpi] Too many NUMA nodes, folding domain %u into node 0\n", domain);
+        return 0;
+    }
+
+    domains[boot_info->numa_node_count] = domain;
+    return boot_info->numa_node_count++;
+}
+
+static void parse_srat(ACPI_SDT_Header* head, u32* domains, u32* apic_nodes, u32* apic_ids, size_t* apic_count) {
+    char* buf_ptr = (char*) head + sizeof(ACPI_SDT_Header) + sizeof(ACPI_SRAT_Header);
+    char* end_ptr = (char*) head + head->length;
+    while (buf_ptr < end_ptr) {
+        ACPI_APIC_Entry* entry = (ACPI_APIC_Entry*) buf_ptr;
+        if (entry->length == 0) {
+            break;
+        }
+
+        switch (entry->type) {
+            case SRAT_ENTRY_LAPIC: {
+                ACPI_SRAT_LAPIC_Entry* e = (ACPI_SRAT_LAPIC_Entry*) buf_ptr;
+                if ((e->flags & SRAT_ENABLED) && *apic_count < MAX_CORES) {
+                    u32 domain = e->proximity_lo | (e->proximity_hi[0] << 8) | (e->proximity_hi[1] << 16) | (e->proximity_hi[2] << 24);
+                    apic_ids[*apic_count]     = e->apic_id;
+                    apic_nodes[*apic_count]   = numa_node_for(domains, domain);
+                    *apic_count += 1;
+                }
+            } break;
+            case SRAT_ENTRY_X2APIC: {
+                ACPI_SRAT_X2APIC_Entry* e = (ACPI_SRAT_X2APIC_Entry*) buf_ptr;
+                if ((e->flags & SRAT_ENABLED) && *apic_count < MAX_CORES) {
+                    apic_ids[*apic_count]     = e->x2apic_id;
+                    apic_nodes[*apic_count]   = numa_node_for(domains, e->proximity);
+                    *apic_count += 1;
+                }
+            } break;
+            case SRAT_ENTRY_MEMORY: {
+                ACPI_SRAT_Mem_Entry* e = (ACPI_SRAT_Mem_Entry*) buf_ptr;
+                if ((e->flags & SRAT_ENABLED) && e->size > 0 && boot_info->numa_range_count < MAX_NUMA_RANGES) {
+                    NumaRange* r = &boot_info->numa_ranges[boot_info->numa_range_count++];
+                    r->base = e->base;
+                    r->size = e->size;
+                    r->node = numa_node_for(domains, e->proximity);
+                }
+            } break;
+        }
+        buf_ptr += entry->length;
+    }
+}
+
+// fills in the node distances, SLIT is indexed by proximity domain
+static void parse_slit(ACPI_SDT_Header* head, u32* domains) {
+    ACPI_SLIT_Header* slit = (ACPI_SLIT_Header*) ((char*) head + sizeof(ACPI_SDT_Header));
+    u64 n = slit->locality_count;
+
+    FOR_N(i, 0, boot_info->numa_node_count) {
+        FOR_N(j, 0, boot_info->numa_node_count) {
+            if (domains[i] < n && domains[j] < n) {
+                boot_info->numa_distance[i][j] = slit->distances[domains[i]*n + domains[j]];
+            }
+        }
+    }
+}
 
 static uintptr_t id_map(uintptr_t addr) {
     size_t offset = addr & (PAGE_SIZE - 1);
@@ -159,6 +283,18 @@ void x86_parse_acpi(void) {
     u8 apic_magic[] = {'A', 'P', 'I', 'C' };
     u8 hpet_magic[] = {'H', 'P', 'E', 'T' };
     u8 mcfg_magic[] = {'M', 'C', 'F', 'G' };
+    u8 srat_magic[] = {'S', 'R', 'A', 'T' };
+    u8 slit_magic[] = {'S', 'L', 'I', 'T' };
+
+    // the SRAT names cores by APIC ID and the MADT might come after it, so
+    // we hold onto the affinities until we've seen both.
+    u32 numa_domains[MAX_NUMA_NODES];
+    u32 apic_nodes[MAX_CORES], apic_ids[MAX_CORES];
+    size_t apic_count = 0;
+    ACPI_SDT_Header* slit = NULL;
+
+    boot_info->numa_node_count  = 0;
+    boot_info->numa_range_count = 0;
     u64 remaining_length = xhead->header.length - sizeof(xhead->header);
     int entries = remaining_length / 8;
     for (int i = 0; i < entries; i++) {
@@ -224,6 +360,10 @@ void x86_parse_acpi(void) {
 
             u64 ticks_per_time = end - start;
             tsc_freq = (ticks_per_time / us_delay);
+        } else if (memeq(head->signature, srat_magic, sizeof(srat_magic))) {
+            parse_srat(head, numa_domains, apic_nodes, apic_ids, &apic_count);
+        } else if (memeq(head->signature, slit_magic, sizeof(slit_magic))) {
+            slit = head;
         } else if (memeq(head->signature, mcfg_magic, sizeof(mcfg_magic))) {
             /*ACPI_MCFG_Header *mhead = (ACPI_MCFG_Header*) head;
             size_t n = (mhead->header.length - 44) / 16;
@@ -244,6 +384,38 @@ void x86_parse_acpi(void) {
     boot_info->core_count = core_count;
     boot_info->tsc_freq = tsc_freq;
 
+    // no SRAT, everyone's on the same node
+    bool has_srat = boot_info->numa_node_count > 0;
+    if (!has_srat) {
+        boot_info->numa_node_count = 1;
+    }
+
+    // without a SLIT we only know local vs remote
+    FOR_N(i, 0, boot_info->numa_node_count) {
+        FOR_N(j, 0, boot_info->numa_node_count) {
+            boot_info->numa_distance[i][j] = i == j ? 10 : 20;
+        }
+    }
+
+    if (slit != NULL && has_srat) {
+        parse_slit(slit, numa_domains);
+    }
+
+    FOR_N(i, 0, core_count) {
+        PerCPU* cpu = &boot_info->cores[i];
+        cpu->numa_node = 0;
+        FOR_N(j, 0, apic_count) {
+            if (apic_ids[j] == cpu->lapic_id) {
+                cpu->numa_node = apic_nodes[j];
+                break;
+            }
+        }
+    }
+
+    if (boot_info->numa_node_count > 1) {
+        kprintf("Found %d NUMA nodes\n", boot_info->numa_node_count);
+    }
+
     kassert(boot_info->lapic_base, "We don't have APIC?");
     // kprintf("Found the APIC:     %p (vaddr=%p)\n", boot_info->lapic_base, paddr2kaddr(boot_info->lapic_base));
     // kprintf("Found the I/O APIC: %p (vaddr=%p)\n", boot_info->ioapic_base, paddr2kaddr(boot_info->ioapic_base));
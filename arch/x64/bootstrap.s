@@ -23,7 +23,8 @@ bootstrap_start:
     or eax, 0x100
     wrmsr
 
-    mov ebx, 0x80000013
+    ; Enable paging & protected mode, WP so ring 0 respects read-only pages
+    mov ebx, 0x80010013
     mov cr0, ebx
 
     lgdt [0x1000 + (bootstrap_gdt64_pointer - bootstrap_start)]
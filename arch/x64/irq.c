@@ -356,6 +356,13 @@ uintptr_t x86_irq_int_handler(CPUState* state, uintptr_t cr3, PerCPU* cpu) {
     u64 now = __rdtsc();
     PageTable* old_address_space = paddr2kaddr(cr3);
 
+    // we swapped CR3 on the way in so there's nothing stale left in the TLB,
+    // that's all the shootdown was waiting on.
+    Env* shootdown = atomic_exchange(&cpu->tlb_shootdown, NULL);
+    if (shootdown != NULL) {
+        atomic_fetch_add(&shootdown->addr_space.checkpoint_done, 1);
+    }
+
     #if DEBUG_IRQ
     if (state->interrupt_num != 14 && state->interrupt_num != 32) {
         kprintf("CPU-%d: %s (%d): cr3=%p error=0x%x\n", id, interrupt_names[state->interrupt_num], state->interrupt_num, cr3, state->error);
@@ -394,20 +401,35 @@ uintptr_t x86_irq_int_handler(CPUState* state, uintptr_t cr3, PerCPU* cpu) {
             if (rwlock_try_lock_shared(&env->addr_space.lock)) {
                 // update hardware page tables to match
                 bool is_write = state->error & 2;
-                bool success = vmem_segfault(env, access_addr, is_write);
-                if (!success) {
-                    dump_page_fault(state, cr3, cpu, env, curr, access_addr);
+                VMem_Fault fault = vmem_segfault(env, access_addr, is_write);
+                rwlock_unlock_shared(&env->addr_space.lock);
 
+                if (fault == VMEM_FAULT_OK_FLUSH) {
+                    // the other threads might still be reading the zero page
+                    // we just replaced, they need to let go before we write.
+                    arch_tlb_shootdown(env);
+                    fault = VMEM_FAULT_OK;
+                }
+
+                if (fault != VMEM_FAULT_OK) {
                     kassert(curr->client.wake_time == 0, "just in case");
+                    if (fault == VMEM_FAULT_NO_MEM) {
+                        // the access was fine, we just couldn't back it. the
+                        // whole env goes since it's not getting anywhere.
+                        kprintf("[oom] killing env %p, couldn't commit %p\n", env, access_addr);
+                        env_mark_dead(env);
+                    } else if (atomic_ldrlx(&env->is_dead)) {
+                        // its memory's being torn down, the thread just hadn't
+                        // been told it's dead yet.
+                    } else {
+                        dump_page_fault(state, cr3, cpu, env, curr, access_addr);
+                        store_dump_all();
+                    }
                     curr->client.is_dead = true;
-                    store_dump_all();
-                    rwlock_unlock_shared(&env->addr_space.lock);
 
                     // run other processes, this one's dead
                     cr3 = timer_interrupt(state, cr3, cpu, now);
                 }
-
-                rwlock_unlock_shared(&env->addr_space.lock);
             } else {
                 spall_end_event(id);
 
@@ -442,6 +464,56 @@ uintptr_t x86_irq_int_handler(CPUState* state, uintptr_t cr3, PerCPU* cpu) {
     return cr3;
 }
 
+// indexed by level, 0 is the top table and 3 holds the 4KiB PTEs
+static const uint64_t pte_shifts[4] = { 39, 30, 21, 12 };
+
+// convert software page properties into hardware page flags
+static uint64_t pte_flags(VMem_Flags flags) {
+    uint64_t page_flags = PAGE_PRESENT;
+    if (!(flags & VMEM_PAGE_KERNEL)) { page_flags |= PAGE_USER;  }
+    if (flags & VMEM_PAGE_WRITE)     { page_flags |= PAGE_WRITE; }
+    if (flags & VMEM_PAGE_UNCACHED)  { page_flags |= PAGE_NOCACHE; }
+    if (flags & VMEM_PAGE_WRITETHRU) { page_flags |= PAGE_WRITETHRU; }
+    return page_flags;
+}
+
+static size_t pte_index(uintptr_t vaddr, size_t level) {
+    return (vaddr >> pte_shifts[level]) & 0x1FF;
+}
+
+// replaces a large page with a table of smaller pages which map the same thing,
+// since nothing about the translation changes the TLBs don't care. returns the
+// new entry or 0 if we couldn't get a frame for the table.
+static u64 pte_split(_Atomic(u64)* slot, u64 entry, size_t level) {
+    PageTable* table = frame_alloc(0, FRAME_PAGE_TABLE);
+    if (table == NULL) {
+        return 0;
+    }
+
+    // the 1GiB pages turn into 2MiB ones, the 2MiB ones into 4KiB. the PAT bit
+    // sits where the PS bit does on 4KiB PTEs so it has to go.
+    uint64_t child_size = 1ull << pte_shifts[level + 1];
+    uint64_t base  = entry & 0xFFFFFFFFF000;
+    uint64_t flags = entry & 0xFFF & ~PAGE_HUGE;
+    if (level + 1 < 3) {
+        flags |= PAGE_HUGE;
+    }
+
+    FOR_N(i, 0, 512) {
+        atomic_store_explicit(&table->entries[i], (base + i*child_size) | flags, memory_order_relaxed);
+    }
+
+    u64 new_entry = kaddr2paddr(table) | (entry & (PAGE_PRESENT | PAGE_WRITE | PAGE_USER));
+    if (!atomic_compare_exchange_strong(slot, &entry, new_entry)) {
+        // someone else changed it first, take theirs
+        frame_free(table, 0);
+        return entry;
+    }
+
+    atomic_fetch_add_explicit(&vmem_counters.large_splits, 1, memory_order_relaxed);
+    return new_entry;
+}
+
 // there's two events:
 //   update software PTEs => update hardware PTEs
 //
@@ -450,59 +522,225 @@ uintptr_t x86_irq_int_handler(CPUState* state, uintptr_t cr3, PerCPU* cpu) {
 // view. If the memory map update makes "backwards progress" (new form causes more segfaults,
 // thus updates can't be accomodated for in existing segfaults), we'll require TLB shootdowns
 // and an exclusive lock on the address space.
-void arch_pte_update(Env* env, uintptr_t access_addr, uintptr_t translated, VMem_Flags flags) {
-    static const uint64_t shifts[3] = { 39, 30, 21 };
-
-    // convert software page properties into hardware page flags
-    uint64_t page_flags = PAGE_PRESENT;
-    if (!(flags & VMEM_PAGE_KERNEL)) { page_flags |= PAGE_USER;  }
-    if (flags & VMEM_PAGE_WRITE)     { page_flags |= PAGE_WRITE; }
-    if (flags & VMEM_PAGE_UNCACHED)  { page_flags |= PAGE_NOCACHE; }
-    if (flags & VMEM_PAGE_WRITETHRU) { page_flags |= PAGE_WRITETHRU; }
+static bool pte_install(Env* env, uintptr_t access_addr, uintptr_t translated, VMem_Flags flags, size_t level, bool fill_only, u64* out_old) {
+    uint64_t page_flags = pte_flags(flags);
 
     PageTable* curr = env->addr_space.hw_tables;
-    for (size_t i = 0; i < 3; i++) {
-        size_t index = (access_addr >> shifts[i]) & 0x1FF;
+    for (size_t i = 0; i < level; i++) {
+        _Atomic(u64)* slot = &curr->entries[pte_index(access_addr, i)];
 
         // the intermediate page tables need to have permissions that are "above" the child pages, so we'll OR our
         // flags with it.
-        u64 entry = atomic_load_explicit(&curr->entries[index], memory_order_relaxed);
+        u64 entry = atomic_load_explicit(slot, memory_order_relaxed);
         for (;;) {
             u64 new_entry = entry;
             // no table? add one
             PageTable* new_pt = NULL;
-            if (entry & PAGE_PRESENT) {
+            if (entry & PAGE_HUGE) {
+                // a large page which already says the same thing is fine, that's
+                // just someone else's fault (or readahead) getting here second.
+                uint64_t mask = (1ull << pte_shifts[i]) - 1;
+                uint64_t mapped = (entry & 0xFFFFFFFFF000 & ~mask) | (access_addr & mask);
+                if ((mapped & -PAGE_SIZE) == (translated & 0xFFFFFFFFF000) && (entry & 0x1F) == page_flags) {
+                    return true;
+                }
+
+                // there's a large page in the way, we need to get under it
+                entry = pte_split(slot, entry, i);
+                if (entry == 0) {
+                    return false;
+                }
+                continue;
+            } else if (entry & PAGE_PRESENT) {
                 // bits missing? add one
-                new_entry |= page_flags;
+                new_entry |= page_flags & (PAGE_PRESENT | PAGE_WRITE | PAGE_USER);
             } else {
-                new_pt = kheap_alloc_page();
-                memset(new_pt, 0, sizeof(PageTable));
+                new_pt = frame_alloc(0, FRAME_ZERO | FRAME_PAGE_TABLE);
+                if (new_pt == NULL) {
+                    // whatever tables we did put in are still good
+                    return false;
+                }
 
-                new_entry = kaddr2paddr(new_pt) | page_flags;
+                new_entry = kaddr2paddr(new_pt) | (page_flags & (PAGE_PRESENT | PAGE_WRITE | PAGE_USER));
             }
             // no progress necessary, it's already behaving
             if (entry == new_entry) { break; }
             // transaction, if we fail at least someone allocate the
             // physical page (so we don't spam allocations as much)
-            if (atomic_compare_exchange_strong(&curr->entries[index], &entry, new_entry)) { entry = new_entry; break; }
+            if (atomic_compare_exchange_strong(slot, &entry, new_entry)) { entry = new_entry; break; }
             // throw away our new_pt
-            if (new_pt == NULL) { kheap_free_page(new_pt); }
+            if (new_pt != NULL) { frame_free(new_pt, 0); }
         }
 
-        curr = paddr2kaddr(entry & ~0x1FF);
+        curr = paddr2kaddr(entry & 0xFFFFFFFFF000);
         kassert(curr != NULL, "missing page table, didn't we just insert it?");
     }
 
-    size_t pte_index = (access_addr >> 12) & 0x1FF; // 4KiB
+    _Atomic(u64)* slot = &curr->entries[pte_index(access_addr, level)];
 
-    u64 old_pte = curr->entries[pte_index];
+    u64 old_pte = atomic_load_explicit(slot, memory_order_relaxed);
     u64 new_pte = (translated & 0xFFFFFFFFF000) | page_flags;
+    if (fill_only && (old_pte & PAGE_PRESENT)) {
+        return true;
+    }
+
+    if (level < 3) {
+        // a table's already there, we'd have to free it from under whoever's
+        // walking it so they'll just get 4KiB pages.
+        if ((old_pte & PAGE_PRESENT) && !(old_pte & PAGE_HUGE)) {
+            return false;
+        }
+        new_pte |= PAGE_HUGE;
+    }
+
     if (old_pte != new_pte) {
-        atomic_compare_exchange_strong(&curr->entries[pte_index], &old_pte, new_pte);
+        // if we lose, whoever won gets to say what's there
+        if (!atomic_compare_exchange_strong(slot, &old_pte, new_pte)) {
+            old_pte = 0;
+        }
         ON_DEBUG(VMEM)(kprintf("[vmem] updated PTE [%p] %p -> %p!\n", access_addr, old_pte, new_pte));
     }
+
+    if (out_old != NULL) {
+        *out_old = old_pte & PAGE_PRESENT ? old_pte & 0xFFFFFFFFF000 : 0;
+    }
+    return true;
+}
+
+bool arch_pte_update(Env* env, uintptr_t access_addr, uintptr_t translated, VMem_Flags flags) {
+    return pte_install(env, access_addr, translated, flags, 3, false, NULL);
+}
+
+bool arch_pte_swap(Env* env, uintptr_t access_addr, uintptr_t translated, VMem_Flags flags, uintptr_t* old_paddr) {
+    u64 old = 0;
+    bool ok = pte_install(env, access_addr, translated, flags, 3, false, &old);
+    *old_paddr = old;
+    return ok;
+}
+
+bool arch_pte_fill(Env* env, uintptr_t access_addr, uintptr_t translated, VMem_Flags flags) {
+    return pte_install(env, access_addr, translated, flags, 3, true, NULL);
+}
+
+bool arch_pte_update_large(Env* env, uintptr_t access_addr, uintptr_t translated, size_t page_size, VMem_Flags flags) {
+    if (page_size == (1ull << 30)) {
+        return x86_has_1gib_pages && pte_install(env, access_addr, translated, flags, 1, false, NULL);
+    } else if (page_size == (1ull << 21)) {
+        return pte_install(env, access_addr, translated, flags, 2, false, NULL);
+    } else {
+        return false;
+    }
+}
+
+// walks down to whichever entry maps vaddr, large pages which [vaddr, end)
+// only covers part of get split up along the way. returns the level of the
+// entry, it's either not present (a hole that big) or entirely in the range.
+static size_t pte_walk(Env* env, uintptr_t vaddr, uintptr_t end, PageTable* path[4], bool* zapped) {
+    path[0] = env->addr_space.hw_tables;
+    for (size_t i = 0; i < 3; i++) {
+        _Atomic(u64)* slot = &path[i]->entries[pte_index(vaddr, i)];
+        u64 entry = atomic_load_explicit(slot, memory_order_relaxed);
+        if ((entry & PAGE_PRESENT) == 0) {
+            return i;
+        }
+
+        if (entry & PAGE_HUGE) {
+            uint64_t size = 1ull << pte_shifts[i];
+            if ((vaddr & (size - 1)) == 0 && end - vaddr >= size) {
+                return i;
+            }
+
+            entry = pte_split(slot, entry, i);
+            if (entry == 0) {
+                // dropping the whole thing works too, whatever's outside the
+                // range just faults back in.
+                atomic_store_explicit(slot, 0, memory_order_relaxed);
+                *zapped = true;
+                return i;
+            }
+        }
+        path[i + 1] = paddr2kaddr(entry & 0xFFFFFFFFF000);
+    }
+    return 3;
 }
 
+// unlike arch_pte_update this doesn't make anything new, missing tables just
+// mean there's nothing committed under them. it's up to the caller to do the
+// shootdown if it took any access away.
+bool arch_pte_protect(Env* env, uintptr_t vaddr, size_t size, VMem_Flags flags) {
+    const uint64_t perm_mask = PAGE_USER | PAGE_WRITE | PAGE_NOCACHE | PAGE_WRITETHRU;
+    uint64_t page_flags = pte_flags(flags);
+
+    bool changed = false;
+    uintptr_t end = vaddr + size;
+    while (vaddr < end) {
+        PageTable* path[4];
+        size_t level = pte_walk(env, vaddr, end, path, &changed);
+        _Atomic(u64)* slot = &path[level]->entries[pte_index(vaddr, level)];
+
+        // the CPU might be setting the accessed/dirty bits as we go
+        u64 old_pte = atomic_load_explicit(slot, memory_order_relaxed);
+        while (old_pte & PAGE_PRESENT) {
+            // we're only here to take access away, gaining WRITE is left for the
+            // faults (which also know not to hand it out on the zero page).
+            u64 new_pte = (old_pte & ~perm_mask) | page_flags;
+            if (!(old_pte & PAGE_WRITE)) { new_pte &= ~PAGE_WRITE; }
+            if (old_pte == new_pte) { break; }
+            if (atomic_compare_exchange_strong(slot, &old_pte, new_pte)) {
+                ON_DEBUG(VMEM)(kprintf("[vmem] protected PTE [%p] %p -> %p!\n", vaddr, old_pte, new_pte));
+                changed = true;
+                break;
+            }
+        }
+
+        // skip the rest of the page (or the hole)
+        uint64_t step = 1ull << pte_shifts[level];
+        vaddr = (vaddr + step) & -step;
+    }
+    return changed;
+}
+
+static bool pt_empty(PageTable* pt) {
+    FOR_N(i, 0, 512) {
+        if (atomic_load_explicit(&pt->entries[i], memory_order_relaxed) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void arch_pte_clear(Env* env, uintptr_t vaddr, size_t size, VMem_Reclaim* r) {
+    uintptr_t end = vaddr + size;
+    while (vaddr < end) {
+        PageTable* path[4];
+        size_t level = pte_walk(env, vaddr, end, path, &r->stale);
+        if (atomic_exchange(&path[level]->entries[pte_index(vaddr, level)], 0) & PAGE_PRESENT) {
+            r->stale = true;
+        }
+
+        uintptr_t table_addr = vaddr;
+        uint64_t step = 1ull << pte_shifts[level];
+        vaddr = (vaddr + step) & -step;
+
+        // once we're done with a table, free it if it emptied out. the top
+        // level stays with the env.
+        for (size_t j = level; j > 0; j--) {
+            uint64_t span = 1ull << pte_shifts[j - 1];
+            if (vaddr < end && (vaddr & (span - 1)) != 0) {
+                break;
+            }
+
+            if (!pt_empty(path[j])) {
+                break;
+            }
+
+            atomic_store_explicit(&path[j - 1]->entries[pte_index(table_addr, j - 1)], 0, memory_order_relaxed);
+            r->stale = true;
+            vmem_reclaim_push(r, path[j]);
+        }
+    }
+}
+
 CPUState new_thread_state(void* entrypoint, uintptr_t arg, uintptr_t stack, size_t stack_size, bool is_user) {
     // the stack will grow downwards.
     // the other registers are zeroed by default.
@@ -1,4 +1,4 @@
-extern kmain, kernel_tss
+extern kmain, kernel_tss, kheap_idle, frame_idle, vmem_idle
 global _start, kernel_idle
 
 ; We got ourselves boot info in RCX
@@ -43,8 +43,19 @@ _start.reload_cs:
     hlt
 
 kernel_idle:
+    ; the idle state doesn't come with a stack but nobody else is on
+    ; the kernel stack while we're idle (interrupts run on IST1).
+    mov rsp, gs:[8]
+    xor ebp, ebp
+
+    ; use the downtime to zero some pages
+    call kheap_idle
+    call frame_idle
+    ; and promote whatever anonymous memory filled up
+    call vmem_idle
+kernel_idle.halt:
     hlt
-    jmp kernel_idle
+    jmp kernel_idle.halt
 
 section .data
 far_jumper:
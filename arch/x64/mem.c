@@ -3,6 +3,28 @@
 uintptr_t arch_canonical_addr(uintptr_t ptr) {
     return (ptr >> 47) != 0 ? ptr | (0xFFFFull << 48) : ptr;
 }
+
+void arch_zero_page(void* page) {
+    void* dst = page;
+    size_t n  = PAGE_SIZE / 8;
+    asm volatile ("rep stosq" : "+D" (dst), "+c" (n) : "a" (0ull) : "memory");
+}
+
+void arch_zero_page_nt(void* page) {
+    u64* dst = page;
+    for (size_t i = 0; i < PAGE_SIZE / 8; i += 4) {
+        asm volatile (
+            "movnti [%0 + 0],  %1\n"
+            "movnti [%0 + 8],  %1\n"
+            "movnti [%0 + 16], %1\n"
+            "movnti [%0 + 24], %1\n"
+            :: "r" (&dst[i]), "r" (0ull) : "memory"
+        );
+    }
+    // non-temporal stores are weakly ordered, they need to land before
+    // anyone else gets a hold of the page.
+    asm volatile ("sfence" ::: "memory");
+}
 
 static PageTable* get_pt(PageTable* parent, size_t index) {
     if (parent->entries[index] & PAGE_PRESENT) {
@@ -119,6 +141,7 @@ static void memdump(u64 *buffer, size_t size) {
 }
 
 static u64 memmap__probe(PageTable* address_space, uintptr_t virt) {
+    static const uint64_t shifts[3] = { 39, 30, 21 };
     size_t l[4] = {
         (virt >> 39) & 0x1FF,
         (virt >> 30) & 0x1FF,
@@ -134,6 +157,13 @@ static u64 memmap__probe(PageTable* address_space, uintptr_t virt) {
             return 0;
         }
 
+        // large page, we'll hand back what the 4KiB PTE would've looked like
+        u64 entry = curr->entries[l[i]];
+        if (i > 0 && (entry & PAGE_HUGE)) {
+            uint64_t mask = (1ull << shifts[i]) - 1;
+            return (entry & 0xFFFFFFFFF000ull & ~mask) | (virt & mask & ~0xFFFull) | (entry & 0xFFF & ~PAGE_HUGE);
+        }
+
         curr = paddr2kaddr(arch_canonical_addr(curr->entries[l[i]] & 0xFFFFFFFFF000ull));
     }
 
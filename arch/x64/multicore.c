@@ -38,13 +38,25 @@ void arch_wake_up(int core_id) {
 
 // TODO(NeGate): this function is spin-locking for an unbounded
 // amount of time in a non-preemptible environment...
+// if some other core is waiting on us to flush while we're stuck waiting on
+// it, we can acknowledge from here instead of deadlocking with interrupts off.
+static void tlb_ack_pending(PerCPU* cpu) {
+    Env* pending = atomic_exchange(&cpu->tlb_shootdown, NULL);
+    if (pending != NULL) {
+        uintptr_t cr3 = x86_get_cr3();
+        asm volatile ("mov cr3, %0" :: "r" (cr3) : "memory");
+        atomic_fetch_add(&pending->addr_space.checkpoint_done, 1);
+    }
+}
+
 void arch_tlb_shootdown(Env* env) {
     PerCPU* cpu = cpu_get();
     spall_begin_event("shootdown", cpu_get_index());
 
-    // acquire TLB lock
-    Thread* curr = cpu->current_thread;
-    while (!atomic_compare_exchange_strong(&env->addr_space.tlb_lock, &(Thread*){ NULL }, curr)) {
+    // acquire TLB lock, the core's the owner since the idle loop doesn't have
+    // a thread to go by.
+    while (!atomic_compare_exchange_strong(&env->addr_space.tlb_lock, &(PerCPU*){ NULL }, cpu)) {
+        tlb_ack_pending(cpu);
         asm volatile ("pause");
     }
 
@@ -52,16 +64,27 @@ void arch_tlb_shootdown(Env* env) {
     int checkpoint_count = 0;
     FOR_N(i, 0, boot_info->core_count) {
         Thread* t = boot_info->cores[i].current_thread;
-        if (t != curr && t != NULL && t->parent == env) {
+        if (&boot_info->cores[i] != cpu && t != NULL && t->parent == env) {
+            // any interrupt flushes the TLB, the handler acknowledges it
+            // by bumping checkpoint_done.
+            atomic_store(&boot_info->cores[i].tlb_shootdown, env);
+
             // sending an IPI which triggers int#32 (Timer)
             x86_send_ipi(boot_info->cores[i].lapic_id, 0x20);
             checkpoint_count++;
         }
     }
 
+    // we're probably in a syscall on the env's tables, those don't swap CR3
+    uintptr_t cr3 = x86_get_cr3();
+    if (cr3 == kaddr2paddr(env->addr_space.hw_tables)) {
+        asm volatile ("mov cr3, %0" :: "r" (cr3) : "memory");
+    }
+
     // barrier until all of those threads have crossed the checkpoint
     while (env->addr_space.checkpoint_done != checkpoint_count) {
         // keep waiting
+        tlb_ack_pending(cpu);
         asm volatile ("pause");
     }
 
@@ -86,10 +109,12 @@ void x86_boot_cores(void) {
     }
 
     u64* gdt_table = kheap_alloc(boot_info->core_count * sizeof(u64));
+    kassert(gdt_table, "OOM");
     gdt_table[0] = 0;
 
     FOR_N(k, 1, boot_info->core_count) {
         char* sp = kheap_alloc(KERNEL_STACK_SIZE);
+        kassert(sp, "OOM");
         // kprintf("KernelStack[%d]: %p - %p\n", k, sp, sp + KERNEL_STACK_SIZE);
 
         // if windows can get away with small kernel stacks so can we
@@ -16,6 +16,8 @@ static bool has_cpu_support(void) {
         return false;
     }
 
+    x86_get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+    x86_has_1gib_pages = (edx >> 26) & 1;
     return true;
 }
 
@@ -44,6 +46,7 @@ void x86_set_kernel_gs(int core_id) {
 }
 
 static atomic_int cores_ready;
+bool x86_has_1gib_pages;
 
 void pci_init(void);
 void ps2_init(void);
@@ -54,6 +57,11 @@ void arch_init(int id) {
     // Double checking
     uint32_t val = 0x1F80;
     asm volatile ("ldmxcsr [%q0]" :: "r"(&val));
+
+    // the kernel has to respect read-only PTEs too, otherwise a syscall writing
+    // to user memory goes straight into the zero page or a COW page. the APs
+    // already got it from the bootstrap, UEFI doesn't promise it for the BSP.
+    x86_set_cr0(x86_get_cr0() | (1ull << 16));
 
     if (id == 0) {
         if (!has_cpu_support()) {
@@ -73,6 +81,7 @@ void arch_init(int id) {
         kprintf("Found %d cores | TSC freq %d MHz\n", boot_info->core_count, boot_info->tsc_freq);
 
         kheap_multicore(boot_info->core_count);
+        frame_init();
         store_alloc();
         pci_init();
 
@@ -85,7 +94,9 @@ void arch_init(int id) {
     }
 
     PerCPU* cpu = &boot_info->cores[id];
-    cpu->kernel_stack_top = kheap_alloc(KERNEL_STACK_SIZE) + KERNEL_STACK_SIZE;
+    char* kernel_stack = kheap_alloc(KERNEL_STACK_SIZE);
+    kassert(kernel_stack, "OOM");
+    cpu->kernel_stack_top = kernel_stack + KERNEL_STACK_SIZE;
 
     // setup TSS, it'll store the relevant kernel stack
     {
@@ -156,6 +167,28 @@ size_t cpu_get_index(void) {
     return cpu_get() - boot_info->cores;
 }
 
+bool arch_irq_save(void) {
+    u64 flags;
+    asm volatile ("pushfq\npop %0\ncli" : "=r" (flags) :: "memory");
+    return flags & 0x200;
+}
+
+void arch_irq_restore(bool enabled) {
+    if (enabled) {
+        asm volatile ("sti" ::: "memory");
+    }
+}
+
+u64 x86_get_cr0(void) {
+    u64 result;
+    asm volatile ("mov %q0, cr0" : "=a" (result));
+    return result;
+}
+
+void x86_set_cr0(u64 v) {
+    asm volatile ("mov cr0, %q0" :: "a" (v) : "memory");
+}
+
 u64 x86_get_cr2(void) {
     u64 result;
     asm volatile ("mov %q0, cr2" : "=a" (result));
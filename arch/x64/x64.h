@@ -24,6 +24,8 @@ typedef enum PageFlags {
     PAGE_WRITETHRU = 8,
     PAGE_NOCACHE   = 16,
     PAGE_ACCESSED  = 32,
+    // only in the PML4E->PDPTE & PDPTE->PDE levels, it makes the entry a 1GiB or 2MiB page
+    PAGE_HUGE      = 128,
 } PageFlags;
 
 enum {
@@ -50,6 +52,9 @@ enum {
 
 extern CPUState kernel_idle_state;
 
+// CPUID.80000001H:EDX.Page1GB
+extern bool x86_has_1gib_pages;
+
 _Noreturn void x86_halt(void);
 
 void x86_parse_acpi(void);
@@ -67,8 +72,12 @@ u64 x86_readmsr(u32 r);
 void x86_writemsr(u32 r, u64 v);
 
 // Control regs:
+//   CR0 holds the paging & protection toggles, WP (bit 16) makes ring 0 respect
+//       read-only pages.
 //   CR2 holds the linear address accessed when a segfault occurs.
 //   CR3 holds the physical address to the root page table.
+u64 x86_get_cr0(void);
+void x86_set_cr0(u64 v);
 u64 x86_get_cr2(void);
 u64 x86_get_cr3(void);
 
@@ -340,6 +340,10 @@ EFI_STATUS efi_main(EFI_HANDLE img_handle, EFI_SYSTEM_TABLE* st) {
     if (sizeof(kernel_map) > 0) {
         mem_map_mark(&mem_map, (u64) kernel_map, PAGE_4K(sizeof(kernel_map)), MEM_REGION_KERNEL);
     }
+    // the rest of the loader's memory gets handed to the kernel heap after boot,
+    // these two stick around (the kernel runs on our page tables & GDT).
+    mem_map_mark(&mem_map, (u64) &kernel_boot_info, PAGE_4K(sizeof(BootInfo)), MEM_REGION_BOOT_INFO);
+    mem_map_mark(&mem_map, (u64) page_tables, page_tables_count, MEM_REGION_PAGE_TABLES);
     mem_map_merge_contiguous_ranges(&mem_map);
     if(!mem_map_verify(&mem_map)) {
         panic("MemMap contains overlapping ranges");
@@ -390,6 +394,11 @@ EFI_STATUS efi_main(EFI_HANDLE img_handle, EFI_SYSTEM_TABLE* st) {
     map_pages_id(&ctx, kernel_module.phys_base + kernel_module.entry_addr, 1);
     map_pages(&ctx, kernel_boot_info.identity_map_ptr + (uintptr_t) &kernel_boot_info, (uintptr_t) &kernel_boot_info, (sizeof(BootInfo) + 4095) / 4096, false);
 
+    // we're done making page tables, whatever's left of the estimate can go
+    if (ctx.used < ctx.capacity) {
+        mem_map_mark(&mem_map, (u64) &page_tables[ctx.used], ctx.capacity - ctx.used, MEM_REGION_BOOT);
+    }
+
     // memset(framebuffer, 0, framebuffer_stride * framebuffer_height * sizeof(u32));
     for (size_t j = 0; j < 50; j++) {
         for (size_t i = 0; i < 50; i++) {
@@ -75,8 +75,7 @@ static u64 efi_cvt_mem_desc_type(u32 efi_type) {
         return MEM_REGION_BOOT;
         case EfiBootServicesCode:
         case EfiBootServicesData:
-        // return MEM_REGION_UEFI_BOOT;
-        return MEM_REGION_USABLE;
+        return MEM_REGION_UEFI_BOOT;
         case EfiRuntimeServicesCode:
         case EfiRuntimeServicesData:
         return MEM_REGION_UEFI_RUNTIME;
@@ -120,6 +119,8 @@ static char* mem_region_name(u64 type) {
         case MEM_REGION_IO:           return "MEM_REGION_IO";
         case MEM_REGION_IO_PORTS:     return "MEM_REGION_IO_PORTS";
         case MEM_REGION_FRAMEBUFFER:  return "MEM_REGION_FRAMEBUFFER";
+        case MEM_REGION_BOOT_INFO:    return "MEM_REGION_BOOT_INFO";
+        case MEM_REGION_PAGE_TABLES:  return "MEM_REGION_PAGE_TABLES";
     }
     return "MEM_REGION_BAD_TYPE";
 }
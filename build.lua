@@ -140,7 +140,7 @@ do
     })
 
     table.insert(lines, "# INITRD")
-    build("objs/bake_initrd"..host_exe, "cc", "userland/bake_initrd.c", { flags = " -I ext" })
+    build("objs/bake_initrd"..host_exe, "cc", "userland/bake_initrd.c", { flags = " -I ext -I include" })
     command("objs/initrd", init_rd_list, "objs/bake_initrd"..host_exe.." $out $in", "objs/bake_initrd"..host_exe)
     table.insert(lines, "")
 end
@@ -180,6 +180,15 @@ do
     table.insert(lines, "")
 end
 
+-- Host heap harness, kernel/heap.c running as a normal process (objs/heap_host [threads] [MiB])
+if not is_windows then
+    table.insert(lines, "# HEAP HOST")
+    build("objs/heap_host", "cc", "tools/heap_host.c", {
+        flags = " -std=gnu23 -O2 -g -I ext -I include -I kernel -DKERNEL_LAND -masm=intel -lpthread"
+    })
+    table.insert(lines, "")
+end
+
 -- EFI Bootloader
 do
     table.insert(lines, "# EFI BOOTLOADER")
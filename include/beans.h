@@ -24,6 +24,16 @@ enum {
     MEM_FIXED       = 16,
 };
 
+// madvise
+enum {
+    // whatever the kernel's default is
+    MADV_NORMAL     = 0,
+    // anonymous memory in the range should use 2MiB pages where it can
+    MADV_HUGEPAGE   = 1,
+    // ... or never
+    MADV_NOHUGEPAGE = 2,
+};
+
 enum {
     RESULT_SUCCESS   =  0,
 
@@ -45,6 +55,67 @@ enum {
     RESULT_BAD_PERMISSION = -8,
 };
 
+// heap telemetry, SYS_heap_stats fills in one of these per core. the counters
+// are kept by whichever core did the alloc/free (no atomics that way) so a
+// single core's live count can go negative, it only adds up across all of
+// them. used/owned are from the owning core's side, owned - used is what's
+// sitting free inside memory the class holds.
+enum {
+    // 16, 32, 48, 64, 128, 192 ... 4096 (block_size has the exact one)
+    HEAP_STATS_SMALL = 0,
+    // 64KiB chunks the small classes (and slab caches) carve from
+    HEAP_STATS_64K   = 23,
+    // kheap_alloc_page
+    HEAP_STATS_PAGE  = 24,
+    // 4KiB - 2MiB
+    HEAP_STATS_VAR   = 25,
+    // multi-segment allocs
+    HEAP_STATS_SPAN  = 26,
+    // slab cache objects, every cache summed up (their 64KiB chunks are
+    // in HEAP_STATS_64K too)
+    HEAP_STATS_SLAB  = 27,
+
+    HEAP_STATS_CLASSES,
+};
+
+typedef struct HeapClassStats {
+    uint64_t block_size;
+    uint64_t allocs, frees;
+    // frees of objects which belong to some other core's heap (they went
+    // through its thread_free list)
+    uint64_t remote_frees;
+    // bytes lost to rounding up to the block size
+    int64_t  wasted_bytes;
+
+    uint64_t used_bytes, owned_bytes;
+    uint64_t free_blocks;
+    // 64KiB chunks or 2MiB segments backing the class
+    uint64_t granules;
+} HeapClassStats;
+
+typedef struct HeapCoreStats {
+    HeapClassStats classes[HEAP_STATS_CLASSES];
+
+    // segments sitting in the core's pool
+    uint64_t pooled_segments;
+    uint64_t zeroed_pages, zeroed_hits, zeroed_misses;
+} HeapCoreStats;
+
+// virtual memory telemetry, SYS_vmem_stats fills one in (it's system-wide)
+typedef struct VMemStats {
+    // anonymous 2MiB blocks which got a whole frame on first touch
+    uint64_t thp_faults;
+    // ... and the ones which wanted one but got 4KiB pages
+    uint64_t thp_fallbacks;
+    // 4KiB pages which the idle loop collapsed into a 2MiB one
+    uint64_t thp_promotions;
+    // large pages broken up by a partial mprotect/munmap
+    uint64_t large_splits;
+    // faults which landed where a readahead stream expected (or started
+    // one), the ones which didn't & how many pages got committed ahead
+    uint64_t ra_hits, ra_misses, ra_pages;
+} VMemStats;
+
 typedef enum {
     #define X(name, ...) SYS_ ## name,
     #include "syscall_table.h"
@@ -78,7 +149,20 @@ static uint64_t mailbox_wait(KHandle mailbox, uint64_t info, uint64_t args[2], v
 
 static KHandle vmo_create(size_t size)  { return syscall(SYS_vmo_create, size); }
 static size_t vmo_get_size(KHandle vmo) { return syscall(SYS_vmo_get_size, vmo); }
+// copy-on-write view of [offset, offset + size) in the VMO, pages are shared until written
+static KHandle vmo_clone(KHandle vmo, size_t offset, size_t size) { return syscall(SYS_vmo_clone, vmo, offset, size); }
+// VMO with the unpacked contents of an initrd file (offset is where its FileEntry is in
+// the initrd VMO), the kernel unpacks the pages as they're touched.
+static KHandle vmo_create_initrd(KHandle initrd, size_t offset) { return syscall(SYS_vmo_create_initrd, initrd, offset); }
 
 static void* mmap(KHandle env, KHandle vmo, uintptr_t addr, size_t size, uint32_t flags, size_t offset) { return (void*) syscall(SYS_mmap, env, vmo, addr, size, flags, offset); }
+static int munmap(KHandle env, void* addr, size_t size) { return syscall(SYS_munmap, env, addr, size); }
+static int mprotect(KHandle env, void* addr, size_t size, uint32_t prot) { return syscall(SYS_mprotect, env, addr, size, prot); }
+static int madvise(KHandle env, void* addr, size_t size, uint32_t advice) { return syscall(SYS_madvise, env, addr, size, advice); }
 static void* mpin(KHandle vmo, size_t offset, size_t size, uintptr_t* out_paddr) { return (void*) syscall(SYS_mpin, vmo, offset, size, out_paddr); }
+
+// returns the number of cores written out, passing NULL prints the heap to
+// the kernel log instead.
+static int heap_stats(HeapCoreStats* out, size_t max_cores) { return syscall(SYS_heap_stats, out, max_cores); }
+static int vmem_stats(VMemStats* out) { return syscall(SYS_vmem_stats, out); }
 #endif
@@ -45,6 +45,10 @@ typedef int8_t              i8;
 #define DEBUG_SCHED   0
 #define DEBUG_NBHM    0
 #define DEBUG_SPALL   0
+// samples kheap/kcache call sites, see heap_prof.c
+#define DEBUG_HEAPPROF 0
+// runs kheap_bench during boot
+#define DEBUG_HEAPBENCH 0
 #define DEBUG_EFI     0
 
 #define ON_DEBUG(cond) CONCAT(DO_IF_, CONCAT(DEBUG_, cond))
@@ -63,6 +67,7 @@ typedef _Atomic(u64) atomic_u64;
 // bootleg string.h
 void* memset(void* buffer, int c, size_t n);
 void* memcpy(void* dest, const void* src, size_t n);
+void* memmove(void* dest, const void* src, size_t n);
 int memcmp(const void* a, const void* b, size_t n);
 bool memeq(const void* a, const void* b, size_t n);
 
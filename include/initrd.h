@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The initrd is a list of files (each one padded to 16 bytes) ending with an
+// empty path. The file data is LZ4 compressed in INITRD_BLOCK_SIZE blocks which
+// don't reference each other so any page can be unpacked without the ones before
+// it, that's what lets the kernel page them in on demand:
+//
+//   uint32_t block_ends[block_count]; // where each block ends, relative to the first one
+//   char blocks[];
+//
+// a block which didn't compress is stored as is (the packed & unpacked sizes match).
+enum { INITRD_BLOCK_SIZE = 64*1024 };
+
+typedef struct {
+    uint32_t data_len;
+    uint32_t unpacked_len;
+    char path[24];
+    char data[];
+} FileEntry;
+
+static size_t initrd_block_count(const FileEntry* file) {
+    return (file->unpacked_len + INITRD_BLOCK_SIZE - 1) / INITRD_BLOCK_SIZE;
+}
+
+static FileEntry* initrd_next(FileEntry* file) {
+    size_t padded_len = (file->data_len + 16) & -16ull;
+    return (FileEntry*) (((char*) file) + sizeof(FileEntry) + padded_len);
+}
@@ -9,6 +9,8 @@ X(thread_create)
 X(thread_setattr)
 // Tracing/Debug
 X(debug_log)
+X(heap_stats)
+X(vmem_stats)
 // Event
 X(event_create)
 X(event_wait)
@@ -16,11 +18,15 @@ X(event_signal)
 // VMM
 X(mmap)
 X(munmap)
+X(mprotect)
+X(madvise)
 X(mpin)
 X(mdump)
 X(get_paddr)
 X(vmo_create)
 X(vmo_get_size)
+X(vmo_clone)
+X(vmo_create_initrd)
 // PCI
 X(pci_device_count)
 X(pci_claim_device)
@@ -19,6 +19,9 @@ enum {
     KERNEL_STACK_COOKIE = 0xABCDABCD,
 
     MAX_CORES = 256,
+
+    MAX_NUMA_NODES  = 16,
+    MAX_NUMA_RANGES = 64,
 };
 
 typedef struct {
@@ -38,6 +41,10 @@ typedef enum {
     MEM_REGION_ACPI_NVS,
     MEM_REGION_IO,
     MEM_REGION_IO_PORTS,
+    // loader memory the kernel keeps using, everything else in BOOT &
+    // UEFI_BOOT goes to the heap once the kernel's done with boot_info.
+    MEM_REGION_BOOT_INFO,
+    MEM_REGION_PAGE_TABLES,
 } MemRegionType;
 
 typedef struct {
@@ -52,6 +59,13 @@ typedef struct {
     MemRegion* regions;
 } MemMap;
 
+// physical memory which belongs to a NUMA node (from the SRAT)
+typedef struct {
+    u64 base;
+    u64 size;
+    u32 node;
+} NumaRange;
+
 typedef struct Heap Heap;
 typedef struct StoreLog StoreLog;
 
@@ -65,12 +79,16 @@ struct PerCPU {
     void* irq_stack_top;
 
     u32 physical_id, lapic_id;
+    // NUMA node we're sitting on, 0 if there's no SRAT
+    u32 numa_node;
 
     // Scheduler info
     Server sched;
 
     _Alignas(64) _Atomic bool idleing;
     _Alignas(64) _Atomic(struct Thread*) current_thread;
+    // set by whoever's waiting on us in arch_tlb_shootdown
+    _Atomic(struct Env*) tlb_shootdown;
     _Alignas(64) _Atomic(struct Thread*) blocked_threads;
 
     // NBHM crap
@@ -114,6 +132,13 @@ typedef struct {
     u64 rsdp_addr;
     MemMap mem_map;
 
+    // NUMA nodes are numbered densely (not by ACPI proximity domain), the
+    // distances are relative with 10 being local like in the SLIT.
+    u32 numa_node_count;
+    u32 numa_range_count;
+    NumaRange numa_ranges[MAX_NUMA_RANGES];
+    u8 numa_distance[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
     uintptr_t elf_virtual_ptr;
     uintptr_t elf_physical_ptr;
     size_t elf_mapped_size;
@@ -11,7 +11,7 @@
 // Used by both data structures for tracking frozen values
 #define EBR_PRIME_BIT (1ull << 63ull)
 
-#define EBR_VIRTUAL_ALLOC(size)     memset(kheap_alloc(size), 0, size)
+#define EBR_VIRTUAL_ALLOC(size)     kheap_zalloc(size)
 #define EBR_VIRTUAL_FREE(ptr, size) kheap_free(ptr, size)
 
 // traditional heap ops
@@ -56,6 +56,9 @@ struct EBR_FreeNode {
 // concurrent free-list
 static _Atomic(EBR_FreeNode*) ebr_free_list;
 
+// we make one of these for every deferred free
+static KCache ebr_node_cache = KCACHE_INIT("ebr_node", EBR_FreeNode, NULL);
+
 static int ebr_thread_fn(void* arg) {
     EBR_FreeNode* last_free_list = NULL;
 
@@ -101,7 +104,7 @@ static int ebr_thread_fn(void* arg) {
                 EBR_FreeNode* list = last_free_list;
                 while (list) {
                     EBR_FreeNode* next = list->next;
-                    kheap_free(list, sizeof(EBR_FreeNode));
+                    kcache_free(&ebr_node_cache, list);
                     list = next;
                 }
                 last_free_list = NULL;
@@ -109,9 +112,11 @@ static int ebr_thread_fn(void* arg) {
 
             // empty the free list, it's possible that the mutators are still watching it
             // so we can't free it until the next iteration.
-            for (; free_list; free_list = free_list->next) {
-                EBR_VIRTUAL_FREE(free_list->ptr, free_list->size);
-                // printf("FREE %p %zu\n", free_list->ptr, free_list->size);
+            for (EBR_FreeNode* node = free_list; node; node = node->next) {
+                // ebr_shrink might've beaten us to it
+                if (node->ptr == NULL) { continue; }
+                EBR_VIRTUAL_FREE(node->ptr, node->size);
+                // printf("FREE %p %zu\n", node->ptr, node->size);
             }
             last_free_list = free_list;
             EBR__END();
@@ -122,16 +127,94 @@ static int ebr_thread_fn(void* arg) {
     }
 }
 
+// Called when the heap's out of memory, we can't wait around for the EBR thread
+// so anything retired since its last pass gets freed right here as long as no
+// core is in a critical section. The nodes go back on the list with a NULL ptr
+// so the EBR thread still gets rid of them later (once it's safe to).
+static size_t ebr_shrink(void) {
+    EBR_FreeNode* free_list = atomic_exchange(&ebr_free_list, NULL);
+    if (free_list == NULL) {
+        return 0;
+    }
+
+    // every pointer on the list was unlinked before it got here, any core which
+    // isn't pinned right now can't be looking at them.
+    atomic_thread_fence(memory_order_seq_cst);
+    bool pinned = false;
+    for (int i = 0; i < boot_info->core_count; i++) {
+        if (atomic_ldacq(&boot_info->cores[i].ebr_time) & EBR_PINNED_BIT) {
+            pinned = true;
+            break;
+        }
+    }
+
+    size_t freed = 0;
+    EBR_FreeNode* last = free_list;
+    for (EBR_FreeNode* node = free_list;; node = node->next) {
+        if (!pinned && node->ptr != NULL) {
+            EBR_VIRTUAL_FREE(node->ptr, node->size);
+            freed += node->size;
+            node->ptr = NULL;
+        }
+
+        last = node;
+        if (node->next == NULL) { break; }
+    }
+
+    EBR_FreeNode* list = ebr_free_list;
+    do {
+        last->next = list;
+    } while (!atomic_compare_exchange_strong(&ebr_free_list, &list, free_list));
+    return freed;
+}
+
 static _Atomic bool init;
 void ebr_init(void) {
     if (atomic_cas_acq_rel(&init, &(bool){ false }, true)) {
-        Thread* t = thread_create(NULL, ebr_thread_fn, 0, (uintptr_t) kheap_alloc(KERNEL_STACK_SIZE), KERNEL_STACK_SIZE);
+        void* stack = kheap_alloc(KERNEL_STACK_SIZE);
+        kassert(stack, "OOM");
+
+        Thread* t = thread_create(NULL, ebr_thread_fn, 0, (uintptr_t) stack, KERNEL_STACK_SIZE);
+        kassert(t, "OOM");
         thread_resume(t, NULL);
+
+        kheap_register_shrinker("ebr", ebr_shrink);
+    }
+}
+
+// waits out every critical section which is running right now, anyone who
+// starts one after this can't see the retired pointers anymore. our own core
+// gets skipped, if we're pinned it's the caller doing the retiring.
+static void ebr_synchronize(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+
+    PerCPU* self = cpu_get();
+    for (int i = 0; i < boot_info->core_count; i++) {
+        PerCPU* cpu = &boot_info->cores[i];
+        if (cpu == self) {
+            continue;
+        }
+
+        uint64_t t = atomic_ldacq(&cpu->ebr_time);
+        if (t & EBR_PINNED_BIT) {
+            // we might be under a spinlock, no sleeping here
+            while (atomic_ldacq(&cpu->ebr_time) == t) {
+                asm volatile ("pause");
+            }
+        }
     }
 }
 
 void ebr_free(void* ptr, size_t size) {
-    EBR_FreeNode* node = kheap_alloc(sizeof(EBR_FreeNode));
+    EBR_FreeNode* node = kcache_alloc(&ebr_node_cache);
+    if (node == NULL) {
+        // there's no memory to remember it, so we just wait until nobody
+        // could be reading it anymore and free it right now.
+        ebr_synchronize();
+        EBR_VIRTUAL_FREE(ptr, size);
+        return;
+    }
+
     node->ptr  = ptr;
     node->size = size;
 
@@ -0,0 +1,513 @@
+#include <kernel.h>
+
+enum {
+    FRAME_NIL = UINT32_MAX,
+
+    FRAME_SEGMENT_PAGES = 1u << FRAME_SEGMENT_ORDER,
+
+    // order-0 frames each core keeps around, has to be a power of two
+    FRAME_CACHE_SIZE  = 64,
+    // how many frames move between a cache & the buddy lists at once
+    FRAME_CACHE_BATCH = 16,
+    // how many pre-zeroed frames each core keeps around
+    FRAME_ZEROED_MAX  = 64,
+    // fully free segments a zone holds onto before giving them back to the
+    // heap, else a single alloc+free on the edge would ping-pong the segment.
+    FRAME_ZONE_SPARE  = 2,
+};
+
+// one buddy allocator per NUMA node, orders go up to a whole segment
+typedef struct {
+    Lock lock;
+    uint32_t free[FRAME_SEGMENT_ORDER + 1];
+    size_t free_count[FRAME_SEGMENT_ORDER + 1];
+} FrameZone;
+
+typedef struct {
+    // ring of order-0 frames, the hot end is at head+count (recently freed,
+    // probably still in cache) and the cold end is at head.
+    uint32_t head, count;
+    uint32_t frames[FRAME_CACHE_SIZE];
+
+    // frames the idle loop zeroed ahead of time, linked through the descriptors
+    uint32_t zeroed;
+    uint32_t zeroed_count;
+} FrameCPU;
+
+PageFrame* page_frames;
+static size_t page_frame_count;
+
+static FrameZone frame_zones[MAX_NUMA_NODES];
+static FrameCPU frame_cpus[MAX_CORES];
+
+static void* frame_kaddr(uint32_t pfn) { return paddr2kaddr((uintptr_t) pfn * PAGE_SIZE); }
+static uint32_t frame_pfn(void* ptr)   { return kaddr2paddr(ptr) / PAGE_SIZE; }
+
+static size_t frame_shrink(void);
+
+void frame_init(void) {
+    page_frame_count = kheap_segment_count() * FRAME_SEGMENT_PAGES;
+    kassert(page_frame_count < FRAME_NIL, "too much physical memory for 32bit frame numbers");
+
+    page_frames = kheap_zalloc(page_frame_count * sizeof(PageFrame));
+    kassert(page_frames, "OOM");
+    FOR_N(i, 0, MAX_NUMA_NODES) {
+        FOR_N(j, 0, FRAME_SEGMENT_ORDER + 1) {
+            frame_zones[i].free[j] = FRAME_NIL;
+        }
+    }
+
+    FOR_N(i, 0, MAX_CORES) {
+        frame_cpus[i].zeroed = FRAME_NIL;
+    }
+
+    kheap_register_shrinker("frame", frame_shrink);
+    ON_DEBUG(KHEAP)(kprintf("[frame] %zu frames, descriptors take %zu KiB\n", page_frame_count, (page_frame_count * sizeof(PageFrame)) / 1024));
+}
+
+////////////////////////////////
+// Buddy lists
+////////////////////////////////
+static void zone_push(FrameZone* zone, uint32_t pfn, int order) {
+    PageFrame* f = &page_frames[pfn];
+    f->flags = FRAME_FREE;
+    f->order = order;
+    f->prev  = FRAME_NIL;
+    f->next  = zone->free[order];
+    if (f->next != FRAME_NIL) {
+        page_frames[f->next].prev = pfn;
+    }
+    zone->free[order] = pfn;
+    zone->free_count[order] += 1;
+}
+
+static void zone_remove(FrameZone* zone, uint32_t pfn, int order) {
+    PageFrame* f = &page_frames[pfn];
+    if (f->prev != FRAME_NIL) {
+        page_frames[f->prev].next = f->next;
+    } else {
+        zone->free[order] = f->next;
+    }
+
+    if (f->next != FRAME_NIL) {
+        page_frames[f->next].prev = f->prev;
+    }
+    f->flags = 0;
+    zone->free_count[order] -= 1;
+}
+
+// splits the smallest free block which fits, the upper halves go back
+// into the lists.
+static uint32_t zone_alloc(FrameZone* zone, int order) {
+    int o = order;
+    while (o <= FRAME_SEGMENT_ORDER && zone->free[o] == FRAME_NIL) {
+        o++;
+    }
+
+    if (o > FRAME_SEGMENT_ORDER) {
+        return FRAME_NIL;
+    }
+
+    uint32_t pfn = zone->free[o];
+    zone_remove(zone, pfn, o);
+    while (o > order) {
+        o -= 1;
+        zone_push(zone, pfn + (1u << o), o);
+    }
+    return pfn;
+}
+
+// merges with the buddies as far as we can, if the whole segment's free and
+// we've got enough spares we return it so the caller can give it back to the
+// heap (once it's let go of the lock).
+static void* zone_free(FrameZone* zone, uint32_t pfn, int order) {
+    while (order < FRAME_SEGMENT_ORDER) {
+        uint32_t buddy = pfn ^ (1u << order);
+        PageFrame* b = &page_frames[buddy];
+        if (!(b->flags & FRAME_FREE) || b->order != order) {
+            break;
+        }
+
+        zone_remove(zone, buddy, order);
+        pfn &= ~(1u << order);
+        order += 1;
+    }
+
+    if (order == FRAME_SEGMENT_ORDER && zone->free_count[order] >= FRAME_ZONE_SPARE) {
+        page_frames[pfn].flags = 0;
+        return frame_kaddr(pfn);
+    }
+
+    zone_push(zone, pfn, order);
+    return NULL;
+}
+
+// pulls a fresh segment out of the heap, it goes to the zone of whichever
+// node it came from (the heap already tries ours first).
+static FrameZone* zone_grow(void) {
+    void* seg = kheap_alloc_segments(1);
+    if (seg == NULL) {
+        return NULL;
+    }
+
+    int node = kheap_segment_node(seg);
+    uint32_t pfn = frame_pfn(seg);
+    FOR_N(i, 0, FRAME_SEGMENT_PAGES) {
+        page_frames[pfn + i].node = node;
+    }
+
+    FrameZone* zone = &frame_zones[node];
+    spin_lock(&zone->lock);
+    zone_push(zone, pfn, FRAME_SEGMENT_ORDER);
+    spin_unlock(&zone->lock);
+    return zone;
+}
+
+// the heap's out of segments, go look at what the other nodes have left
+static uint32_t zone_alloc_any(int order, FrameZone** out_zone) {
+    FOR_N(i, 0, boot_info->numa_node_count) {
+        FrameZone* zone = &frame_zones[i];
+        spin_lock(&zone->lock);
+        uint32_t pfn = zone_alloc(zone, order);
+        spin_unlock(&zone->lock);
+
+        if (pfn != FRAME_NIL) {
+            *out_zone = zone;
+            return pfn;
+        }
+    }
+    return FRAME_NIL;
+}
+
+static FrameZone* local_zone(void) {
+    return &frame_zones[boot_info->cores[cpu_get_index()].numa_node];
+}
+
+static uint32_t frame_alloc_block(int order) {
+    FrameZone* zone = local_zone();
+    for (;;) {
+        spin_lock(&zone->lock);
+        uint32_t pfn = zone_alloc(zone, order);
+        spin_unlock(&zone->lock);
+
+        if (pfn != FRAME_NIL) {
+            return pfn;
+        }
+
+        zone = zone_grow();
+        if (zone == NULL) {
+            return zone_alloc_any(order, &zone);
+        }
+    }
+}
+
+// true if it managed to give a whole segment back to the heap
+static bool frame_release(uint32_t pfn, int order) {
+    FrameZone* zone = &frame_zones[page_frames[pfn].node];
+    spin_lock(&zone->lock);
+    void* seg = zone_free(zone, pfn, order);
+    spin_unlock(&zone->lock);
+
+    if (seg != NULL) {
+        kheap_free_segments(seg, 1);
+        return true;
+    }
+    return false;
+}
+
+////////////////////////////////
+// Per-core cache
+////////////////////////////////
+static void cache_push_hot(FrameCPU* cpu, uint32_t pfn) {
+    cpu->frames[(cpu->head + cpu->count) & (FRAME_CACHE_SIZE - 1)] = pfn;
+    cpu->count += 1;
+}
+
+static void cache_push_cold(FrameCPU* cpu, uint32_t pfn) {
+    cpu->head = (cpu->head - 1) & (FRAME_CACHE_SIZE - 1);
+    cpu->frames[cpu->head] = pfn;
+    cpu->count += 1;
+}
+
+static uint32_t cache_pop_hot(FrameCPU* cpu) {
+    cpu->count -= 1;
+    return cpu->frames[(cpu->head + cpu->count) & (FRAME_CACHE_SIZE - 1)];
+}
+
+static uint32_t cache_pop_cold(FrameCPU* cpu) {
+    uint32_t pfn = cpu->frames[cpu->head];
+    cpu->head = (cpu->head + 1) & (FRAME_CACHE_SIZE - 1);
+    cpu->count -= 1;
+    return pfn;
+}
+
+static bool cache_refill(FrameCPU* cpu) {
+    FrameZone* zone = local_zone();
+    for (;;) {
+        spin_lock(&zone->lock);
+        while (cpu->count < FRAME_CACHE_BATCH) {
+            uint32_t pfn = zone_alloc(zone, 0);
+            if (pfn == FRAME_NIL) {
+                break;
+            }
+
+            page_frames[pfn].flags = FRAME_CACHED;
+            cache_push_hot(cpu, pfn);
+        }
+        spin_unlock(&zone->lock);
+
+        if (cpu->count > 0) {
+            return true;
+        }
+
+        zone = zone_grow();
+        if (zone == NULL) {
+            uint32_t pfn = zone_alloc_any(0, &zone);
+            if (pfn == FRAME_NIL) {
+                return false;
+            }
+
+            page_frames[pfn].flags = FRAME_CACHED;
+            cache_push_hot(cpu, pfn);
+            return true;
+        }
+    }
+}
+
+// hands the cold end of the cache back to the buddy lists
+static void cache_drain(FrameCPU* cpu) {
+    void* release[FRAME_CACHE_BATCH];
+    size_t release_count = 0;
+
+    FrameZone* zone = NULL;
+    FOR_N(i, 0, FRAME_CACHE_BATCH) {
+        uint32_t pfn = cache_pop_cold(cpu);
+
+        // these are almost always from the same zone, no need to keep
+        // bouncing the lock.
+        FrameZone* z = &frame_zones[page_frames[pfn].node];
+        if (z != zone) {
+            if (zone) { spin_unlock(&zone->lock); }
+            zone = z;
+            spin_lock(&zone->lock);
+        }
+
+        void* seg = zone_free(zone, pfn, 0);
+        if (seg != NULL) {
+            release[release_count++] = seg;
+        }
+    }
+    spin_unlock(&zone->lock);
+
+    FOR_N(i, 0, release_count) {
+        kheap_free_segments(release[i], 1);
+    }
+}
+
+static uint32_t zeroed_pop(FrameCPU* cpu) {
+    uint32_t pfn = cpu->zeroed;
+    cpu->zeroed = page_frames[pfn].next;
+    cpu->zeroed_count -= 1;
+    return pfn;
+}
+
+////////////////////////////////
+// Frame API
+////////////////////////////////
+void* frame_alloc(int order, uint32_t flags) {
+    kassert(order >= 0 && order <= FRAME_MAX_ORDER, "bad frame order %d", order);
+
+    uint32_t pfn;
+    bool is_zeroed = false;
+    if (order > FRAME_SEGMENT_ORDER) {
+        void* ptr = kheap_alloc_segments(1ull << (order - FRAME_SEGMENT_ORDER));
+        if (ptr == NULL) {
+            return NULL;
+        }
+
+        pfn = frame_pfn(ptr);
+        page_frames[pfn].node = kheap_segment_node(ptr);
+    } else if (order == 0) {
+        FrameCPU* cpu = &frame_cpus[cpu_get_index()];
+        if ((flags & FRAME_ZERO) && cpu->zeroed != FRAME_NIL) {
+            pfn = zeroed_pop(cpu);
+            is_zeroed = true;
+        } else if (cpu->count > 0 || cache_refill(cpu)) {
+            pfn = flags & FRAME_COLD ? cache_pop_cold(cpu) : cache_pop_hot(cpu);
+        } else if (cpu->zeroed != FRAME_NIL) {
+            // last resort, the idle loop was sitting on some
+            pfn = zeroed_pop(cpu);
+            is_zeroed = true;
+        } else {
+            return NULL;
+        }
+    } else {
+        pfn = frame_alloc_block(order);
+        if (pfn == FRAME_NIL) {
+            return NULL;
+        }
+    }
+
+    PageFrame* f = &page_frames[pfn];
+    f->flags = FRAME_ALLOCATED | (flags & (FRAME_USER | FRAME_PAGE_TABLE));
+    f->order = order;
+    atomic_store_explicit(&f->refs, 1, memory_order_relaxed);
+
+    void* ptr = frame_kaddr(pfn);
+    if ((flags & FRAME_ZERO) && !is_zeroed) {
+        FOR_N(i, 0, 1ull << order) {
+            arch_zero_page((char*) ptr + i*PAGE_SIZE);
+        }
+    }
+    return ptr;
+}
+
+void frame_free(void* ptr, uint32_t flags) {
+    uint32_t pfn = frame_pfn(ptr);
+    PageFrame* f = &page_frames[pfn];
+    kassert(f->flags & FRAME_ALLOCATED, "freeing a frame which isn't allocated (%p)", ptr);
+    kassert(atomic_load_explicit(&f->refs, memory_order_relaxed) <= 1, "freeing a frame which is still shared (%p)", ptr);
+
+    int order = f->order;
+    f->flags = 0;
+    if (order > FRAME_SEGMENT_ORDER) {
+        kheap_free_segments(ptr, 1ull << (order - FRAME_SEGMENT_ORDER));
+        return;
+    }
+
+    // frames from some other node go straight back to their zone, we'd
+    // only end up handing them out locally again.
+    int core_id = cpu_get_index();
+    if (order == 0 && f->node == boot_info->cores[core_id].numa_node) {
+        FrameCPU* cpu = &frame_cpus[core_id];
+        if (cpu->count == FRAME_CACHE_SIZE) {
+            cache_drain(cpu);
+        }
+
+        f->flags = FRAME_CACHED;
+        if (flags & FRAME_COLD) {
+            cache_push_cold(cpu, pfn);
+        } else {
+            cache_push_hot(cpu, pfn);
+        }
+        return;
+    }
+
+    frame_release(pfn, order);
+}
+
+void frame_donate(void* ptr, size_t count) {
+    uint32_t pfn = frame_pfn(ptr);
+    uint32_t end = pfn + count;
+    while (pfn < end) {
+        int order = 0;
+        while (order < FRAME_SEGMENT_ORDER && (pfn & ((2u << order) - 1)) == 0 && pfn + (2u << order) <= end) {
+            order += 1;
+        }
+
+        // blocks never cross a segment so they're all on one node
+        int node = kheap_segment_node(frame_kaddr(pfn));
+        FOR_N(i, 0, 1u << order) {
+            page_frames[pfn + i].node = node;
+        }
+        frame_release(pfn, order);
+        pfn += 1u << order;
+    }
+}
+
+// The heap's out of segments, we give back our cached & pre-zeroed frames then
+// every fully free segment the zones were keeping as spares.
+static size_t frame_shrink(void) {
+    const size_t seg_size = FRAME_SEGMENT_PAGES * PAGE_SIZE;
+
+    size_t freed = 0;
+    FrameCPU* cpu = &frame_cpus[cpu_get_index()];
+    while (cpu->zeroed != FRAME_NIL) {
+        freed += frame_release(zeroed_pop(cpu), 0) ? seg_size : 0;
+    }
+
+    while (cpu->count > 0) {
+        freed += frame_release(cache_pop_cold(cpu), 0) ? seg_size : 0;
+    }
+
+    FOR_N(i, 0, boot_info->numa_node_count) {
+        FrameZone* zone = &frame_zones[i];
+        for (;;) {
+            spin_lock(&zone->lock);
+            uint32_t pfn = zone->free[FRAME_SEGMENT_ORDER];
+            if (pfn != FRAME_NIL) {
+                zone_remove(zone, pfn, FRAME_SEGMENT_ORDER);
+            }
+            spin_unlock(&zone->lock);
+
+            if (pfn == FRAME_NIL) {
+                break;
+            }
+
+            kheap_free_segments(frame_kaddr(pfn), 1);
+            freed += seg_size;
+        }
+    }
+
+    ON_DEBUG(KHEAP)(kprintf("[frame] shrink gave back %zu KiB\n", freed / 1024));
+    return freed;
+}
+
+void frame_ref(void* ptr) {
+    atomic_fetch_add_explicit(&frame_desc(ptr)->refs, 1, memory_order_relaxed);
+}
+
+void frame_unref(void* ptr) {
+    if (atomic_fetch_sub_explicit(&frame_desc(ptr)->refs, 1, memory_order_acq_rel) == 1) {
+        frame_free(ptr, 0);
+    }
+}
+
+void frame_split(void* ptr) {
+    uint32_t pfn = frame_pfn(ptr);
+    PageFrame* f = &page_frames[pfn];
+    kassert(f->flags & FRAME_ALLOCATED, "splitting a frame which isn't allocated (%p)", ptr);
+
+    // the node was filled in for every frame back when a single segment came
+    // in, runs only did the first one. once the frames are split up they go
+    // back through the zones, whole segments get back to the heap from there.
+    int order = f->order;
+    if (order > FRAME_SEGMENT_ORDER) {
+        kheap_split_segments(ptr, 1ull << (order - FRAME_SEGMENT_ORDER));
+        for (size_t i = 0; i < (1ull << order); i += FRAME_SEGMENT_PAGES) {
+            int node = kheap_segment_node(frame_kaddr(pfn + i));
+            FOR_N(j, 0, FRAME_SEGMENT_PAGES) {
+                page_frames[pfn + i + j].node = node;
+            }
+        }
+    }
+
+    FOR_N(i, 0, 1ull << order) {
+        PageFrame* sub = &page_frames[pfn + i];
+        sub->flags = f->flags;
+        sub->order = 0;
+        atomic_store_explicit(&sub->refs, 1, memory_order_relaxed);
+    }
+}
+
+// Zeroes the cold end of our cache ahead of time, called from the idle loop
+// with interrupts on. Same deal as kheap_idle, we only hold them off for a
+// page at a time.
+void frame_idle(void) {
+    FrameCPU* cpu = &frame_cpus[cpu_get_index()];
+    for (;;) {
+        bool irq = arch_irq_save();
+        if (cpu->count == 0 || cpu->zeroed_count >= FRAME_ZEROED_MAX) {
+            arch_irq_restore(irq);
+            break;
+        }
+
+        uint32_t pfn = cache_pop_cold(cpu);
+        arch_zero_page_nt(frame_kaddr(pfn));
+
+        page_frames[pfn].next = cpu->zeroed;
+        cpu->zeroed = pfn;
+        cpu->zeroed_count += 1;
+        arch_irq_restore(irq);
+    }
+}
@@ -19,6 +19,9 @@ uint32_t handles_hash(const void* k) {
 #define NBHM_FN(n) handles_ ## n
 #include <nbhm.h>
 
+static KCache vmo_cache   = KCACHE_INIT("vmo", KObject_VMO, NULL);
+static KCache event_cache = KCACHE_INIT("event", KObject_Event, NULL);
+
 const char* kobject_name(KObject* obj) {
     switch (obj->tag) {
         case KOBJECT_ENV:     return "ENV";
@@ -34,43 +37,122 @@ const char* kobject_name(KObject* obj) {
 KObject_VMO* vmo_create_physical(uintptr_t addr, size_t size, VMem_Flags flags) {
     kassert((addr & (PAGE_SIZE-1)) == 0, "must be page-aligned (%d)", addr);
 
-    KObject_VMO* obj = kheap_zalloc(sizeof(KObject_VMO));
+    KObject_VMO* obj = kcache_zalloc(&vmo_cache);
+    if (obj == NULL) {
+        return NULL;
+    }
+
     obj->super.tag = KOBJECT_VMO;
+    obj->refs = 1;
     obj->size = (size + PAGE_SIZE - 1) & -PAGE_SIZE;
     obj->paddr = addr;
     obj->flags = flags;
     if (addr == 0) {
-        size_t init_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-        if (init_pages < 4)   { init_pages = 4;   }
-        if (init_pages > 100) { init_pages = 100; }
-
-        obj->pages = nbhm_alloc(init_pages);
+        if (!vmem_ws_init(&obj->pages, obj->size, obj->size > VMEM_WS_DENSE_MAX)) {
+            kcache_free(&vmo_cache, obj);
+            return NULL;
+        }
+    }
+
+    if (STORE_PUT(obj) == 0) {
+        vmem_ws_free(&obj->pages);
+        kcache_free(&vmo_cache, obj);
+        return NULL;
+    }
+    return obj;
+}
+
+KObject_VMO* vmo_clone(KObject_VMO* src, size_t offset, size_t size) {
+    kassert((offset & (PAGE_SIZE-1)) == 0, "must be page-aligned (%d)", offset);
+
+    // the clone doesn't force writable mappings, whoever maps it picks
+    KObject_VMO* obj = vmo_create_physical(0, size, src->flags & ~VMEM_PAGE_WRITE);
+    if (obj == NULL) {
+        return NULL;
+    }
+
+    // we're reading through to its pages, it can't go away before we do
+    vmo_ref(src);
+    obj->parent = src;
+    obj->parent_offset = offset;
+    return obj;
+}
+
+void vmo_ref(KObject_VMO* vmo) {
+    atomic_fetch_add_explicit(&vmo->refs, 1, memory_order_relaxed);
+}
+
+void vmo_unref(KObject_VMO* vmo) {
+    while (vmo != NULL) {
+        if (atomic_fetch_sub_explicit(&vmo->refs, 1, memory_order_acq_rel) != 1) {
+            return;
+        }
+        kassert(atomic_ldrlx(&vmo->mappings) == 0, "freeing a VMO which is still mapped (%p)", vmo);
+
+        store_remove(&vmo->super);
+        if (vmo->paddr == 0) {
+            vmem_vmo_release(vmo);
+            vmem_ws_free(&vmo->pages);
+        }
+
+        if (vmo->pager_free != NULL) {
+            vmo->pager_free(vmo->pager_data);
+        }
+
+        // the clone's ref on its parent goes with it
+        KObject_VMO* parent = vmo->parent;
+        kcache_free(&vmo_cache, vmo);
+        vmo = parent;
     }
-    STORE_PUT(obj);
+}
+
+KObject_VMO* vmo_create_pager(size_t size, VMem_PagerFn* pager, VMem_PagerFreeFn* pager_free, void* pager_data) {
+    KObject_VMO* obj = vmo_create_physical(0, size, 0);
+    if (obj == NULL) {
+        return NULL;
+    }
+
+    obj->pager = pager;
+    obj->pager_free = pager_free;
+    obj->pager_data = pager_data;
     return obj;
 }
 
 KObject_Mailbox* mailbox_create(size_t max_requests) {
     size_t log2 = 63 - __builtin_clzll(max_requests);
     KObject_Mailbox* obj = kheap_zalloc(sizeof(KObject_Mailbox) + max_requests*sizeof(atomic_u64[2]));
+    if (obj == NULL) {
+        return NULL;
+    }
+
     *obj = (KObject_Mailbox){
         .super = {
             .tag = KOBJECT_MAILBOX,
         },
         .cap_log2 = log2
     };
-    STORE_PUT(obj);
+    if (STORE_PUT(obj) == 0) {
+        kheap_free(obj, sizeof(KObject_Mailbox) + max_requests*sizeof(atomic_u64[2]));
+        return NULL;
+    }
     return obj;
 }
 
 KObject_Event* event_create(void) {
-    KObject_Event* obj = kheap_zalloc(sizeof(KObject_Event));
+    KObject_Event* obj = kcache_alloc(&event_cache);
+    if (obj == NULL) {
+        return NULL;
+    }
+
     *obj = (KObject_Event){
         .super = {
             .tag = KOBJECT_EVENT,
         },
     };
-    STORE_PUT(obj);
+    if (STORE_PUT(obj) == 0) {
+        kcache_free(&event_cache, obj);
+        return NULL;
+    }
     return obj;
 }
 
@@ -167,9 +249,12 @@ void* env_get_handle(Env* env, KObjectID id, KAccessRights* out_rights) {
     return obj;
 }
 
+// 0 if the handle table couldn't grow
 KObjectID env_grant_rights(Env* env, KAccessRights rights, KObject* obj) {
     rights |= KACCESS_READ;
-    handles_put(&env->access_rights, (void*) obj->id, (void*) (uintptr_t) ((rights & KACCESS_MASK) + 1));
+    if (handles_put(&env->access_rights, (void*) obj->id, (void*) (uintptr_t) ((rights & KACCESS_MASK) + 1)) == NULL) {
+        return 0;
+    }
     return obj->id;
 }
 
@@ -5,17 +5,56 @@
 // Something we need to account for is the fact that a lot of allocations
 // are movable given we notify whoever is responsible.
 #include <kernel.h>
+#include <beans.h>
 
 enum {
     SMALL_SEGMENT_SIZE = 64*1024,
-    SEGMENT_SIZE = 2*1024*1024
+    SEGMENT_SIZE = 2*1024*1024,
+
+    // kheap_alloc size classes below 4096
+    SMALL_CLASS_COUNT = 23,
+
+    // see kheap_register_shrinker
+    MAX_SHRINKERS = 8,
+
+    // max number of segments we'll take from a neighbor in one go, we'd
+    // rather not come back to their queue for every allocation.
+    SEGMENT_STEAL_BATCH = 8,
+
+    // how many pre-zeroed pages each core keeps around for kheap_alloc_page.
+    ZEROED_POOL_MAX = 64,
+
+    // objects a core holds onto in its kcache magazine before it
+    // starts flushing half of them back to their owners.
+    KCACHE_MAG_SIZE = 16,
+
+    // var_page bins, the first few are exact (1, 2, 3 pages) then every
+    // power of two gets split into 4.
+    VAR_BIN_COUNT = 40,
+    VAR_SEGMENT_PAGES = SEGMENT_SIZE / PAGE_SIZE,
 };
 
+// Chase-Lev deque, the owner pushes & pops from the bottom while
+// other cores steal from the top.
 typedef struct {
-    _Atomic int64_t bot;
+    _Alignas(64) _Atomic int64_t bot;
     _Atomic int64_t top;
     _Atomic(void*)* data;
+
+    // other cores sorted by distance (closest first), this
+    // is the order we go stealing in.
+    uint16_t* victims;
 } SegmentPool;
+
+// segments which got freed by a core on some other NUMA node, they wait here
+// for a core on their own node to come looking. nodes without any cores
+// keep all their memory in here.
+typedef struct {
+    Lock lock;
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    void** data;
+} NodePool;
 
 typedef struct HeapBlock HeapBlock;
 struct HeapBlock {
@@ -27,44 +66,240 @@ struct HeapBlock {
 typedef struct HeapFreeList HeapFreeList;
 struct HeapFreeList {
     uint32_t thread_id;
+
+    // blocks are carved out of granules (64KiB chunks or whole segments),
+    // once all of a granule's blocks are free we can hand it back.
+    uint32_t granule;
+    uint32_t block_size;
+
+    // bytes handed out & bytes carved into the list (free or not), these
+    // don't include what's sitting in thread_free.
     uint64_t used;
+    uint64_t owned;
+    // we don't go looking for empty granules until this much is free.
+    uint64_t sweep_at;
 
     HeapBlock* free;       // List we allocate from.
     HeapBlock* local_free; // List holding new free allocs.
 
     // List holding new free allocs from other threads
     _Atomic(HeapBlock*) thread_free;
-    atomic_u64 thread_freed;
 };
 
+// free run of pages in a var_page segment, the page count is also written
+// into the last 8 bytes of the run so the block after us can find our start.
+typedef struct VarBlock VarBlock;
+struct VarBlock {
+    VarBlock* next;
+    VarBlock* prev;
+    size_t pages;
+};
+
+// variable sized allocs (4KiB - 2MiB), segregated fit where neighboring free
+// runs in the same segment get coalesced as soon as they're freed.
+typedef struct {
+    uint32_t thread_id;
+
+    // bytes handed out & bytes in var segments we hold
+    uint64_t used;
+    uint64_t owned;
+
+    // bit i is set if bins[i] isn't empty
+    uint64_t bin_mask;
+    VarBlock* bins[VAR_BIN_COUNT];
+
+    // frees from other cores, these are plain HeapBlocks until the
+    // owner gets to them.
+    _Atomic(HeapBlock*) thread_free;
+} HeapVarList;
+
+// telemetry, only ever touched by the core the Heap belongs to. frees get
+// counted by whoever did the free, not the owner.
+typedef struct {
+    uint64_t allocs, frees;
+    uint64_t remote_frees;
+    int64_t wasted;
+} HeapCounters;
+
 struct Heap {
-    // max alloc size of 4096 => 64, 128, 256, 512, 1024, 2048, 4096.
-    //   these are sub-allocations from page_64K alloc.
-    HeapFreeList page_classes[7];
+    // max alloc size of 4096 => 16, 32, 48, 64, 128, 192 ... 4096 (see
+    //   small_class_sizes). these are sub-allocations from page_64K alloc.
+    HeapFreeList page_classes[SMALL_CLASS_COUNT];
 
-    // variable size, not really interested in fragmentation
-    HeapFreeList var_page;
     // small size pages use this to grab segments
     HeapFreeList page_64K;
     // used by page allocator
     HeapFreeList fixed_page;
+
+    // variable size
+    HeapVarList var_page;
+
+    // pages from fixed_page which the idle loop zeroed ahead of time, these
+    // still count as used as far as fixed_page is concerned.
+    HeapBlock* zeroed;
+    uint32_t zeroed_count;
+    uint64_t zeroed_hits;
+    uint64_t zeroed_misses;
+
+    // we're in the middle of kheap_reclaim, an alloc from inside one of the
+    // shrinkers shouldn't go around again.
+    bool reclaiming;
+
+    HeapCounters counters[HEAP_STATS_CLASSES];
+};
+
+// the free lists line up with the stats classes
+_Static_assert(offsetof(Heap, page_64K) / sizeof(HeapFreeList) == HEAP_STATS_64K, "stats classes don't match the heap");
+_Static_assert(offsetof(Heap, fixed_page) / sizeof(HeapFreeList) == HEAP_STATS_PAGE, "stats classes don't match the heap");
+
+// per-core slab cache state
+struct KCacheCPU {
+    // blocks carved out of this core's 64KiB chunks
+    HeapFreeList list;
+
+    // recently freed objects (from any owner), we hand these out before
+    // going to the list.
+    uint32_t mag_count;
+    void* mag[KCACHE_MAG_SIZE];
 };
 
+enum {
+    // not memory we hand out
+    SEGMENT_NONE,
+    // free, there's at least one pool entry pointing to it
+    SEGMENT_POOLED,
+    // popped from a pool & given to a heap
+    SEGMENT_OWNED,
+    // part of a multi-segment allocation
+    SEGMENT_SPAN,
+};
+
+// one per 2MiB of physical memory
+typedef struct {
+    // NULL while the segment is sitting in a pool
+    Heap* heap;
+
+    // spans grab free segments straight from the map without going through
+    // the pools, so whoever pops an entry has to win the POOLED -> OWNED
+    // race before using it. stale entries are just dropped, queued counts
+    // how many are still out there so we don't keep piling more on.
+    _Atomic uint32_t state;
+    _Atomic uint32_t queued;
+    // number of segments in the span, only set on the first one
+    uint32_t span_len;
+    // NUMA node the memory sits on
+    uint32_t node;
+
+    // scratch space for fl_sweep, free bytes per granule. these are
+    // always back to zero once the sweep is done.
+    int32_t swept;
+    int32_t small_swept[SEGMENT_SIZE / SMALL_SEGMENT_SIZE];
+
+    // var_page segments mark the first & last page of every free run here,
+    // that's enough to tell if our neighbors are free when coalescing.
+    uint64_t var_edges[VAR_SEGMENT_PAGES / 64];
+
+    #if DEBUG_HEAPPROF
+    // objects the profiler is tracking in here, frees only have to go
+    // ask it if this isn't zero.
+    _Atomic uint32_t sampled;
+    #endif
+} HeapSegment;
+
+// below 64 we only promise 16 byte alignment (same as HeapBlock's size), past
+// that every class is a multiple of 64 so the _Alignas(64) objects stay happy.
+// each power of two gets split into 4 which keeps the rounding waste under 25%
+// instead of the ~50% we'd get from plain powers of two.
+static const uint16_t small_class_sizes[SMALL_CLASS_COUNT] = {
+    16,   32,   48,   64,
+    128,  192,  256,
+    320,  384,  448,  512,
+    640,  768,  896,  1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+};
+
+// indexed by (obj_size + 15) / 16, obj_size < 4096
+static const uint8_t small_class_lookup[257] = {
+     0,  0,  1,  2,  3,  4,  4,  4,  4,  5,  5,  5,  5,  6,  6,  6,
+     6,  7,  7,  7,  7,  8,  8,  8,  8,  9,  9,  9,  9, 10, 10, 10,
+    10, 11, 11, 11, 11, 11, 11, 11, 11, 12, 12, 12, 12, 12, 12, 12,
+    12, 13, 13, 13, 13, 13, 13, 13, 13, 14, 14, 14, 14, 14, 14, 14,
+    14, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    16, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+    17, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18,
+    18, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19,
+    19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19,
+    19, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
+    20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
+    20, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+    21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+    21, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22,
+    22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22,
+    22,
+};
+
 static int heap_size_class(size_t obj_size) {
-    if (obj_size < 64) {
-        return 0;
-    }
-    return 64 - __builtin_clzll((obj_size - 1) / 64);
+    return small_class_lookup[(obj_size + 15) / 16];
 }
 
 static uint64_t segment_pool_mask;
+static size_t segment_pool_count = 1;
 static SegmentPool segment_pools[MAX_CORES];
 
 static Heap local_heaps[MAX_CORES];
 
+static size_t numa_node_count = 1;
+static NodePool node_pools[MAX_NUMA_NODES];
+// other nodes sorted by distance (closest first, starting with ourselves)
+static uint8_t numa_order[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
 static size_t segment_map_len;
-static Heap** segment_map;
+static HeapSegment* segment_map;
+
+// what kheap_init carved out of the memory map for the first pool & the
+// segment map, kheap_release_boot has to step over them.
+static struct { uintptr_t base, end; } heap_carved[2];
+
+// only one core gets to look for spans at a time
+static Lock span_lock;
+
+static HeapSegment* heap_segment(void* obj) {
+    uintptr_t index = kaddr2paddr(obj) / SEGMENT_SIZE;
+    kassert(index < segment_map_len, "we're trying to free an invalid object, %p (index=%d, limit=%d)", obj, index, segment_map_len);
+    return &segment_map[index];
+}
+
+static void heap_init_lists(Heap* heap, int core_id) {
+    FOR_N(i, 0, ELEM_COUNT(heap->page_classes)) {
+        heap->page_classes[i].granule    = SMALL_SEGMENT_SIZE;
+        heap->page_classes[i].block_size = small_class_sizes[i];
+    }
+
+    heap->page_64K.granule      = SEGMENT_SIZE;
+    heap->page_64K.block_size   = SMALL_SEGMENT_SIZE;
+    heap->fixed_page.granule    = SEGMENT_SIZE;
+    heap->fixed_page.block_size = PAGE_SIZE;
+
+    HeapFreeList* lists = (HeapFreeList*) heap;
+    FOR_N(i, 0, offsetof(Heap, fixed_page) / sizeof(HeapFreeList) + 1) {
+        lists[i].thread_id = core_id;
+        // we keep a couple of empty granules around before bothering to
+        // return any, else a single alloc+free on the edge would ping-pong
+        // the segment between us and the pool.
+        lists[i].sweep_at  = 2*lists[i].granule;
+    }
+
+    heap->var_page.thread_id = core_id;
+}
 
+// loader & boot services memory, we can't touch it until the kernel's done
+// with boot_info but the segment map still has to cover it.
+static bool boot_region(MemRegion* region) {
+    return region->type == MEM_REGION_BOOT || region->type == MEM_REGION_UEFI_BOOT;
+}
+
 void kheap_init(MemMap* mem_map) {
     int core_id = cpu_get_index();
     kassert(core_id == 0, "Just kinda assumed alright!");
@@ -73,16 +308,21 @@ void kheap_init(MemMap* mem_map) {
     uintptr_t highest_addr = 0;
     FOR_N(i, 0, mem_map->nregions) {
         MemRegion* region = &mem_map->regions[i];
-        if (region->type != MEM_REGION_USABLE || region->base < 0x100000) {
+        if ((region->type != MEM_REGION_USABLE && !boot_region(region)) || region->base < 0x100000) {
             continue;
         }
 
-        uintptr_t end  = (region->base + region->pages*PAGE_SIZE) & -SEGMENT_SIZE;
+        // the unaligned tails become frames later, they need descriptors too
+        uintptr_t end  = region->base + region->pages*PAGE_SIZE;
         if (end > highest_addr) {
             highest_addr = end;
         }
 
-        total_chunks += region->pages / (SEGMENT_SIZE / PAGE_SIZE);
+        // a region can't hold more aligned segments than this, the extra one
+        // is for the tails. kheap_release_boot hands those to frame_donate and
+        // the buddy merging there can put the tails of two neighboring regions
+        // back together into a whole segment, which comes to our pool.
+        total_chunks += region->pages / (SEGMENT_SIZE / PAGE_SIZE) + 1;
     }
     segment_map_len = (highest_addr + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
 
@@ -95,7 +335,7 @@ void kheap_init(MemMap* mem_map) {
 
     _Atomic(void*)* queue_arr = NULL;
     size_t queue_cnt = 0;
-    size_t segment_map_size = segment_map_len*sizeof(Heap*);
+    size_t segment_map_size = segment_map_len*sizeof(HeapSegment);
     FOR_N(i, 0, mem_map->nregions) {
         MemRegion* restrict region = &mem_map->regions[i];
         if (region->type != MEM_REGION_USABLE || region->base < 0x100000) {
@@ -111,6 +351,8 @@ void kheap_init(MemMap* mem_map) {
             queue_arr = paddr2kaddr(base);
 
             segment_pools[0].data = queue_arr;
+            heap_carved[0].base = base;
+            heap_carved[0].end  = base + queue_size;
             base += queue_size;
         }
 
@@ -119,6 +361,9 @@ void kheap_init(MemMap* mem_map) {
             ON_DEBUG(KHEAP)(kprintf("[heap] Allocated segment map @ %p (%#zx bytes)\n", base, segment_map_size));
 
             segment_map = paddr2kaddr(base);
+            memset(segment_map, 0, segment_map_size);
+            heap_carved[1].base = base;
+            heap_carved[1].end  = base + segment_map_size;
             base += segment_map_size;
         }
 
@@ -138,59 +383,179 @@ void kheap_init(MemMap* mem_map) {
         }
     }
 
-    ON_DEBUG(KHEAP)(kprintf("Total waste: %zu bytes (%zu KiB)\n", total_waste, (total_waste + 512) / 1024));
+    ON_DEBUG(KHEAP)(kprintf("Total waste: %zu bytes (%zu KiB), frames get it after boot\n", total_waste, (total_waste + 512) / 1024));
+    FOR_N(i, 0, queue_cnt) {
+        HeapSegment* seg = &segment_map[kaddr2paddr(atomic_ldrlx(&queue_arr[i])) / SEGMENT_SIZE];
+        atomic_strlx(&seg->state, SEGMENT_POOLED);
+        atomic_strlx(&seg->queued, 1);
+    }
+
+    heap_init_lists(&local_heaps[0], 0);
     atomic_strlx(&segment_pools[0].bot, queue_cnt);
     atomic_thread_fence(memory_order_release);
 }
 
+// we don't get told the cache topology directly but APIC IDs are handed out
+// hierarchically (SMT siblings, then cores on the same die, then packages) so
+// the highest bit which differs between two IDs is a decent distance metric.
+// cores on different NUMA nodes are always further than that, we just go by
+// the SLIT distance between them.
+static int core_distance(int a, int b) {
+    u32 node_a = boot_info->cores[a].numa_node;
+    u32 node_b = boot_info->cores[b].numa_node;
+    if (node_a != node_b) {
+        return 32 + boot_info->numa_distance[node_a][node_b];
+    }
+
+    uint32_t x = boot_info->cores[a].lapic_id ^ boot_info->cores[b].lapic_id;
+    return x ? 32 - __builtin_clz(x) : 0;
+}
+
+static void compute_numa_order(void) {
+    FOR_N(a, 0, numa_node_count) {
+        uint8_t* order = numa_order[a];
+        FOR_N(b, 0, numa_node_count) {
+            int dist = boot_info->numa_distance[a][b];
+
+            size_t j = b;
+            for (; j > 0 && boot_info->numa_distance[a][order[j - 1]] > dist; j--) {
+                order[j] = order[j - 1];
+            }
+            order[j] = b;
+        }
+    }
+}
+
+static void compute_victims(int core_id, size_t num_cores) {
+    uint16_t* victims = kheap_alloc((num_cores - 1) * sizeof(uint16_t));
+
+    // start from our right neighbor so cores at the same distance don't
+    // all hammer the same victim first.
+    size_t n = 0;
+    FOR_N(i, 1, num_cores) {
+        int other = (core_id + i) % num_cores;
+        int dist  = core_distance(core_id, other);
+
+        // insertion sort, it's a one time thing
+        size_t j = n++;
+        for (; j > 0 && core_distance(core_id, victims[j - 1]) > dist; j--) {
+            victims[j] = victims[j - 1];
+        }
+        victims[j] = other;
+    }
+    segment_pools[core_id].victims = victims;
+}
+
 void kheap_multicore(size_t num_cores) {
     int core_id = cpu_get_index();
     kassert(core_id == 0, "Just kinda assumed alright!");
 
-    int64_t b = atomic_ldacq(&segment_pools[0].bot);
-    int64_t t = atomic_ldacq(&segment_pools[0].top);
-
-    int per_core = (b - t) / num_cores;
+    size_t node_count = boot_info->numa_node_count ? boot_info->numa_node_count : 1;
     size_t queue_size = (segment_pool_mask + 1) * sizeof(void*);
 
-    uint64_t mask = segment_pool_mask;
+    // grab all the queues before we start shuffling pool 0 around
     FOR_N(i, 1, num_cores) {
-        _Atomic(void*)* queue_arr = kheap_alloc(queue_size);
-        FOR_N(j, 0, per_core) {
-            void* ptr = atomic_ldrlx(&segment_pools[0].data[t & mask]);
-            atomic_strlx(&queue_arr[j], ptr);
-            t = (t + 1) & mask;
+        segment_pools[i].data = kheap_alloc(queue_size);
+    }
+
+    if (node_count > 1) {
+        FOR_N(i, 0, node_count) {
+            node_pools[i].data = kheap_alloc(queue_size);
+        }
+
+        // tag every segment with its node, only the ones the range covers
+        // completely. anything the SRAT didn't mention stays on node 0.
+        FOR_N(i, 0, boot_info->numa_range_count) {
+            NumaRange* r = &boot_info->numa_ranges[i];
+            size_t first = (r->base + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+            size_t last  = (r->base + r->size) / SEGMENT_SIZE;
+            if (last > segment_map_len) {
+                last = segment_map_len;
+            }
+
+            for (size_t j = first; j < last; j++) {
+                segment_map[j].node = r->node;
+            }
         }
-        segment_pools[i].data = queue_arr;
-        atomic_strlx(&segment_pools[i].bot, per_core);
     }
-    ON_DEBUG(KHEAP)(kprintf("[heap] Core0 remaining %zu, Per-Core %zu\n", b - t, per_core));
 
-    atomic_strlx(&segment_pools[0].top, t);
-    atomic_thread_fence(memory_order_seq_cst);
+    // group the cores by node, counting sort
+    uint16_t node_cores[MAX_CORES];
+    size_t node_start[MAX_NUMA_NODES + 1] = { 0 };
+    size_t node_cursor[MAX_NUMA_NODES] = { 0 };
+    FOR_N(i, 0, num_cores) {
+        node_start[boot_info->cores[i].numa_node + 1] += 1;
+    }
+    FOR_N(i, 0, node_count) {
+        node_start[i + 1] += node_start[i];
+    }
+    FOR_N(i, 0, num_cores) {
+        u32 node = boot_info->cores[i].numa_node;
+        node_cores[node_start[node] + node_cursor[node]++] = i;
+    }
+
+    // deal out the segments round-robin between the cores on their node,
+    // core 0's share gets compacted in place since we only ever write
+    // behind the read cursor.
+    int64_t b = atomic_ldacq(&segment_pools[0].bot);
+    int64_t t = atomic_ldacq(&segment_pools[0].top);
+
+    uint64_t mask = segment_pool_mask;
+    int64_t given[MAX_CORES] = { 0 };
+    given[0] = t;
+    FOR_N(i, 0, node_count) {
+        node_cursor[i] = 0;
+    }
+
+    for (int64_t i = t; i != b; i++) {
+        void* ptr = atomic_ldrlx(&segment_pools[0].data[i & mask]);
+        u32 node  = heap_segment(ptr)->node;
+
+        size_t core_count = node_start[node + 1] - node_start[node];
+        if (core_count == 0) {
+            // memory-only node, it'll just get stolen from by distance
+            NodePool* pool = &node_pools[node];
+            pool->data[atomic_ldrlx(&pool->tail) & mask] = ptr;
+            atomic_strlx(&pool->tail, atomic_ldrlx(&pool->tail) + 1);
+            continue;
+        }
+
+        int core = node_cores[node_start[node] + (node_cursor[node]++ % core_count)];
+        atomic_strlx(&segment_pools[core].data[given[core] & mask], ptr);
+        given[core] += 1;
+    }
 
-    // local heaps need to know where they belong, used for cross-core freeing
     FOR_N(i, 0, num_cores) {
-        FOR_N(j, 0, ELEM_COUNT(local_heaps[i].page_classes)) {
-            local_heaps[i].page_classes[j].thread_id = i;
+        atomic_strlx(&segment_pools[i].bot, given[i]);
+        ON_DEBUG(KHEAP)(kprintf("[heap] Core%d: node %d, %zu segments\n", i, boot_info->cores[i].numa_node, given[i] - (i ? 0 : t)));
+    }
+
+    numa_node_count = node_count;
+    compute_numa_order();
+
+    if (num_cores > 1) {
+        FOR_N(i, 0, num_cores) {
+            compute_victims(i, num_cores);
         }
+    }
+    segment_pool_count = num_cores;
+    atomic_thread_fence(memory_order_seq_cst);
 
-        local_heaps[i].var_page.thread_id = i;
-        local_heaps[i].page_64K.thread_id = i;
+    // local heaps need to know where they belong, used for cross-core freeing
+    FOR_N(i, 1, num_cores) {
+        heap_init_lists(&local_heaps[i], i);
     }
 }
 
-// TODO(NeGate): when this function fails, it should look at its
-// neighbors (in an ordering favorable to the cache topology) and
-// try to steal memory.
-static void* alloc_segment(void) {
-    int core_id = cpu_get_index();
-    SegmentPool* pool = &segment_pools[core_id];
-
+static void* pop_segment(SegmentPool* pool) {
     // pop from local queue
     int64_t bot = atomic_ldacq(&pool->bot) - 1;
     atomic_strlx(&pool->bot, bot);
 
+    // the bot store must be visible before we read top, else a thief
+    // might grab the same entry we're about to take.
+    atomic_thread_fence(memory_order_seq_cst);
+
     int64_t top = atomic_ldrlx(&pool->top);
     if (top <= bot) {
         // queue isn't empty
@@ -208,240 +573,1338 @@ static void* alloc_segment(void) {
     }
 }
 
-static void free_segment(void* ptr) {
-    int core_id = cpu_get_index();
-    SegmentPool* pool = &segment_pools[core_id];
-
+static void push_segment(SegmentPool* pool, void* ptr) {
     // push to local queue
     int64_t b = atomic_ldacq(&pool->bot);
     atomic_strlx(&pool->data[b & segment_pool_mask], ptr);
     atomic_thread_fence(memory_order_release);
     atomic_strlx(&pool->bot, b + 1);
 }
-
-// every block in this page is capable of holding the alloc
-static void* fl_alloc_exact(HeapFreeList* list) {
-    HeapBlock* block = list->free;
-    if (block == NULL) {
-        // no blocks? "compact" the lists together
-        list->free = list->local_free;
-        list->local_free = NULL;
 
-        // append the stuff that other threads freed
-        HeapBlock* other = atomic_exchange_explicit(&list->thread_free, NULL, memory_order_acq_rel);
-        if (other != NULL) {
-            other->next = list->free;
-            list->free = other;
-        }
-
-        block = list->free;
-        if (block == NULL) {
-            return NULL;
-        }
+static void* pop_node_segment(int node) {
+    NodePool* pool = &node_pools[node];
+    if (atomic_ldrlx(&pool->head) == atomic_ldrlx(&pool->tail)) {
+        return NULL;
     }
-    list->free = block->next;
-    list->used += 1;
-    return block;
-}
-
-// check if there's any block in here which can hold the alloc
-static void* fl_alloc_fit(HeapFreeList* list, size_t size, size_t align) {
-    // we shouldn't really call this everytime
-    if (1) {
-        // no blocks? "compact" the lists together
-        list->free = list->local_free;
-        list->local_free = NULL;
 
-        // append the stuff that other threads freed
-        HeapBlock* other = atomic_exchange_explicit(&list->thread_free, NULL, memory_order_acq_rel);
-        if (other != NULL) {
-            other->next = list->free;
-            list->free = other;
-        }
+    void* ptr = NULL;
+    spin_lock(&pool->lock);
+    uint64_t head = atomic_ldrlx(&pool->head);
+    if (head != atomic_ldrlx(&pool->tail)) {
+        ptr = pool->data[head & segment_pool_mask];
+        atomic_strlx(&pool->head, head + 1);
     }
+    spin_unlock(&pool->lock);
+    return ptr;
+}
 
-    for (HeapBlock *block = list->free, *prev = NULL; block; prev = block, block = block->next) {
-        uintptr_t start = (uintptr_t) block;
-        uintptr_t next_used = start + block->size;
+static void push_node_segment(int node, void* ptr) {
+    NodePool* pool = &node_pools[node];
+    spin_lock(&pool->lock);
+    uint64_t tail = atomic_ldrlx(&pool->tail);
+    pool->data[tail & segment_pool_mask] = ptr;
+    atomic_strlx(&pool->tail, tail + 1);
+    spin_unlock(&pool->lock);
+}
 
-        // round up
-        start = (start + align - 1) & -align;
+// steals from the top of someone else's queue, this is the only
+// operation which can happen on a non-local pool.
+static void* steal_segment(SegmentPool* pool, int64_t* out_left) {
+    int64_t top = atomic_ldacq(&pool->top);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bot = atomic_ldacq(&pool->bot);
 
-        uintptr_t end = start + size;
-        if (end <= next_used) {
-            // Replace free-list node due to imperfect split
-            if (size != block->size) {
-                kassert(next_used - end >= sizeof(HeapBlock), "fragmentation smaller than HeapBlock");
-                HeapBlock* next = (HeapBlock*) end;
-                next->next = list->local_free;
-                next->size = next_used - end;
-                list->local_free = next;
+    *out_left = bot - top;
+    if (top >= bot) {
+        return NULL;
+    }
 
-                if (prev) {
-                    prev->next = block->next;
-                } else {
-                    list->free = block->next;
-                }
-            }
-            list->used += 1;
-            return block;
-        }
+    void* ptr = atomic_ldrlx(&pool->data[top & segment_pool_mask]);
+    if (!atomic_cas_acq_rel(&pool->top, &top, top + 1)) {
+        // lost to the owner or another thief, they can have it
+        return NULL;
     }
-    return NULL;
+    *out_left -= 1;
+    return ptr;
 }
-
-static void* gimme_segment(Heap* heap, HeapFreeList* list, size_t size, bool is_small) {
-    char* segment = alloc_segment();
-    if (segment == NULL) {
+
+static void* steal_from(int core_id, int victim_id, bool batched) {
+    SegmentPool* local  = &segment_pools[core_id];
+    SegmentPool* victim = &segment_pools[victim_id];
+
+    int64_t left;
+    void* ptr = steal_segment(victim, &left);
+    if (ptr == NULL) {
         return NULL;
     }
 
-    ON_DEBUG(KHEAP)(kprintf("[heap] Allocating 2M segment, split into %zuK: %p\n", kaddr2paddr(segment), size / 1024));
-    if (is_small) {
-        // give away the remaining ones to the thread for other allocs
-        FOR_REV_N(i, 1, SEGMENT_SIZE / size) {
-            HeapBlock* block = (HeapBlock*) &segment[i*size];
-            block->next = list->local_free;
-            block->size = size;
-            list->local_free = block;
-        }
-    } else {
-        HeapBlock* block = (HeapBlock*) (segment + size);
-        block->next = list->local_free;
-        block->size = SEGMENT_SIZE - size;
-        list->local_free = block;
+    int64_t batch = batched ? left / 2 : 0;
+    if (batch > SEGMENT_STEAL_BATCH - 1) {
+        batch = SEGMENT_STEAL_BATCH - 1;
     }
 
-    uintptr_t i = kaddr2paddr(segment) / SEGMENT_SIZE;
-    kassert(i < segment_map_len, "OOB!");
-    segment_map[i] = heap;
-    return segment;
-}
-
-void* kheap_alloc_page(void) {
-    int core_id = cpu_get_index();
-    Heap* heap  = &local_heaps[core_id];
-    void* page  = fl_alloc_exact(&heap->fixed_page);
-    if (page == NULL) {
-        page = gimme_segment(heap, &heap->fixed_page, PAGE_SIZE, true);
+    FOR_N(j, 0, batch) {
+        void* extra = steal_segment(victim, &left);
+        if (extra == NULL) {
+            break;
+        }
+        push_segment(local, extra);
     }
 
-    memset(page, 0, PAGE_SIZE);
-    return page;
-}
-
-void kheap_free_page(void* ptr) {
-
+    ON_DEBUG(KHEAP)(kprintf("[heap] CPU-%d stole from CPU-%d (batch=%zu)\n", core_id, victim_id, batch + 1));
+    return ptr;
 }
-
-void* kheap_alloc(size_t obj_size) {
-    int core_id = cpu_get_index();
-    Heap* heap  = &local_heaps[core_id];
 
-    if (obj_size < 4096) {
-        int size_class  = heap_size_class(obj_size);
-        size_t old_size = obj_size;
-        obj_size = 64ull << size_class;
-        kassert(obj_size >= old_size, "woah");
+// Walks the NUMA nodes from closest to furthest, on each one we check the
+// node's pool and then its cores (closest first). we take half of the first
+// non-empty queue we find (capped at SEGMENT_STEAL_BATCH) and keep the extras
+// in our own pool so the next few allocations don't come back to steal again,
+// remote memory is taken one at a time since we'd rather not hoard it.
+static void* steal_segments(int core_id) {
+    SegmentPool* local = &segment_pools[core_id];
+    u32 local_node = boot_info->cores[core_id].numa_node;
+    FOR_N(n, 0, numa_node_count) {
+        u32 node = numa_order[local_node][n];
+        if (numa_node_count > 1) {
+            void* ptr = pop_node_segment(node);
+            if (ptr != NULL) {
+                return ptr;
+            }
+        }
 
-        HeapFreeList* list = &heap->page_classes[size_class];
-        void* obj = fl_alloc_exact(list);
-        if (obj == NULL) {
-            char* small_segment = fl_alloc_exact(&heap->page_64K);
-            if (small_segment == NULL) {
-                small_segment = gimme_segment(heap, &heap->page_64K, SMALL_SEGMENT_SIZE, true);
-                kassert(small_segment, "OOM");
+        FOR_N(i, 0, segment_pool_count - 1) {
+            if (boot_info->cores[local->victims[i]].numa_node != node) {
+                continue;
             }
 
-            // add new entries to the free list
-            FOR_REV_N(i, 1, SMALL_SEGMENT_SIZE / obj_size) {
-                HeapBlock* block = (HeapBlock*) &small_segment[i*obj_size];
-                block->next = list->local_free;
-                block->size = obj_size;
-                list->local_free = block;
+            void* ptr = steal_from(core_id, local->victims[i], node == local_node);
+            if (ptr != NULL) {
+                return ptr;
             }
-            obj = small_segment;
         }
+    }
 
-        ON_DEBUG(KHEAP)(kprintf("[heap] alloc(%zu => %zu) %p\n", old_size, obj_size, obj));
-        // kprintf("=== ALLOC %p %zu (%p) ===\n", obj, obj_size, list);
-        return obj;
-    } else {
-        obj_size  = (obj_size + 4095) & ~4095ull;
+    return NULL;
+}
 
-        void* obj = fl_alloc_fit(&heap->var_page, obj_size, 4096);
-        if (obj == NULL) {
-            kassert(obj_size <= SEGMENT_SIZE, "Too much to alloc together!!! %zu", obj_size);
-            obj = gimme_segment(heap, &heap->var_page, obj_size, false);
-            kassert(obj, "OOM");
+static void* alloc_segment(void) {
+    int core_id = cpu_get_index();
+    for (;;) {
+        void* ptr = pop_segment(&segment_pools[core_id]);
+        if (ptr == NULL && (segment_pool_count > 1 || numa_node_count > 1)) {
+            ptr = steal_segments(core_id);
         }
 
-        ON_DEBUG(KHEAP)(kprintf("[heap] alloc(%zu) %p\n", obj_size, obj));
-        // kprintf("=== ALLOC %p %zu (%p) ===\n", obj, obj_size, &heap->var_page);
-        return obj;
+        if (ptr == NULL) {
+            return NULL;
+        }
+
+        HeapSegment* seg = heap_segment(ptr);
+        atomic_fetch_sub(&seg->queued, 1);
+        if (atomic_compare_exchange_strong(&seg->state, &(uint32_t){ SEGMENT_POOLED }, SEGMENT_OWNED)) {
+            return ptr;
+        }
+
+        // stale entry, a span took it from under us
     }
 }
-
-static bool fl_free(HeapFreeList* list, void* obj, size_t size) {
-    HeapBlock* block = (HeapBlock*) obj;
-    block->size = size;
 
-    bool discard = false;
-    if (list->thread_id == cpu_get_index()) {
-        ON_DEBUG(KHEAP)(kprintf("[heap] free(%p, %zu)\n", obj, size));
+static void free_segment(void* ptr) {
+    HeapSegment* seg = heap_segment(ptr);
+    seg->heap = NULL;
+    atomic_store(&seg->state, SEGMENT_POOLED);
 
-        // Local free
-        block->next = list->local_free;
-        list->local_free = block;
-        list->used -= 1;
+    // if there's still a stale entry for it in some pool, it's good as new
+    // again and we don't need another one.
+    if (atomic_load(&seg->queued) == 0) {
+        atomic_fetch_add(&seg->queued, 1);
 
-        uint64_t thread_freed = atomic_load_explicit(&list->thread_freed, memory_order_relaxed);
-        if (list->used == thread_freed) {
-            discard = true;
+        // remote memory goes back to its own node instead of sitting in
+        // our pool where we'd keep reusing it.
+        int core_id = cpu_get_index();
+        if (numa_node_count > 1 && seg->node != boot_info->cores[core_id].numa_node) {
+            push_node_segment(seg->node, ptr);
+        } else {
+            push_segment(&segment_pools[core_id], ptr);
         }
-    } else {
-        ON_DEBUG(KHEAP)(kprintf("[heap] deferred_free(%p, %zu)\n", obj, size));
+    }
+}
 
-        // Non-local free, queue up for the owner thread to handle it
-        do {
-            block->next = list->thread_free;
-        } while (!atomic_cas_acq_rel(&list->thread_free, &(HeapBlock*){ block }, block->next));
+// Looks for count physically adjacent free segments, we claim them straight
+// out of the segment map (the pool entries become stale). the run starts on
+// a multiple of align segments.
+static void* alloc_span(size_t count, size_t align) {
+    spin_lock(&span_lock);
 
-        atomic_fetch_add_explicit(&list->thread_freed, 1, memory_order_acq_rel);
-    }
+    size_t run = 0;
+    FOR_N(i, 0, segment_map_len) {
+        if (atomic_ldrlx(&segment_map[i].state) != SEGMENT_POOLED) {
+            run = 0;
+            continue;
+        }
 
-    #ifndef NDEBUG
-    memset(block->data, 0xCC, size - sizeof(HeapBlock));
-    #endif
+        if (run == 0 && i % align != 0) {
+            continue;
+        }
 
-    return discard;
-}
-
-void kheap_free(void* obj, size_t obj_size) {
-    uintptr_t index = kaddr2paddr(obj) / SEGMENT_SIZE;
-    kassert(index < segment_map_len, "we're trying to free an invalid object, %p (index=%d, limit=%d)", obj, index, segment_map_len);
+        if (++run < count) {
+            continue;
+        }
 
-    Heap* heap = segment_map[index];
-    kassert(heap, "Not a segment associated with a heap");
+        size_t start = i + 1 - count, j = start;
+        for (; j <= i; j++) {
+            if (!atomic_compare_exchange_strong(&segment_map[j].state, &(uint32_t){ SEGMENT_POOLED }, SEGMENT_SPAN)) {
+                break;
+            }
+        }
 
-    // The top-level free list of the segment can be either page_64K if obj_size
-    // is less than 4K, var_page if not.
-    HeapFreeList* list = NULL;
-    if (obj_size < 4096) {
-        int size_class = heap_size_class(obj_size);
-        obj_size = 64ull << size_class;
-        list     = &heap->page_classes[size_class];
-    } else {
-        obj_size = (obj_size + 4095) & ~4095ull;
-        list     = &heap->var_page;
-    }
+        if (j > i) {
+            segment_map[start].span_len = count;
+            spin_unlock(&span_lock);
 
-    // kprintf("=== FREE %p %zu (%p) ===\n", obj, obj_size, list);
-    fl_free(list, obj, obj_size);
+            ON_DEBUG(KHEAP)(kprintf("[heap] Allocated span of %zu segments: %p\n", count, start*SEGMENT_SIZE));
+            return paddr2kaddr(start*SEGMENT_SIZE);
+        }
+
+        // someone popped one of them while we were claiming, let go of
+        // the rest and keep looking past it.
+        FOR_N(k, start, j) {
+            atomic_store(&segment_map[k].state, SEGMENT_POOLED);
+        }
+        run = 0;
+    }
+
+    spin_unlock(&span_lock);
+    return NULL;
+}
+
+static void free_span(void* ptr, size_t count) {
+    HeapSegment* seg = heap_segment(ptr);
+    kassert(atomic_ldrlx(&seg->state) == SEGMENT_SPAN && seg->span_len == count, "bad span free %p (%zu segments)", ptr, count);
+
+    seg->span_len = 0;
+    FOR_N(i, 0, count) {
+        free_segment((char*) ptr + i*SEGMENT_SIZE);
+    }
+}
+
+// move everything other cores freed into our local list, we need to walk it
+// anyway to find the tail and to know how many bytes came back.
+static void fl_collect(HeapFreeList* list) {
+    HeapBlock* other = atomic_exchange_explicit(&list->thread_free, NULL, memory_order_acq_rel);
+    if (other == NULL) {
+        return;
+    }
+
+    HeapBlock* tail = other;
+    for (;;) {
+        list->used -= tail->size;
+        if (tail->next == NULL) { break; }
+        tail = tail->next;
+    }
+
+    tail->next = list->local_free;
+    list->local_free = other;
+}
+
+static void fl_free(HeapFreeList* list, void* obj, size_t size);
+
+// splices local_free onto the front of the free list
+static void fl_merge_local(HeapFreeList* list) {
+    if (list->local_free) {
+        HeapBlock* tail = list->local_free;
+        while (tail->next) { tail = tail->next; }
+
+        tail->next = list->free;
+        list->free = list->local_free;
+        list->local_free = NULL;
+    }
+}
+
+static int32_t* fl_sweep_counter(HeapFreeList* list, HeapBlock* block) {
+    uintptr_t paddr  = kaddr2paddr(block);
+    HeapSegment* seg = &segment_map[paddr / SEGMENT_SIZE];
+    if (list->granule == SEGMENT_SIZE) {
+        return &seg->swept;
+    } else {
+        return &seg->small_swept[(paddr % SEGMENT_SIZE) / SMALL_SEGMENT_SIZE];
+    }
+}
+
+// Finds the granules which are entirely free, unlinks their blocks and hands
+// them back (64KiB chunks go to page_64K, segments go to the pool). Only the
+// owner can call this.
+static void fl_sweep(HeapFreeList* list) {
+    Heap* heap = &local_heaps[list->thread_id];
+    fl_collect(list);
+
+    fl_merge_local(list);
+
+    int32_t capacity = list->granule;
+    if (list->block_size) {
+        capacity = (list->granule / list->block_size) * list->block_size;
+    }
+
+    // tally up the free bytes per granule
+    for (HeapBlock* block = list->free; block; block = block->next) {
+        *fl_sweep_counter(list, block) += block->size;
+    }
+
+    // a fully free granule gets its counter flipped negative and we count back
+    // up to zero as we unlink its blocks, by the time we hit zero we've seen
+    // all of them. everyone else just gets their counter reset.
+    char* released = NULL;
+    for (HeapBlock *block, **prev = &list->free; (block = *prev) != NULL;) {
+        int32_t* counter = fl_sweep_counter(list, block);
+        if (*counter == capacity) {
+            *counter = -capacity;
+        }
+
+        if (*counter < 0) {
+            *prev = block->next;
+            *counter += block->size;
+
+            if (*counter == 0) {
+                char* base = paddr2kaddr(kaddr2paddr(block) & -(uintptr_t) list->granule);
+                *(char**) base = released;
+                released = base;
+            }
+        } else {
+            *counter = 0;
+            prev = &block->next;
+        }
+    }
+
+    while (released) {
+        char* base = released;
+        released = *(char**) base;
+        list->owned -= list->granule;
+
+        if (list->granule == SMALL_SEGMENT_SIZE) {
+            ON_DEBUG(KHEAP)(kprintf("[heap] Returning 64K chunk %p\n", base));
+            fl_free(&heap->page_64K, base, SMALL_SEGMENT_SIZE);
+        } else {
+            ON_DEBUG(KHEAP)(kprintf("[heap] Returning 2M segment %p\n", kaddr2paddr(base)));
+            free_segment(base);
+        }
+    }
+
+    // whatever's left is fragmented, don't bother again until a couple more
+    // granules worth of memory has been freed.
+    list->sweep_at = (list->owned - list->used) + 2*list->granule;
+}
+
+// every block in this page is capable of holding the alloc
+static void* fl_alloc_exact(HeapFreeList* list) {
+    HeapBlock* block = list->free;
+    if (block == NULL) {
+        // no blocks? "compact" the lists together
+        fl_collect(list);
+        list->free = list->local_free;
+        list->local_free = NULL;
+
+        // other cores might've handed back enough to free up a granule
+        if (list->owned - list->used >= list->sweep_at) {
+            fl_sweep(list);
+        }
+
+        block = list->free;
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+    list->free = block->next;
+    list->used += block->size;
+    return block;
+}
+
+static void* gimme_segment(Heap* heap, HeapFreeList* list, size_t size) {
+    char* segment = alloc_segment();
+    if (segment == NULL) {
+        return NULL;
+    }
+
+    ON_DEBUG(KHEAP)(kprintf("[heap] Allocating 2M segment, split into %zuK: %p\n", kaddr2paddr(segment), size / 1024));
+
+    // give away the remaining ones to the thread for other allocs
+    FOR_REV_N(i, 1, SEGMENT_SIZE / size) {
+        HeapBlock* block = (HeapBlock*) &segment[i*size];
+        block->next = list->local_free;
+        block->size = size;
+        list->local_free = block;
+    }
+    list->owned += SEGMENT_SIZE;
+    list->used  += size;
+
+    HeapSegment* seg = heap_segment(segment);
+    kassert(seg->heap == NULL, "segment %p is already owned", segment);
+    seg->heap = heap;
+    return segment;
+}
+
+// carves a fresh 64KiB chunk into list->block_size blocks, the first one
+// is handed back to the caller.
+static void* fl_carve_small(Heap* heap, HeapFreeList* list) {
+    char* small_segment = fl_alloc_exact(&heap->page_64K);
+    if (small_segment == NULL) {
+        small_segment = gimme_segment(heap, &heap->page_64K, SMALL_SEGMENT_SIZE);
+        if (small_segment == NULL) {
+            return NULL;
+        }
+    }
+
+    // add new entries to the free list
+    size_t size = list->block_size;
+    FOR_REV_N(i, 1, SMALL_SEGMENT_SIZE / size) {
+        HeapBlock* block = (HeapBlock*) &small_segment[i*size];
+        block->next = list->local_free;
+        block->size = size;
+        list->local_free = block;
+    }
+    list->owned += SMALL_SEGMENT_SIZE;
+    list->used  += size;
+    return small_segment;
+}
+
+////////////////////////////////
+// Variable sized pages
+////////////////////////////////
+// which bin holds runs of this many pages
+static int var_bin(size_t pages) {
+    int fl = 63 - __builtin_clzll(pages);
+    if (fl < 2) {
+        return pages;
+    }
+    return fl*4 + ((pages >> (fl - 2)) & 3);
+}
+
+// first bin where every run is guaranteed to fit this many pages
+static int var_bin_fit(size_t pages) {
+    int fl = 63 - __builtin_clzll(pages);
+    if (fl >= 2) {
+        pages += (1ull << (fl - 2)) - 1;
+    }
+    return var_bin(pages);
+}
+
+static size_t var_page_index(void* ptr) {
+    return (kaddr2paddr(ptr) % SEGMENT_SIZE) / PAGE_SIZE;
+}
+
+static bool var_edge(HeapSegment* seg, size_t i) {
+    return (seg->var_edges[i / 64] >> (i % 64)) & 1;
+}
+
+static void var_set_edges(HeapSegment* seg, size_t first, size_t last, bool on) {
+    if (on) {
+        seg->var_edges[first / 64] |= 1ull << (first % 64);
+        seg->var_edges[last / 64]  |= 1ull << (last % 64);
+    } else {
+        seg->var_edges[first / 64] &= ~(1ull << (first % 64));
+        seg->var_edges[last / 64]  &= ~(1ull << (last % 64));
+    }
+}
+
+static void var_insert(HeapVarList* list, char* ptr, size_t pages) {
+    VarBlock* block = (VarBlock*) ptr;
+    block->pages = pages;
+    ((size_t*) (ptr + pages*PAGE_SIZE))[-1] = pages;
+
+    size_t first = var_page_index(ptr);
+    var_set_edges(heap_segment(ptr), first, first + pages - 1, true);
+
+    int bin = var_bin(pages);
+    block->prev = NULL;
+    block->next = list->bins[bin];
+    if (block->next) {
+        block->next->prev = block;
+    }
+    list->bins[bin] = block;
+    list->bin_mask |= 1ull << bin;
+}
+
+static void var_remove(HeapVarList* list, VarBlock* block) {
+    size_t first = var_page_index(block);
+    var_set_edges(heap_segment(block), first, first + block->pages - 1, false);
+
+    int bin = var_bin(block->pages);
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        list->bins[bin] = block->next;
+        if (block->next == NULL) {
+            list->bin_mask &= ~(1ull << bin);
+        }
+    }
+
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+}
+
+// puts a run back into the bins, merging it with any free neighbors. we only
+// keep one entirely free segment around, any more go back to the pool.
+static void var_release(HeapVarList* list, char* ptr, size_t pages) {
+    HeapSegment* seg = heap_segment(ptr);
+    size_t first = var_page_index(ptr);
+    size_t last  = first + pages - 1;
+
+    if (last + 1 < VAR_SEGMENT_PAGES && var_edge(seg, last + 1)) {
+        VarBlock* right = (VarBlock*) (ptr + pages*PAGE_SIZE);
+        var_remove(list, right);
+        pages += right->pages;
+    }
+
+    if (first > 0 && var_edge(seg, first - 1)) {
+        size_t left_pages = ((size_t*) ptr)[-1];
+        VarBlock* left = (VarBlock*) (ptr - left_pages*PAGE_SIZE);
+        var_remove(list, left);
+        ptr    = (char*) left;
+        pages += left_pages;
+    }
+
+    if (pages == VAR_SEGMENT_PAGES && (list->bin_mask & (1ull << var_bin(VAR_SEGMENT_PAGES)))) {
+        ON_DEBUG(KHEAP)(kprintf("[heap] Returning 2M segment %p\n", kaddr2paddr(ptr)));
+        list->owned -= SEGMENT_SIZE;
+        free_segment(ptr);
+        return;
+    }
+
+    var_insert(list, ptr, pages);
+}
+
+static void var_collect(HeapVarList* list) {
+    HeapBlock* block = atomic_exchange_explicit(&list->thread_free, NULL, memory_order_acq_rel);
+    while (block != NULL) {
+        HeapBlock* next = block->next;
+        list->used -= block->size;
+        var_release(list, (char*) block, block->size / PAGE_SIZE);
+        block = next;
+    }
+}
+
+static void* var_alloc(HeapVarList* list, size_t size) {
+    if (atomic_ldrlx(&list->thread_free) != NULL) {
+        var_collect(list);
+    }
+
+    size_t pages = size / PAGE_SIZE;
+    int bin = var_bin_fit(pages);
+
+    VarBlock* block = NULL;
+    uint64_t mask = bin < VAR_BIN_COUNT ? list->bin_mask & (~0ull << bin) : 0;
+    if (mask) {
+        block = list->bins[__builtin_ctzll(mask)];
+    } else {
+        // rounding up skips the bin which could've had a fit, we'll walk it
+        // before giving up.
+        for (VarBlock* b = list->bins[var_bin(pages)]; b; b = b->next) {
+            if (b->pages >= pages) {
+                block = b;
+                break;
+            }
+        }
+
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    var_remove(list, block);
+    if (block->pages > pages) {
+        var_insert(list, (char*) block + size, block->pages - pages);
+    }
+    list->used += size;
+    return block;
+}
+
+static bool var_grow(Heap* heap, HeapVarList* list) {
+    char* segment = alloc_segment();
+    if (segment == NULL) {
+        return false;
+    }
+
+    ON_DEBUG(KHEAP)(kprintf("[heap] Allocating 2M segment for var pages: %p\n", kaddr2paddr(segment)));
+    HeapSegment* seg = heap_segment(segment);
+    kassert(seg->heap == NULL, "segment %p is already owned", segment);
+    seg->heap = heap;
+
+    list->owned += SEGMENT_SIZE;
+    var_insert(list, segment, VAR_SEGMENT_PAGES);
+    return true;
+}
+
+static void var_free(HeapVarList* list, void* obj, size_t size) {
+    #ifndef NDEBUG
+    memset(obj, 0xCC, size);
+    #endif
+
+    if (list->thread_id == cpu_get_index()) {
+        ON_DEBUG(KHEAP)(kprintf("[heap] free(%p, %zu)\n", obj, size));
+        list->used -= size;
+        var_release(list, obj, size / PAGE_SIZE);
+    } else {
+        ON_DEBUG(KHEAP)(kprintf("[heap] deferred_free(%p, %zu)\n", obj, size));
+
+        HeapBlock* block = obj;
+        block->size = size;
+
+        HeapBlock* head = atomic_ldrlx(&list->thread_free);
+        do {
+            block->next = head;
+        } while (!atomic_cas_acq_rel(&list->thread_free, &head, block));
+    }
+}
+
+// hands back everything this core is holding onto that's entirely free, we
+// do this when we couldn't find a span. returns how many bytes worth of
+// segments went back to the pool.
+static size_t heap_compact(Heap* heap) {
+    size_t owned = heap->page_64K.owned + heap->fixed_page.owned + heap->var_page.owned;
+
+    // zeroed pages still count as used by fixed_page
+    while (heap->zeroed) {
+        HeapBlock* page = heap->zeroed;
+        heap->zeroed = page->next;
+        heap->zeroed_count -= 1;
+        fl_free(&heap->fixed_page, page, PAGE_SIZE);
+    }
+
+    // size classes go first since they feed chunks back into page_64K
+    FOR_N(i, 0, ELEM_COUNT(heap->page_classes)) {
+        fl_sweep(&heap->page_classes[i]);
+    }
+    fl_sweep(&heap->page_64K);
+    fl_sweep(&heap->fixed_page);
+
+    // the var list keeps an empty segment cached
+    HeapVarList* var = &heap->var_page;
+    var_collect(var);
+
+    int bin = var_bin(VAR_SEGMENT_PAGES);
+    while (var->bins[bin] != NULL) {
+        VarBlock* block = var->bins[bin];
+        var_remove(var, block);
+        var->owned -= SEGMENT_SIZE;
+        free_segment(block);
+    }
+
+    return owned - (heap->page_64K.owned + heap->fixed_page.owned + heap->var_page.owned);
+}
+
+////////////////////////////////
+// Reclaim
+////////////////////////////////
+typedef struct {
+    const char* name;
+    KShrinkerFn* fn;
+} Shrinker;
+
+static Lock shrinker_lock;
+static _Atomic uint32_t shrinker_count;
+static Shrinker shrinkers[MAX_SHRINKERS];
+
+void kheap_register_shrinker(const char* name, KShrinkerFn* fn) {
+    spin_lock(&shrinker_lock);
+    uint32_t i = atomic_ldrlx(&shrinker_count);
+    kassert(i < MAX_SHRINKERS, "too many shrinkers, couldn't add %s", name);
+    shrinkers[i] = (Shrinker){ name, fn };
+    atomic_strel(&shrinker_count, i + 1);
+    spin_unlock(&shrinker_lock);
+}
+
+// Runs every shrinker and then hands back whatever this core's heap is sitting
+// on. We're out of memory by the time we get here so none of this gets to
+// allocate, allocs from inside it just fail.
+size_t kheap_reclaim(void) {
+    Heap* heap = &local_heaps[cpu_get_index()];
+    if (heap->reclaiming) {
+        return 0;
+    }
+    heap->reclaiming = true;
+
+    size_t freed = 0;
+    uint32_t count = atomic_ldacq(&shrinker_count);
+    FOR_N(i, 0, count) {
+        size_t n = shrinkers[i].fn();
+        ON_DEBUG(KHEAP)(kprintf("[heap] shrinker %s gave back %zu KiB\n", shrinkers[i].name, n / 1024));
+        freed += n;
+    }
+
+    // the shrinkers are probably freeing into our lists, we go last
+    freed += heap_compact(heap);
+    heap->reclaiming = false;
+    return freed;
+}
+
+size_t kheap_segment_count(void) {
+    return segment_map_len;
+}
+
+int kheap_segment_node(void* ptr) {
+    return heap_segment(ptr)->node;
+}
+
+// whole segments for the frame allocator, bigger runs are naturally aligned
+// since that's what large pages want.
+void* kheap_alloc_segments(size_t count) {
+    void* ptr = count == 1 ? alloc_segment() : alloc_span(count, count);
+    if (ptr == NULL) {
+        kheap_reclaim();
+        ptr = count == 1 ? alloc_segment() : alloc_span(count, count);
+    }
+    return ptr;
+}
+
+void kheap_free_segments(void* ptr, size_t count) {
+    if (count == 1) {
+        free_segment(ptr);
+    } else {
+        free_span(ptr, count);
+    }
+}
+
+void kheap_split_segments(void* ptr, size_t count) {
+    if (count > 1) {
+        HeapSegment* seg = heap_segment(ptr);
+        kassert(atomic_ldrlx(&seg->state) == SEGMENT_SPAN && seg->span_len == count, "bad span split %p (%zu segments)", ptr, count);
+        seg->span_len = 0;
+    }
+}
+
+// Hands over everything we couldn't touch during boot: what's left of the
+// loader (MEM_REGION_BOOT), boot services memory and the ends of the usable
+// regions which didn't make a whole segment. Aligned segments go into our
+// pool, the rest becomes 4KiB frames (which get merged with their buddies, so
+// tails that meet up across two regions can still come back as a segment,
+// see frame.c's zone_free). The memory map itself lives in loader
+// memory so we copy it out first, call this once nothing else is reading
+// boot_info's loader pointers.
+void kheap_release_boot(void) {
+    MemMap* mem_map = &boot_info->mem_map;
+    MemRegion* regions = kheap_alloc(mem_map->nregions * sizeof(MemRegion));
+    if (regions == NULL) {
+        kprintf("[heap] couldn't copy the memory map, boot memory stays reserved\n");
+        return;
+    }
+    memcpy(regions, mem_map->regions, mem_map->nregions * sizeof(MemRegion));
+    mem_map->regions = regions;
+    mem_map->cap = mem_map->nregions;
+
+    size_t segment_bytes = 0, frame_bytes = 0;
+    FOR_N(i, 0, mem_map->nregions) {
+        MemRegion* region = &regions[i];
+        bool boot = boot_region(region);
+        if ((region->type != MEM_REGION_USABLE && !boot) || region->base < 0x100000) {
+            continue;
+        }
+
+        uintptr_t base = region->base;
+        uintptr_t end  = base + region->pages*PAGE_SIZE;
+        FOR_N(j, 0, ELEM_COUNT(heap_carved)) {
+            if (heap_carved[j].base == base) {
+                base = heap_carved[j].end;
+            }
+        }
+        base = (base + PAGE_SIZE - 1) & -PAGE_SIZE;
+
+        uintptr_t lo = (base + SEGMENT_SIZE - 1) & -SEGMENT_SIZE;
+        uintptr_t hi = end & -SEGMENT_SIZE;
+        if (lo >= hi) {
+            // doesn't have a single whole segment in it
+            lo = hi = end;
+        }
+
+        // usable regions already gave their segments away in kheap_init
+        if (boot) {
+            for (uintptr_t p = lo; p < hi; p += SEGMENT_SIZE) {
+                free_segment(paddr2kaddr(p));
+            }
+            segment_bytes += hi - lo;
+            region->type = MEM_REGION_USABLE;
+        }
+
+        if (base < lo) {
+            frame_donate(paddr2kaddr(base), (lo - base) / PAGE_SIZE);
+        }
+        if (hi < end) {
+            frame_donate(paddr2kaddr(hi), (end - hi) / PAGE_SIZE);
+        }
+        frame_bytes += (lo - base) + (end - hi);
+    }
+
+    ON_DEBUG(KHEAP)(kprintf("[heap] boot memory: %zu MiB as segments, %zu KiB as frames\n", segment_bytes >> 20, frame_bytes / 1024));
+}
+
+#if DEBUG_HEAPPROF
+static void heap_prof_alloc(void* obj, size_t size, void* site) {
+    if (heapprof_alloc(obj, size, site)) {
+        atomic_fetch_add_explicit(&heap_segment(obj)->sampled, 1, memory_order_relaxed);
+    }
+}
+
+static void heap_prof_free(void* obj) {
+    HeapSegment* seg = heap_segment(obj);
+    if (atomic_ldrlx(&seg->sampled) && heapprof_free(obj)) {
+        atomic_fetch_sub_explicit(&seg->sampled, 1, memory_order_relaxed);
+    }
+}
+#endif
+
+static void heap_count_alloc(Heap* heap, int stats_class, size_t wasted) {
+    heap->counters[stats_class].allocs += 1;
+    heap->counters[stats_class].wasted += wasted;
+}
+
+static void heap_count_free(Heap* owner, int stats_class, size_t wasted) {
+    Heap* heap = &local_heaps[cpu_get_index()];
+    heap->counters[stats_class].frees  += 1;
+    heap->counters[stats_class].wasted -= wasted;
+    if (owner != NULL && owner != heap) {
+        heap->counters[stats_class].remote_frees += 1;
+    }
+}
+
+static void* fixed_alloc(Heap* heap) {
+    void* page = fl_alloc_exact(&heap->fixed_page);
+    if (page == NULL) {
+        page = gimme_segment(heap, &heap->fixed_page, PAGE_SIZE);
+    }
+    return page;
+}
+
+static void* heap_alloc_page(void) {
+    int core_id = cpu_get_index();
+    Heap* heap  = &local_heaps[core_id];
+
+    // the idle loop might've zeroed one for us already
+    HeapBlock* zeroed = heap->zeroed;
+    if (zeroed != NULL) {
+        heap->zeroed = zeroed->next;
+        heap->zeroed_count -= 1;
+        heap->zeroed_hits  += 1;
+        heap_count_alloc(heap, HEAP_STATS_PAGE, 0);
+
+        // the link is the only non-zero part
+        zeroed->next = NULL;
+        return zeroed;
+    }
+
+    void* page = fixed_alloc(heap);
+    if (page == NULL) {
+        kheap_reclaim();
+        page = fixed_alloc(heap);
+        if (page == NULL) {
+            ON_DEBUG(KHEAP)(kprintf("[heap] OOM, alloc_page()\n"));
+            return NULL;
+        }
+    }
+
+    heap->zeroed_misses += 1;
+    heap_count_alloc(heap, HEAP_STATS_PAGE, 0);
+    arch_zero_page(page);
+    return page;
+}
+
+void* kheap_alloc_page(void) {
+    void* page = heap_alloc_page();
+    ON_DEBUG(HEAPPROF)(heap_prof_alloc(page, PAGE_SIZE, __builtin_return_address(0)));
+    return page;
+}
+
+void kheap_free_page(void* ptr) {
+    ON_DEBUG(HEAPPROF)(heap_prof_free(ptr));
+
+    Heap* heap = heap_segment(ptr)->heap;
+    kassert(heap, "Not a segment associated with a heap");
+    heap_count_free(heap, HEAP_STATS_PAGE, 0);
+    fl_free(&heap->fixed_page, ptr, PAGE_SIZE);
+}
+
+// Tops up the zeroed page pool, called from the idle loop with interrupts on.
+// We only hold them off for a page at a time, if the scheduler takes the core
+// from us we don't get resumed, just called again next time we're idle.
+void kheap_idle(void) {
+    Heap* heap = &local_heaps[cpu_get_index()];
+    for (;;) {
+        bool irq = arch_irq_save();
+        if (heap->zeroed_count >= ZEROED_POOL_MAX) {
+            arch_irq_restore(irq);
+            break;
+        }
+
+        // we only zero what's already sitting in fixed_page, it's not worth
+        // pulling a new segment for pages nobody asked for yet.
+        HeapBlock* page = fl_alloc_exact(&heap->fixed_page);
+        if (page == NULL) {
+            arch_irq_restore(irq);
+            break;
+        }
+
+        arch_zero_page_nt(page);
+        page->next   = heap->zeroed;
+        heap->zeroed = page;
+        heap->zeroed_count += 1;
+        arch_irq_restore(irq);
+    }
+}
+
+void kheap_zeroed_stats(uint64_t* out_hits, uint64_t* out_misses, uint64_t* out_pooled) {
+    uint64_t hits = 0, misses = 0, pooled = 0;
+    FOR_N(i, 0, boot_info->core_count) {
+        hits   += local_heaps[i].zeroed_hits;
+        misses += local_heaps[i].zeroed_misses;
+        pooled += local_heaps[i].zeroed_count;
+    }
+
+    *out_hits   = hits;
+    *out_misses = misses;
+    *out_pooled = pooled;
+}
+
+// caches only show up here once some core's used them
+static _Atomic(KCache*) kcache_list;
+
+// the counters are plain loads, a snapshot of another core is only roughly
+// consistent but it's not worth slowing down the allocator over.
+void kheap_stats(int core_id, HeapCoreStats* out) {
+    Heap* heap = &local_heaps[core_id];
+    memset(out, 0, sizeof(HeapCoreStats));
+
+    HeapFreeList* lists = (HeapFreeList*) heap;
+    FOR_N(i, 0, HEAP_STATS_CLASSES) {
+        HeapClassStats* s = &out->classes[i];
+        s->allocs       = heap->counters[i].allocs;
+        s->frees        = heap->counters[i].frees;
+        s->remote_frees = heap->counters[i].remote_frees;
+        s->wasted_bytes = heap->counters[i].wasted;
+
+        uint64_t granule;
+        if (i <= HEAP_STATS_PAGE) {
+            s->block_size  = lists[i].block_size;
+            s->used_bytes  = lists[i].used;
+            s->owned_bytes = lists[i].owned;
+            granule        = lists[i].granule;
+        } else if (i == HEAP_STATS_SLAB) {
+            // the caches don't share a block size, free_blocks gets summed per cache
+            for (KCache* cache = atomic_load_explicit(&kcache_list, memory_order_acquire); cache; cache = cache->next) {
+                KCacheCPU* cpu = cache->cpus[core_id];
+                if (cpu == NULL) {
+                    continue;
+                }
+
+                s->used_bytes  += cpu->list.used;
+                s->owned_bytes += cpu->list.owned;
+                if (cpu->list.owned > cpu->list.used) {
+                    s->free_blocks += (cpu->list.owned - cpu->list.used) / cpu->list.block_size;
+                }
+            }
+            s->granules = s->owned_bytes / SMALL_SEGMENT_SIZE;
+            continue;
+        } else if (i == HEAP_STATS_VAR) {
+            s->block_size  = PAGE_SIZE;
+            s->used_bytes  = heap->var_page.used;
+            s->owned_bytes = heap->var_page.owned;
+            granule        = SEGMENT_SIZE;
+        } else {
+            // spans don't belong to any heap
+            s->block_size = SEGMENT_SIZE;
+            continue;
+        }
+
+        // used might be briefly ahead of owned while the owner's
+        // in the middle of something.
+        if (s->owned_bytes > s->used_bytes) {
+            s->free_blocks = (s->owned_bytes - s->used_bytes) / s->block_size;
+        }
+        s->granules = s->owned_bytes / granule;
+    }
+
+    int64_t pooled = atomic_ldrlx(&segment_pools[core_id].bot) - atomic_ldrlx(&segment_pools[core_id].top);
+    out->pooled_segments = pooled > 0 ? pooled : 0;
+    out->zeroed_pages    = heap->zeroed_count;
+    out->zeroed_hits     = heap->zeroed_hits;
+    out->zeroed_misses   = heap->zeroed_misses;
+}
+
+void kheap_dump(void) {
+    // the small classes are just printed by size
+    static const char* names[HEAP_STATS_CLASSES] = {
+        [HEAP_STATS_64K]  = "64K",
+        [HEAP_STATS_PAGE] = "page",
+        [HEAP_STATS_VAR]  = "var",
+        [HEAP_STATS_SPAN] = "span",
+        [HEAP_STATS_SLAB] = "slab",
+    };
+
+    HeapCoreStats total = { 0 };
+    kprintf("[heap] core  pooled  zeroed  (hits/misses)   var KiB (used/owned)\n");
+    FOR_N(i, 0, segment_pool_count) {
+        HeapCoreStats stats;
+        kheap_stats(i, &stats);
+
+        HeapClassStats* var = &stats.classes[HEAP_STATS_VAR];
+        kprintf("[heap] %4d  %6llu  %6llu  (%llu/%llu)   %llu/%llu\n", (int) i, stats.pooled_segments, stats.zeroed_pages,
+            stats.zeroed_hits, stats.zeroed_misses, var->used_bytes / 1024, var->owned_bytes / 1024);
+
+        FOR_N(j, 0, HEAP_STATS_CLASSES) {
+            HeapClassStats* s = &stats.classes[j];
+            HeapClassStats* t = &total.classes[j];
+            t->block_size    = s->block_size;
+            t->allocs       += s->allocs;
+            t->frees        += s->frees;
+            t->remote_frees += s->remote_frees;
+            t->wasted_bytes += s->wasted_bytes;
+            t->used_bytes   += s->used_bytes;
+            t->owned_bytes  += s->owned_bytes;
+            t->free_blocks  += s->free_blocks;
+            t->granules     += s->granules;
+        }
+    }
+
+    kprintf("[heap] class      allocs        live  remote%%  waste KiB   used KiB  owned KiB  frag%%\n");
+    FOR_N(i, 0, HEAP_STATS_CLASSES) {
+        HeapClassStats* t = &total.classes[i];
+        if (t->allocs == 0 && t->owned_bytes == 0) {
+            continue;
+        }
+
+        uint64_t remote = t->frees ? (t->remote_frees * 100) / t->frees : 0;
+        uint64_t frag   = t->owned_bytes > t->used_bytes ? ((t->owned_bytes - t->used_bytes) * 100) / t->owned_bytes : 0;
+        if (names[i]) {
+            kprintf("[heap] %-5s", names[i]);
+        } else {
+            kprintf("[heap] %-5llu", t->block_size);
+        }
+        kprintf(" %11llu %11lld %7llu%% %10lld %10llu %10llu %5llu%%\n", t->allocs, (int64_t) (t->allocs - t->frees),
+            remote, t->wasted_bytes / 1024, t->used_bytes / 1024, t->owned_bytes / 1024, frag);
+    }
+
+    ON_DEBUG(HEAPPROF)(heapprof_dump());
+}
+
+static void* small_alloc(Heap* heap, HeapFreeList* list) {
+    void* obj = fl_alloc_exact(list);
+    if (obj == NULL) {
+        obj = fl_carve_small(heap, list);
+    }
+    return obj;
+}
+
+static void* heap_alloc(size_t obj_size) {
+    int core_id = cpu_get_index();
+    Heap* heap  = &local_heaps[core_id];
+
+    if (obj_size < 4096) {
+        int size_class  = heap_size_class(obj_size);
+        size_t old_size = obj_size;
+        obj_size = small_class_sizes[size_class];
+        kassert(obj_size >= old_size, "woah");
+
+        HeapFreeList* list = &heap->page_classes[size_class];
+        void* obj = small_alloc(heap, list);
+        if (obj == NULL) {
+            // out of segments, see if anyone's willing to give some back
+            kheap_reclaim();
+            obj = small_alloc(heap, list);
+            if (obj == NULL) {
+                ON_DEBUG(KHEAP)(kprintf("[heap] OOM, alloc(%zu)\n", old_size));
+                return NULL;
+            }
+        }
+
+        heap_count_alloc(heap, HEAP_STATS_SMALL + size_class, obj_size - old_size);
+        ON_DEBUG(KHEAP)(kprintf("[heap] alloc(%zu => %zu) %p\n", old_size, obj_size, obj));
+        // kprintf("=== ALLOC %p %zu (%p) ===\n", obj, obj_size, list);
+        return obj;
+    } else if (obj_size > SEGMENT_SIZE) {
+        size_t count = (obj_size + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+        void* obj = alloc_span(count, 1);
+        if (obj == NULL) {
+            // we might be sitting on the segments we need
+            kheap_reclaim();
+            obj = alloc_span(count, 1);
+            if (obj == NULL) {
+                ON_DEBUG(KHEAP)(kprintf("[heap] OOM, couldn't find %zu contiguous segments\n", count));
+                return NULL;
+            }
+        }
+
+        heap_count_alloc(heap, HEAP_STATS_SPAN, count*SEGMENT_SIZE - obj_size);
+        return obj;
+    } else {
+        size_t old_size = obj_size;
+        obj_size  = (obj_size + 4095) & ~4095ull;
+
+        void* obj = var_alloc(&heap->var_page, obj_size);
+        if (obj == NULL && var_grow(heap, &heap->var_page)) {
+            obj = var_alloc(&heap->var_page, obj_size);
+        }
+
+        if (obj == NULL) {
+            kheap_reclaim();
+            obj = var_alloc(&heap->var_page, obj_size);
+            if (obj == NULL && var_grow(heap, &heap->var_page)) {
+                obj = var_alloc(&heap->var_page, obj_size);
+            }
+
+            if (obj == NULL) {
+                ON_DEBUG(KHEAP)(kprintf("[heap] OOM, alloc(%zu)\n", old_size));
+                return NULL;
+            }
+        }
+
+        heap_count_alloc(heap, HEAP_STATS_VAR, obj_size - old_size);
+        ON_DEBUG(KHEAP)(kprintf("[heap] alloc(%zu) %p\n", obj_size, obj));
+        // kprintf("=== ALLOC %p %zu (%p) ===\n", obj, obj_size, &heap->var_page);
+        return obj;
+    }
+}
+
+// frees a chain of blocks (sizes already filled in) which all belong to
+// the same list, for remote lists it's a single CAS no matter the length.
+static void fl_free_chain(HeapFreeList* list, HeapBlock* first, HeapBlock* last, size_t size) {
+    if (list->thread_id == cpu_get_index()) {
+        ON_DEBUG(KHEAP)(kprintf("[heap] free(%p, %zu)\n", first, size));
+
+        // Local free
+        last->next = list->local_free;
+        list->local_free = first;
+        list->used -= size;
+
+        if (list->owned - list->used >= list->sweep_at) {
+            fl_sweep(list);
+        }
+    } else {
+        ON_DEBUG(KHEAP)(kprintf("[heap] deferred_free(%p, %zu)\n", first, size));
+
+        // Non-local free, queue up for the owner thread to handle it
+        HeapBlock* head = atomic_ldrlx(&list->thread_free);
+        do {
+            last->next = head;
+        } while (!atomic_cas_acq_rel(&list->thread_free, &head, first));
+    }
+}
+
+static void fl_free(HeapFreeList* list, void* obj, size_t size) {
+    HeapBlock* block = (HeapBlock*) obj;
+    block->size = size;
+
+    #ifndef NDEBUG
+    memset(block->data, 0xCC, size - sizeof(HeapBlock));
+    #endif
+
+    fl_free_chain(list, block, block, size);
+}
+
+void* kheap_alloc(size_t obj_size) {
+    void* obj = heap_alloc(obj_size);
+    ON_DEBUG(HEAPPROF)(heap_prof_alloc(obj, obj_size, __builtin_return_address(0)));
+    return obj;
+}
+
+void kheap_free(void* obj, size_t obj_size) {
+    ON_DEBUG(HEAPPROF)(heap_prof_free(obj));
+
+    if (obj_size > SEGMENT_SIZE) {
+        size_t count = (obj_size + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+        heap_count_free(NULL, HEAP_STATS_SPAN, count*SEGMENT_SIZE - obj_size);
+        free_span(obj, count);
+        return;
+    }
+
+    Heap* heap = heap_segment(obj)->heap;
+    kassert(heap, "Not a segment associated with a heap");
+
+    // The top-level free list of the segment can be either page_64K if obj_size
+    // is less than 4K, var_page if not.
+    size_t old_size = obj_size;
+    if (obj_size < 4096) {
+        int size_class = heap_size_class(obj_size);
+        obj_size = small_class_sizes[size_class];
+        heap_count_free(heap, HEAP_STATS_SMALL + size_class, obj_size - old_size);
+
+        // kprintf("=== FREE %p %zu ===\n", obj, obj_size);
+        fl_free(&heap->page_classes[size_class], obj, obj_size);
+    } else {
+        obj_size = (obj_size + 4095) & ~4095ull;
+        heap_count_free(heap, HEAP_STATS_VAR, obj_size - old_size);
+        var_free(&heap->var_page, obj, obj_size);
+    }
 }
 
 void* kheap_zalloc(size_t obj_size) {
-    void* dst = kheap_alloc(obj_size);
-    memset(dst, 0x0, obj_size);
+    void* dst = heap_alloc(obj_size);
+    ON_DEBUG(HEAPPROF)(heap_prof_alloc(dst, obj_size, __builtin_return_address(0)));
+    if (dst != NULL) {
+        memset(dst, 0x0, obj_size);
+    }
     return dst;
 }
+
+////////////////////////////////
+// Slab caches
+////////////////////////////////
+KCache* kcache_create(const char* name, size_t obj_size, size_t align, void (*ctor)(void* obj)) {
+    KCache* cache = kheap_zalloc(sizeof(KCache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->name     = name;
+    cache->obj_size = obj_size;
+    cache->align    = align;
+    cache->ctor     = ctor;
+    return cache;
+}
+
+// each core sets up its own state the first time it touches the cache, the
+// owner always gets there before anyone could free one of its objects.
+static KCacheCPU* kcache_cpu(KCache* cache, int core_id) {
+    KCacheCPU* cpu = cache->cpus[core_id];
+    if (cpu == NULL) {
+        size_t align = cache->align ? cache->align : 16;
+        size_t size  = cache->obj_size < sizeof(HeapBlock) ? sizeof(HeapBlock) : cache->obj_size;
+        size = (size + align - 1) & -align;
+        kassert((align & (align - 1)) == 0, "%s: alignment must be a power of two (%zu)", cache->name, align);
+        kassert(size <= SMALL_SEGMENT_SIZE / 8, "%s: objects are too big for a slab cache (%zu)", cache->name, size);
+
+        cpu = kheap_zalloc(sizeof(KCacheCPU));
+        if (cpu == NULL) {
+            return NULL;
+        }
+
+        cpu->list.thread_id  = core_id;
+        cpu->list.granule    = SMALL_SEGMENT_SIZE;
+        cpu->list.block_size = size;
+        cpu->list.sweep_at   = 2*SMALL_SEGMENT_SIZE;
+        cache->cpus[core_id] = cpu;
+
+        // first core to touch it puts it on the list
+        bool listed = false;
+        if (atomic_compare_exchange_strong(&cache->listed, &listed, true)) {
+            KCache* head = atomic_ldrlx(&kcache_list);
+            do {
+                cache->next = head;
+            } while (!atomic_compare_exchange_weak_explicit(&kcache_list, &head, cache, memory_order_release, memory_order_relaxed));
+        }
+    }
+    return cpu;
+}
+
+// hands the bottom half of the magazine back to the owners, objects which
+// share an owner get linked together so they cost one free_chain.
+static void kcache_flush(KCache* cache, KCacheCPU* cpu) {
+    size_t n = KCACHE_MAG_SIZE / 2;
+    size_t size = cpu->list.block_size;
+
+    FOR_N(i, 0, n) {
+        HeapBlock* first = cpu->mag[i];
+        if (first == NULL) {
+            continue;
+        }
+
+        Heap* owner = heap_segment(first)->heap;
+        HeapBlock* last = first;
+        size_t count = 1;
+        FOR_N(j, i + 1, n) {
+            HeapBlock* block = cpu->mag[j];
+            if (block != NULL && heap_segment(block)->heap == owner) {
+                last->next = block, last = block;
+                cpu->mag[j] = NULL;
+                count += 1;
+            }
+        }
+
+        for (HeapBlock* block = first;; block = block->next) {
+            block->size = size;
+            if (block == last) { break; }
+        }
+
+        HeapFreeList* list = &cache->cpus[owner - local_heaps]->list;
+        fl_free_chain(list, first, last, count*size);
+    }
+
+    cpu->mag_count -= n;
+    FOR_N(i, 0, cpu->mag_count) {
+        cpu->mag[i] = cpu->mag[n + i];
+    }
+}
+
+static void* cache_alloc(KCache* cache) {
+    int core_id = cpu_get_index();
+    KCacheCPU* cpu = kcache_cpu(cache, core_id);
+    if (cpu == NULL) {
+        return NULL;
+    }
+
+    void* obj;
+    if (cpu->mag_count > 0) {
+        obj = cpu->mag[--cpu->mag_count];
+    } else {
+        Heap* heap = &local_heaps[core_id];
+        obj = small_alloc(heap, &cpu->list);
+        if (obj == NULL) {
+            kheap_reclaim();
+            obj = small_alloc(heap, &cpu->list);
+            if (obj == NULL) {
+                ON_DEBUG(KHEAP)(kprintf("[heap] %s: OOM\n", cache->name));
+                return NULL;
+            }
+        }
+    }
+
+    heap_count_alloc(&local_heaps[core_id], HEAP_STATS_SLAB, cpu->list.block_size - cache->obj_size);
+
+    ON_DEBUG(KHEAP)(kprintf("[heap] %s: alloc %p\n", cache->name, obj));
+    return obj;
+}
+
+void* kcache_alloc(KCache* cache) {
+    void* obj = cache_alloc(cache);
+    ON_DEBUG(HEAPPROF)(heap_prof_alloc(obj, cache->obj_size, __builtin_return_address(0)));
+    if (obj != NULL && cache->ctor) {
+        cache->ctor(obj);
+    }
+    return obj;
+}
+
+void* kcache_zalloc(KCache* cache) {
+    void* obj = cache_alloc(cache);
+    ON_DEBUG(HEAPPROF)(heap_prof_alloc(obj, cache->obj_size, __builtin_return_address(0)));
+    if (obj != NULL) {
+        // zeroes first, the ctor gets to build on top of them
+        memset(obj, 0, cache->obj_size);
+        if (cache->ctor) {
+            cache->ctor(obj);
+        }
+    }
+    return obj;
+}
+
+void kcache_free(KCache* cache, void* obj) {
+    ON_DEBUG(HEAPPROF)(heap_prof_free(obj));
+
+    int core_id = cpu_get_index();
+    KCacheCPU* cpu = kcache_cpu(cache, core_id);
+
+    ON_DEBUG(KHEAP)(kprintf("[heap] %s: free %p\n", cache->name, obj));
+    #ifndef NDEBUG
+    memset(obj, 0xCC, cache->obj_size);
+    #endif
+
+    // the owner's list is always there, it's where the object came from
+    Heap* owner = heap_segment(obj)->heap;
+    HeapFreeList* list = &cache->cpus[owner - local_heaps]->list;
+    heap_count_free(owner, HEAP_STATS_SLAB, list->block_size - cache->obj_size);
+
+    if (cpu == NULL) {
+        // couldn't even make our magazine, go straight to the owner
+        fl_free(list, obj, list->block_size);
+        return;
+    }
+
+    if (cpu->mag_count == KCACHE_MAG_SIZE) {
+        kcache_flush(cache, cpu);
+    }
+    cpu->mag[cpu->mag_count++] = obj;
+}
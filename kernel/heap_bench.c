@@ -0,0 +1,144 @@
+// Synthetic kernel object mix for measuring the heap, only built with
+// DEBUG_HEAPBENCH. Core 0 runs it once during boot and prints how long the
+// allocs & frees took along with how much memory the small classes ended up
+// holding compared to what was asked for (and what the old power-of-two
+// classes would've rounded the same requests up to).
+#include <kernel.h>
+#include <beans.h>
+
+#if DEBUG_HEAPBENCH
+enum {
+    // objects live at once
+    HEAPBENCH_LIVE  = 8192,
+    // free one random object & allocate another in its place
+    HEAPBENCH_CHURN = 65536,
+};
+
+typedef struct {
+    const char* name;
+    uint32_t base, per_item;
+    // item count is picked from [min_items, max_items]
+    uint32_t min_items, max_items;
+    uint32_t weight;
+} HeapBenchKind;
+
+typedef struct {
+    void* ptr;
+    uint32_t size;
+} HeapBenchObj;
+
+static const HeapBenchKind bench_kinds[] = {
+    { "event",    sizeof(KObject_Event),   0,                      0,  0,   24 },
+    { "mailbox",  sizeof(KObject_Mailbox), sizeof(atomic_u64[2]),  1,  64,  8  },
+    { "env",      sizeof(Env),             0,                      0,  0,   1  },
+    { "handles",  sizeof(KObject*),        sizeof(KObject*),       1,  48,  16 },
+    { "hashmap",  64,                      16,                     4,  100, 8  },
+    { "mapfile",  0,                       sizeof(MapFileEntry),   1,  32,  8  },
+    { "string",   8,                       1,                      8,  200, 16 },
+};
+
+static uint64_t bench_rng = 0x9E3779B97F4A7C15ull;
+static uint64_t bench_next(void) {
+    bench_rng ^= bench_rng << 13;
+    bench_rng ^= bench_rng >> 7;
+    bench_rng ^= bench_rng << 17;
+    return bench_rng;
+}
+
+static uint32_t bench_size(void) {
+    uint32_t total = 0;
+    FOR_N(i, 0, ELEM_COUNT(bench_kinds)) {
+        total += bench_kinds[i].weight;
+    }
+
+    uint32_t pick = bench_next() % total;
+    const HeapBenchKind* k = bench_kinds;
+    while (pick >= k->weight) {
+        pick -= k->weight, k++;
+    }
+
+    uint32_t items = k->min_items;
+    if (k->max_items > k->min_items) {
+        items += bench_next() % (k->max_items - k->min_items + 1);
+    }
+
+    uint32_t size = k->base + items*k->per_item;
+    return size ? size : 1;
+}
+
+// what the old 64, 128, 256 ... 4096 classes would've handed out
+static uint64_t bench_pow2_size(uint32_t size) {
+    if (size <= 64) {
+        return 64;
+    }
+    return 1ull << (64 - __builtin_clzll(size - 1));
+}
+
+static void bench_small_usage(uint64_t* used, uint64_t* owned) {
+    HeapCoreStats stats;
+    kheap_stats(cpu_get_index(), &stats);
+
+    *used = *owned = 0;
+    FOR_N(i, HEAP_STATS_SMALL, HEAP_STATS_64K) {
+        *used  += stats.classes[i].used_bytes;
+        *owned += stats.classes[i].owned_bytes;
+    }
+}
+
+void kheap_bench(void) {
+    HeapBenchObj* objs = kheap_zalloc(HEAPBENCH_LIVE * sizeof(HeapBenchObj));
+
+    uint64_t base_used, base_owned;
+    bench_small_usage(&base_used, &base_owned);
+
+    // fill, only the small allocs count towards the memory numbers
+    uint64_t requested = 0, pow2 = 0;
+    uint64_t fill_ticks = 0;
+    FOR_N(i, 0, HEAPBENCH_LIVE) {
+        uint32_t size = bench_size();
+
+        uint64_t start = get_time_ticks();
+        objs[i].ptr = kheap_alloc(size);
+        fill_ticks += get_time_ticks() - start;
+
+        objs[i].size = size;
+        if (size < 4096) {
+            requested += size;
+            pow2 += bench_pow2_size(size);
+        }
+    }
+
+    uint64_t used, owned;
+    bench_small_usage(&used, &owned);
+    used -= base_used, owned -= base_owned;
+
+    // churn
+    uint64_t churn_ticks = 0;
+    FOR_N(i, 0, HEAPBENCH_CHURN) {
+        HeapBenchObj* obj = &objs[bench_next() % HEAPBENCH_LIVE];
+        uint32_t size = bench_size();
+
+        uint64_t start = get_time_ticks();
+        kheap_free(obj->ptr, obj->size);
+        obj->ptr = kheap_alloc(size);
+        churn_ticks += get_time_ticks() - start;
+
+        obj->size = size;
+    }
+
+    // drain
+    uint64_t drain_ticks = 0;
+    FOR_N(i, 0, HEAPBENCH_LIVE) {
+        uint64_t start = get_time_ticks();
+        kheap_free(objs[i].ptr, objs[i].size);
+        drain_ticks += get_time_ticks() - start;
+    }
+    kheap_free(objs, HEAPBENCH_LIVE * sizeof(HeapBenchObj));
+
+    kprintf("[heap] bench: %d objects, %d churns\n", HEAPBENCH_LIVE, HEAPBENCH_CHURN);
+    kprintf("[heap]   alloc %llu ticks, churn (free+alloc) %llu ticks, free %llu ticks\n",
+        fill_ticks / HEAPBENCH_LIVE, churn_ticks / HEAPBENCH_CHURN, drain_ticks / HEAPBENCH_LIVE);
+    kprintf("[heap]   small allocs asked for %llu KiB, rounded %llu KiB (pow2 would be %llu KiB), small classes grew by %llu KiB\n",
+        requested / 1024, used / 1024, pow2 / 1024, owned / 1024);
+}
+#endif
@@ -0,0 +1,256 @@
+// Sampling allocation site profiler, only built with DEBUG_HEAPPROF.
+//
+// Every core counts down the bytes it's handed out and once it crosses zero
+// the allocation gets recorded under its return address (the next countdown
+// is randomized so we don't keep landing on the same pattern). Each sample
+// stands in for about HEAPPROF_PERIOD bytes, or itself if it's bigger, so the
+// numbers are estimates but the common case is one subtraction per alloc.
+#include <kernel.h>
+
+#if DEBUG_HEAPPROF
+enum {
+    HEAPPROF_PERIOD = 256*1024,
+
+    // per core, sites which don't fit are just counted as dropped
+    HEAPPROF_SITES_LOG2 = 9,
+    HEAPPROF_SITES  = 1 << HEAPPROF_SITES_LOG2,
+    // sampled objects which haven't been freed yet
+    HEAPPROF_LIVE_LOG2 = 13,
+    HEAPPROF_LIVE   = 1 << HEAPPROF_LIVE_LOG2,
+
+    HEAPPROF_TOP    = 20,
+};
+
+typedef struct {
+    uintptr_t site;
+    uint64_t samples;
+    uint64_t count, bytes;
+
+    // frees can come from any core
+    _Atomic uint64_t freed_count;
+    _Atomic uint64_t freed_bytes;
+} HeapProfSite;
+
+typedef struct {
+    int64_t until_sample;
+    uint64_t rng;
+    uint64_t dropped;
+
+    // we allocate from in here, don't go sampling ourselves
+    bool busy;
+    HeapProfSite* sites;
+} HeapProfCPU;
+
+typedef struct {
+    void* ptr;
+    HeapProfSite* site;
+    uint64_t count, bytes;
+} HeapProfLive;
+
+static HeapProfCPU prof_cpus[MAX_CORES];
+
+static Lock prof_live_lock;
+static size_t prof_live_count;
+static HeapProfLive prof_live[HEAPPROF_LIVE];
+
+// fibonacci hashing, we take the top bits since the bottom ones of page
+// aligned pointers are all the same.
+static size_t prof_hash(uintptr_t x, int bits) {
+    return (x * 11400714819323198485ull) >> (64 - bits);
+}
+
+static HeapProfSite* site_lookup(HeapProfCPU* cpu, uintptr_t site) {
+    size_t mask = HEAPPROF_SITES - 1;
+    size_t i = prof_hash(site, HEAPPROF_SITES_LOG2);
+    FOR_N(probe, 0, HEAPPROF_SITES) {
+        HeapProfSite* s = &cpu->sites[(i + probe) & mask];
+        if (s->site == site) {
+            return s;
+        } else if (s->site == 0) {
+            s->site = site;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static bool live_insert(void* ptr, HeapProfSite* site, uint64_t count, uint64_t bytes) {
+    spin_lock(&prof_live_lock);
+    // keep it at most 3/4ths full, the probes get long otherwise
+    if (prof_live_count >= (HEAPPROF_LIVE / 4) * 3) {
+        spin_unlock(&prof_live_lock);
+        return false;
+    }
+
+    size_t mask = HEAPPROF_LIVE - 1;
+    size_t i = prof_hash((uintptr_t) ptr, HEAPPROF_LIVE_LOG2);
+    while (prof_live[i].ptr != NULL) {
+        i = (i + 1) & mask;
+    }
+
+    prof_live[i] = (HeapProfLive){ ptr, site, count, bytes };
+    prof_live_count += 1;
+    spin_unlock(&prof_live_lock);
+    return true;
+}
+
+static bool live_remove(void* ptr, HeapProfLive* out) {
+    spin_lock(&prof_live_lock);
+
+    size_t mask = HEAPPROF_LIVE - 1;
+    size_t i = prof_hash((uintptr_t) ptr, HEAPPROF_LIVE_LOG2);
+    while (prof_live[i].ptr != ptr) {
+        if (prof_live[i].ptr == NULL) {
+            spin_unlock(&prof_live_lock);
+            return false;
+        }
+        i = (i + 1) & mask;
+    }
+    *out = prof_live[i];
+
+    // backward shift so we don't need tombstones, anything after the hole
+    // which would've landed at or before it moves up.
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; prof_live[j].ptr != NULL; j = (j + 1) & mask) {
+        size_t home = prof_hash((uintptr_t) prof_live[j].ptr, HEAPPROF_LIVE_LOG2);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            prof_live[hole] = prof_live[j];
+            hole = j;
+        }
+    }
+    prof_live[hole].ptr = NULL;
+    prof_live_count -= 1;
+
+    spin_unlock(&prof_live_lock);
+    return true;
+}
+
+bool heapprof_alloc(void* ptr, size_t size, void* site) {
+    HeapProfCPU* cpu = &prof_cpus[cpu_get_index()];
+    cpu->until_sample -= size;
+    if (cpu->until_sample > 0 || cpu->busy || ptr == NULL || size == 0) {
+        return false;
+    }
+
+    cpu->busy = true;
+    if (cpu->sites == NULL) {
+        cpu->sites = kheap_zalloc(HEAPPROF_SITES * sizeof(HeapProfSite));
+        cpu->rng   = (cpu_get_index() + 1) * 0x9E3779B97F4A7C15ull;
+        if (cpu->sites == NULL) {
+            cpu->busy = false;
+            return false;
+        }
+    }
+
+    // xorshift, the next countdown is uniform in [1, 2*PERIOD]
+    cpu->rng ^= cpu->rng << 13;
+    cpu->rng ^= cpu->rng >> 7;
+    cpu->rng ^= cpu->rng << 17;
+    cpu->until_sample = 1 + (cpu->rng % (2*HEAPPROF_PERIOD));
+
+    uint64_t bytes = size < HEAPPROF_PERIOD ? HEAPPROF_PERIOD : size;
+    uint64_t count = bytes / size;
+
+    bool sampled = false;
+    HeapProfSite* s = site_lookup(cpu, (uintptr_t) site);
+    if (s != NULL && live_insert(ptr, s, count, bytes)) {
+        s->samples += 1;
+        s->count   += count;
+        s->bytes   += bytes;
+        sampled = true;
+    } else {
+        cpu->dropped += 1;
+    }
+
+    cpu->busy = false;
+    return sampled;
+}
+
+bool heapprof_free(void* ptr) {
+    HeapProfLive live;
+    if (!live_remove(ptr, &live)) {
+        return false;
+    }
+
+    atomic_fetch_add_explicit(&live.site->freed_count, live.count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&live.site->freed_bytes, live.bytes, memory_order_relaxed);
+    return true;
+}
+
+static void print_site(uintptr_t rip) {
+    if (rip >= boot_info->elf_virtual_ptr) {
+        uint32_t rva = rip - boot_info->elf_virtual_ptr;
+        MapFileEntry* entry = map_entry_get(rva);
+        if (entry != NULL) {
+            kprintf("%s+%d\n", entry->name, rva - entry->rva);
+            return;
+        }
+    }
+    kprintf("%p\n", rip);
+}
+
+void heapprof_dump(void) {
+    // merge every core's sites, the same call site shows up on all of them
+    size_t total = 0;
+    uint64_t dropped = 0;
+    HeapProfSite* merged = kheap_zalloc(boot_info->core_count * HEAPPROF_SITES * sizeof(HeapProfSite));
+    if (merged == NULL) {
+        kprintf("[heap] not enough memory to dump the allocation sites\n");
+        return;
+    }
+    FOR_N(i, 0, boot_info->core_count) {
+        HeapProfCPU* cpu = &prof_cpus[i];
+        dropped += cpu->dropped;
+        if (cpu->sites == NULL) {
+            continue;
+        }
+
+        FOR_N(j, 0, HEAPPROF_SITES) {
+            HeapProfSite* s = &cpu->sites[j];
+            if (s->site == 0) {
+                continue;
+            }
+
+            size_t k = 0;
+            while (k < total && merged[k].site != s->site) {
+                k++;
+            }
+
+            if (k == total) {
+                merged[total++].site = s->site;
+            }
+            merged[k].samples += s->samples;
+            merged[k].count   += s->count;
+            merged[k].bytes   += s->bytes;
+            merged[k].freed_count += atomic_ldrlx(&s->freed_count);
+            merged[k].freed_bytes += atomic_ldrlx(&s->freed_bytes);
+        }
+    }
+
+    kprintf("=== HEAP SITES (%zu, 1 sample per ~%d KiB, %llu dropped) ===\n", total, HEAPPROF_PERIOD / 1024, dropped);
+    kprintf("%10s %10s %10s %10s  %s\n", "KiB", "allocs", "live KiB", "live", "site");
+
+    // top sites by bytes, selection sort since we only want a few
+    FOR_N(i, 0, total < HEAPPROF_TOP ? total : HEAPPROF_TOP) {
+        size_t best = i;
+        FOR_N(j, i + 1, total) {
+            if (merged[j].bytes > merged[best].bytes) {
+                best = j;
+            }
+        }
+
+        HeapProfSite tmp = merged[i];
+        merged[i] = merged[best];
+        merged[best] = tmp;
+
+        HeapProfSite* s = &merged[i];
+        uint64_t live_bytes = s->bytes - atomic_ldrlx(&s->freed_bytes);
+        uint64_t live_count = s->count - atomic_ldrlx(&s->freed_count);
+        kprintf("%10llu %10llu %10llu %10llu  ", s->bytes / 1024, s->count, live_bytes / 1024, live_count);
+        print_site(s->site);
+    }
+    kprintf("\n");
+
+    kheap_free(merged, boot_info->core_count * HEAPPROF_SITES * sizeof(HeapProfSite));
+}
+#endif
@@ -0,0 +1,119 @@
+// Demand paged initrd files, every file opened gets a pager VMO which unpacks
+// whichever LZ4 block a fault lands in (and hands over all of its pages) so a
+// driver only ever pays for the pages it actually touches.
+#include <kernel.h>
+#include <initrd.h>
+
+// Just build it as part of the bigger unit
+#define LZ4_memset(dst, src, n) memset(dst, src, n)
+#define LZ4_memcpy(dst, src, n) memcpy(dst, src, n)
+#define LZ4_memmove(dst, src, n) memmove(dst, src, n)
+#define LZ4_FREESTANDING 1
+#include <lz4.c>
+
+// init can still write to the initrd so we keep our own copy of the sizes, the
+// block table gets checked every time we use it.
+typedef struct {
+    const char* data;
+    uint32_t data_len;
+    uint32_t unpacked_len;
+} InitrdFile;
+
+static bool initrd_pager(KObject_VMO* vmo, size_t offset) {
+    InitrdFile* file = vmo->pager_data;
+
+    size_t block_count = (file->unpacked_len + INITRD_BLOCK_SIZE - 1) / INITRD_BLOCK_SIZE;
+    size_t block = offset / INITRD_BLOCK_SIZE;
+    size_t table_len = block_count * sizeof(uint32_t);
+    if (block >= block_count) {
+        return false;
+    }
+
+    const uint32_t* block_ends = (const uint32_t*) file->data;
+    uint32_t start = block ? block_ends[block - 1] : 0;
+    uint32_t end   = block_ends[block];
+    if (start > end || end > file->data_len - table_len) {
+        kprintf("[initrd] block %zu of %p is out of bounds\n", block, file->data);
+        return false;
+    }
+
+    size_t block_start  = block * INITRD_BLOCK_SIZE;
+    size_t unpacked_len = file->unpacked_len - block_start;
+    if (unpacked_len > INITRD_BLOCK_SIZE) {
+        unpacked_len = INITRD_BLOCK_SIZE;
+    }
+
+    // unpack straight into one allocation, we split it up once it's filled in
+    size_t page_count = (unpacked_len + PAGE_SIZE - 1) / PAGE_SIZE;
+    int order = page_count > 1 ? 64 - __builtin_clzll(page_count - 1) : 0;
+    char* dst = frame_alloc(order, FRAME_USER);
+    if (dst == NULL) {
+        return false;
+    }
+
+    const char* src = file->data + table_len + start;
+    if (end - start == unpacked_len) {
+        // it didn't compress
+        memcpy(dst, src, unpacked_len);
+    } else if (LZ4_decompress_safe(src, dst, end - start, unpacked_len) != unpacked_len) {
+        kprintf("[initrd] block %zu of %p is corrupt\n", block, file->data);
+        frame_free(dst, 0);
+        return false;
+    }
+
+    // the file doesn't have to end on a page
+    memset(dst + unpacked_len, 0, page_count*PAGE_SIZE - unpacked_len);
+
+    // the whole block goes in, readahead is probably gonna want the rest anyways
+    frame_split(dst);
+    FOR_N(i, 0, 1 << order) {
+        if (i < page_count) {
+            vmo_supply(vmo, block_start + i*PAGE_SIZE, dst + i*PAGE_SIZE);
+        } else {
+            frame_free(dst + i*PAGE_SIZE, 0);
+        }
+    }
+    return true;
+}
+
+static void initrd_pager_free(void* pager_data) {
+    kheap_free(pager_data, sizeof(InitrdFile));
+}
+
+KObject_VMO* initrd_open(KObject_VMO* initrd, size_t offset) {
+    // only the real initrd, we're reading it through the identity map
+    uintptr_t initrd_start = kaddr2paddr(boot_info->initrd);
+    if (initrd->paddr < initrd_start || initrd->paddr >= initrd_start + boot_info->initrd_size) {
+        return NULL;
+    }
+
+    size_t initrd_size = initrd_start + boot_info->initrd_size - initrd->paddr;
+    if (initrd->size < initrd_size) {
+        initrd_size = initrd->size;
+    }
+
+    if ((offset & 15) || offset > initrd_size || initrd_size - offset < sizeof(FileEntry)) {
+        return NULL;
+    }
+
+    const FileEntry* entry = paddr2kaddr(initrd->paddr + offset);
+    uint32_t data_len     = entry->data_len;
+    uint32_t unpacked_len = entry->unpacked_len;
+    size_t table_len      = ((unpacked_len + INITRD_BLOCK_SIZE - 1) / INITRD_BLOCK_SIZE) * sizeof(uint32_t);
+    if (unpacked_len == 0 || data_len > initrd_size - offset - sizeof(FileEntry) || table_len > data_len) {
+        return NULL;
+    }
+
+    InitrdFile* file = kheap_alloc(sizeof(InitrdFile));
+    if (file == NULL) {
+        return NULL;
+    }
+    *file = (InitrdFile){ entry->data, data_len, unpacked_len };
+
+    KObject_VMO* vmo = vmo_create_pager(unpacked_len, initrd_pager, initrd_pager_free, file);
+    if (vmo == NULL) {
+        kheap_free(file, sizeof(InitrdFile));
+        return NULL;
+    }
+    return vmo;
+}
@@ -44,8 +44,9 @@ Thread* env_load_elf(Env* env, const u8* program, size_t program_size) {
     ON_DEBUG(ENV)(kprintf("Loading a program! %p\n", program));
     Elf64_Ehdr* elf_header = (Elf64_Ehdr*) program;
 
+    // we only load the trusted programs during boot, there's no one to report OOM to
     KObject_VMO* vmo_ptr = vmo_create_physical(kaddr2paddr((void*) program), program_size, VMEM_PAGE_WRITE | VMEM_PAGE_EXEC);
-    env_grant_rights(env, KACCESS_WRITE, &vmo_ptr->super);
+    kassert(vmo_ptr && env_grant_rights(env, KACCESS_WRITE, &vmo_ptr->super), "OOM");
 
     ////////////////////////////////
     // map segments
@@ -75,24 +76,27 @@ Thread* env_load_elf(Env* env, const u8* program, size_t program_size) {
         ON_DEBUG(ENV)(kprintf("[elf] segment: %p (%d) => ... (%d)\n", segment->p_vaddr, segment->p_memsz, segment->p_filesz));
 
         if (file_size > 0) {
-            vmem_add_range(env, vmo_ptr, vaddr, offset, file_size, VMEM_PAGE_WRITE);
+            kassert(vmem_add_range(env, vmo_ptr, vaddr, offset, file_size, VMEM_PAGE_WRITE), "OOM");
         }
 
         if (mem_size > file_size) {
             // zero pages
-            vmem_add_range(env, NULL, vaddr + file_size, 0, mem_size - file_size, VMEM_PAGE_WRITE);
+            kassert(vmem_add_range(env, NULL, vaddr + file_size, 0, mem_size - file_size, VMEM_PAGE_WRITE), "OOM");
         }
     }
 
     // tiny i know
     size_t stack_size = 2*1024*1024;
-    uintptr_t stack_ptr = vmem_map(env, NULL, 0, 0, stack_size, VMEM_PAGE_WRITE, NULL);
+    uintptr_t stack_ptr = vmem_map(env, NULL, 0, 0, stack_size, VMEM_PAGE_WRITE | VMEM_MAP_TOP_DOWN, NULL);
+    kassert(stack_ptr, "OOM");
 
     ON_DEBUG(ENV)(kprintf("[elf] entry=%p\n", elf_header->e_entry));
     ON_DEBUG(ENV)(kprintf("[elf] stack=%p\n", stack_ptr));
 
     KObject_VMO* initrd_vmo = vmo_create_physical(kaddr2paddr(boot_info->initrd), boot_info->initrd_size, VMEM_PAGE_WRITE);
+    kassert(initrd_vmo, "OOM");
     KObjectID initrd_handle = env_grant_rights(env, KACCESS_WRITE, &initrd_vmo->super);
+    kassert(initrd_handle, "OOM");
 
     return thread_create(env, (ThreadEntryFn*) elf_header->e_entry, initrd_handle, stack_ptr, stack_size);
 }
@@ -144,6 +148,7 @@ void kmain(BootInfo* restrict info) {
 
     arch_init(0);
     ebr_init();
+    ON_DEBUG(HEAPBENCH)(kheap_bench());
 
     if (1) {
         char* stream = boot_info->map_file;
@@ -161,6 +166,7 @@ void kmain(BootInfo* restrict info) {
         }
 
         map_entries = kheap_alloc(line_count * sizeof(MapFileEntry));
+        kassert(map_entries, "OOM");
         while (stream != end) {
             stream += 1;
 
@@ -242,15 +248,20 @@ void kmain(BootInfo* restrict info) {
     };
 
     Env* env = env_create();
+    kassert(env, "OOM");
     void* init_elf_ptr = paddr2kaddr(((uintptr_t) init_elf - boot_info->elf_virtual_ptr) + boot_info->elf_physical_ptr);
     Thread* bootstrap = env_load_elf(env, init_elf_ptr, sizeof(init_elf));
+    kassert(bootstrap, "OOM");
     thread_resume(bootstrap, NULL);
     #endif
 
     kernel_root_mailbox = mailbox_create(boot_info->core_count);
+    kassert(kernel_root_mailbox, "OOM");
 
     // Thread* t = thread_create(NULL, sched_load_balancer, 0, (uintptr_t) kheap_alloc(16384), 16384);
     // thread_resume(t, NULL);
 
+    // the loader's memory is all ours now
+    kheap_release_boot();
     arch_handoff(0);
 }
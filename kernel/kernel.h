@@ -34,6 +34,7 @@ void print_ring_init(void);
 
 void arch_backtrace(void);
 uint64_t arch_get_micros(void);
+uint64_t get_time_ticks(void);
 
 PerCPU* cpu_get(void);
 size_t cpu_get_index(void);
@@ -57,14 +58,143 @@ MapFileEntry* map_entry_get(uint32_t rva);
 ////////////////////////////////
 void  kheap_init(MemMap* mem_map);
 void  kheap_multicore(size_t num_cores);
+// NULL once we're out of memory (after the shrinkers had their go)
 void* kheap_alloc(size_t size);
 void* kheap_zalloc(size_t size);
 void  kheap_free(void* obj, size_t size);
+
+// Shrinkers get called when the heap can't find a segment, they hand back any
+// memory they're holding onto that they don't strictly need (deferred frees,
+// cached frames) and return how many bytes that was. They run on the core that
+// hit the OOM and can't count on allocating anything.
+typedef size_t KShrinkerFn(void);
+void  kheap_register_shrinker(const char* name, KShrinkerFn* fn);
+size_t kheap_reclaim(void);
+
+// telemetry, see HeapCoreStats in beans.h
+struct HeapCoreStats;
+void  kheap_stats(int core_id, struct HeapCoreStats* out);
 void  kheap_dump(void);
 
+// allocation site profiler (only with DEBUG_HEAPPROF), the heap calls these.
+// heapprof_alloc returns true if it decided to sample the object, only those
+// need to come back through heapprof_free.
+bool  heapprof_alloc(void* ptr, size_t size, void* site);
+bool  heapprof_free(void* ptr);
+void  heapprof_dump(void);
+
+// synthetic object mix benchmark (only with DEBUG_HEAPBENCH), see heap_bench.c
+void  kheap_bench(void);
+
 void* kheap_alloc_page(void);
 void  kheap_free_page(void* ptr);
 
+// Slab caches, objects of a single type packed into 64KiB chunks. Each core has
+// a small magazine of recently freed objects it hands out first, frees which
+// belong to other cores get batched back to them once it fills up. The ctor
+// (if any) runs on every alloc (after kcache_zalloc's zeroing), freed objects
+// get written over so there's no "constructed" state to keep around.
+typedef struct KCacheCPU KCacheCPU;
+typedef struct KCache {
+    const char* name;
+    size_t obj_size;
+    size_t align;
+    void (*ctor)(void* obj);
+
+    // filled in lazily by each core
+    KCacheCPU* cpus[MAX_CORES];
+
+    // every cache which got used goes on a list for the telemetry
+    _Atomic(bool) listed;
+    struct KCache* next;
+} KCache;
+
+#define KCACHE_INIT(name_, T, ctor_) { .name = name_, .obj_size = sizeof(T), .align = _Alignof(T), .ctor = ctor_ }
+
+KCache* kcache_create(const char* name, size_t obj_size, size_t align, void (*ctor)(void* obj));
+void* kcache_alloc(KCache* cache);
+void* kcache_zalloc(KCache* cache);
+void  kcache_free(KCache* cache, void* obj);
+
+// refills the pre-zeroed page pool, the idle loop calls this
+void  kheap_idle(void);
+void  kheap_zeroed_stats(uint64_t* out_hits, uint64_t* out_misses, uint64_t* out_pooled);
+
+// raw 2MiB segments, only the frame allocator should be using these. runs of
+// more than one segment are aligned to their size.
+size_t kheap_segment_count(void);
+int   kheap_segment_node(void* ptr);
+void* kheap_alloc_segments(size_t count);
+void  kheap_free_segments(void* ptr, size_t count);
+// a run of segments gets freed one segment at a time after this
+void  kheap_split_segments(void* ptr, size_t count);
+
+// gives the heap the loader & boot services memory, called once at the end of
+// kmain after we're done reading the loader's side of boot_info.
+void  kheap_release_boot(void);
+
+////////////////////////////////
+// Physical frames
+////////////////////////////////
+// Buddy allocator for user pages & page tables, it borrows whole segments from
+// the heap and splits them down to 4KiB. Single frames go through a per-core
+// cache first, freed frames go on the hot end and get handed out again first.
+enum {
+    // 2MiB, anything above this is a whole run of segments
+    FRAME_SEGMENT_ORDER = 9,
+    // 1GiB
+    FRAME_MAX_ORDER = 18,
+};
+
+typedef enum {
+    // head of a block in the buddy lists
+    FRAME_FREE       = 1u << 0,
+    // sitting in some core's cache
+    FRAME_CACHED     = 1u << 1,
+    // head of a block someone's holding
+    FRAME_ALLOCATED  = 1u << 2,
+    FRAME_USER       = 1u << 3,
+    FRAME_PAGE_TABLE = 1u << 4,
+
+    // these only mean something to frame_alloc/frame_free
+    FRAME_ZERO       = 1u << 8,
+    // we don't plan on touching it soon (or we're freeing something we
+    // haven't touched in a while)
+    FRAME_COLD       = 1u << 9,
+} FrameFlags;
+
+// one per 4KiB of physical memory
+typedef struct {
+    _Atomic uint32_t refs;
+    uint16_t flags;
+    uint8_t  order;
+    uint8_t  node;
+
+    // buddy list links (frame numbers)
+    uint32_t next, prev;
+} PageFrame;
+
+extern PageFrame* page_frames;
+
+static inline PageFrame* frame_desc(void* ptr) { return &page_frames[kaddr2paddr(ptr) / PAGE_SIZE]; }
+
+void  frame_init(void);
+void* frame_alloc(int order, uint32_t flags);
+void  frame_free(void* ptr, uint32_t flags);
+// free memory that isn't a whole segment (the heap's leftovers after boot),
+// it's split into the biggest aligned blocks that fit.
+void  frame_donate(void* ptr, size_t count);
+
+// frames start with one reference, the last unref frees it.
+void  frame_ref(void* ptr);
+void  frame_unref(void* ptr);
+// turns one allocation into 4KiB frames with their own refs, they're freed
+// one at a time from then on.
+void  frame_split(void* ptr);
+
+// refills the pre-zeroed frame pool, the idle loop calls this
+void  frame_idle(void);
+
 #define NBHM_ASSERT(x) kassert(x, ":(")
 #include "nbhm.h"
 
@@ -82,6 +212,7 @@ void spall_end_event(int tid);
 typedef _Atomic(uint32_t) RWLock;
 
 bool rwlock_try_lock_shared(RWLock* lock);
+bool rwlock_try_lock_exclusive(RWLock* lock);
 bool rwlock_is_exclusive(RWLock* lock);
 
 void rwlock_lock_shared(RWLock* lock);
@@ -104,6 +235,14 @@ typedef enum {
     VMEM_PAGE_PINNED    = 1u << 3u,
     VMEM_PAGE_UNCACHED  = 1u << 4u,
     VMEM_PAGE_WRITETHRU = 1u << 5u,
+    // anonymous memory which wants (or really doesn't want) 2MiB pages, see
+    // vmem_thp_mode.
+    VMEM_PAGE_HUGE      = 1u << 6u,
+    VMEM_PAGE_NOHUGE    = 1u << 7u,
+
+    // only means something to vmem_map when it's picking the address (it
+    // doesn't get stored), stacks grow down from the top of the address space.
+    VMEM_MAP_TOP_DOWN   = 1u << 8u,
 } VMem_Flags;
 
 // B tree nodes
@@ -115,7 +254,7 @@ enum {
 
 typedef struct {
     uint64_t valid : 1;
-    uint64_t flags : 7;
+    uint64_t flags : 8;
 
     KObject_VMO* vmo;
 
@@ -130,6 +269,11 @@ struct VMem_Node {
     uint8_t is_leaf   : 1;
     uint8_t key_count : 7;
 
+    // where the subtree's last range ends & the biggest hole between any two
+    // of its ranges, lets us find free space without walking every leaf.
+    uintptr_t max_end;
+    size_t max_gap;
+
     uintptr_t keys[VMEM_NODE_MAX_KEYS];
     union {
         VMem_Node* kids[0];    // [VMEM_NODE_MAX_VALS]
@@ -142,27 +286,173 @@ typedef struct {
     size_t index;
 } VMem_Cursor;
 
-// virtual addresses -> committed pages
-typedef NBHM VMem_WorkingSet;
+enum {
+    // every level of a working set's radix tree is a page of these
+    VMEM_WS_FANOUT_LOG2 = 9,
+    VMEM_WS_FANOUT      = 1 << VMEM_WS_FANOUT_LOG2,
+
+    // VMOs bigger than a two level tree are probably sparse, they go in a NBHM
+    VMEM_WS_DENSE_MAX   = PAGE_SIZE << (2*VMEM_WS_FANOUT_LOG2),
+};
 
+// virtual addresses (or VMO offsets) -> committed pages. it's mostly dense ranges
+// so it's a radix tree of page-sized nodes with the physical addresses in the
+// leaves, slots get filled in with a CAS so commits don't need a lock. leaves
+// stick around until the whole thing's freed, there might be someone walking it.
+typedef struct {
+    _Atomic(uintptr_t) root;
+    // levels in the tree, 0 means we're using the hash map
+    int height;
+    NBHM sparse;
+} VMem_WorkingSet;
+
+typedef enum {
+    VMEM_FAULT_OK,
+    // same as OK but the old PTE (the zero page) might still be in other cores'
+    // TLBs, the caller shoots them down once it's let go of the address space.
+    VMEM_FAULT_OK_FLUSH,
+    // nothing's mapped there (or not like that)
+    VMEM_FAULT_SEGV,
+    // it's mapped but we couldn't get a page for it
+    VMEM_FAULT_NO_MEM,
+} VMem_Fault;
+
+typedef enum {
+    // lowest address that fits
+    VMEM_FIT_BOTTOM_UP,
+    // highest address that fits
+    VMEM_FIT_TOP_DOWN,
+} VMem_Fit;
+
+// Readahead, every thread keeps a few fault streams around. once two faults
+// in a row land a fixed stride apart (forwards, backwards, every Nth page) we
+// start committing ahead of the next one, doubling the window on every hit.
+enum {
+    VMEM_RA_STREAMS = 4,
+    // strides past this are just unrelated faults
+    VMEM_RA_MAX_STRIDE = 64*PAGE_SIZE,
+    // pages committed ahead on the second fault of a stream
+    VMEM_RA_MIN_WINDOW = 2,
+};
+
+typedef struct {
+    // where the next fault should land if we're on track, with stride == 0 it's
+    // just the only fault we've seen so far.
+    uintptr_t next_addr;
+    intptr_t stride;
+    uint32_t window;
+    uint32_t last_used;
+} VMem_Stream;
+
+typedef struct {
+    uint32_t clock;
+    VMem_Stream streams[VMEM_RA_STREAMS];
+} VMem_Readahead;
+
+// free range of size bytes (aligned to align) in [lo, hi), 0 if there isn't one
+uintptr_t vmem_find_gap(Env* env, size_t size, size_t align, uintptr_t lo, uintptr_t hi, VMem_Fit fit);
+
+// frames which came out of an address space, other cores might still have
+// them in their TLBs so they wait for the shootdown before being freed.
+typedef struct VMem_ReclaimChunk VMem_ReclaimChunk;
+typedef struct {
+    Env* env;
+    // we took away something a TLB might still be holding
+    bool stale;
+
+    size_t count;
+    VMem_ReclaimChunk* chunks;
+    // frames which didn't fit in a chunk, linked through their descriptors
+    void* overflow;
+} VMem_Reclaim;
+
+// never shoots down by itself, it's fine to push with the address space locked
+void vmem_reclaim_push(VMem_Reclaim* r, void* frame);
+// shoots down (if anything's stale) and then frees everything in the queue. the
+// other threads of the env might be spinning on its lock with interrupts off,
+// so this has to happen after unlocking it.
+void vmem_reclaim_flush(VMem_Reclaim* r);
+
+// user mappings live below this, everything above is the kernel's (and every
+// env shares those page tables)
+#define VMEM_USER_END 0x800000000000ull
+
+// these return 0/false if we couldn't get the memory for it, the caller holds
+// the address space exclusively (or nobody's running in it yet). a fixed vaddr
+// unmaps whatever's there and shoots down right away, so if the env's running
+// that has to be vmem_unmap'd first.
 uintptr_t vmem_map(Env* env, KObject_VMO* vmo, uintptr_t vaddr, size_t offset, size_t size, VMem_Flags flags, uintptr_t* out_paddr);
-void vmem_add_range(Env* env, KObject_VMO* vmo, uintptr_t vaddr, size_t offset, size_t vsize, VMem_Flags flags);
+bool vmem_add_range(Env* env, KObject_VMO* vmo, uintptr_t vaddr, size_t offset, size_t vsize, VMem_Flags flags);
+// tears down the PTEs & private pages too, the caller holds the address space
+// exclusively. the frames go into r, flush it once the lock's been dropped.
+bool vmem_unmap(Env* env, uintptr_t vaddr, size_t size, VMem_Reclaim* r);
 VMem_Cursor vmem_node_lookup(Env* env, uintptr_t key);
 
 // maps a kernel page to a virtual address.
-void vmem_commit_page(Env* env, uintptr_t vaddr, void* kaddr);
+bool vmem_commit_page(Env* env, uintptr_t vaddr, void* kaddr);
 
 uintptr_t vmem_translate(VMem_WorkingSet* ws, uintptr_t vaddr);
-uintptr_t vmem_try_commit(Env* env, VMem_PageDesc* desc, uintptr_t access_addr, uintptr_t start_addr, uintptr_t end_addr);
-
+// covers keys up to size, sparse ones use the hash map instead of the tree
+bool vmem_ws_init(VMem_WorkingSet* ws, size_t size, bool sparse);
+void vmem_ws_free(VMem_WorkingSet* ws);
+// returns the physical page, 0 if we ran out of memory. stale gets set if it
+// replaced the zero page, other cores need a shootdown before anyone writes.
+uintptr_t vmem_try_commit(Env* env, VMem_PageDesc* desc, uintptr_t access_addr, uintptr_t start_addr, uintptr_t end_addr, bool* stale);
+
+// swaps the WRITE/EXEC/caching flags on [addr, addr + size), false if part of
+// it isn't mapped or we ran out of memory splitting.
 bool vmem_protect(Env* env, uintptr_t addr, size_t size, VMem_Flags flags);
-bool vmem_segfault(Env* env, uintptr_t access_addr, bool is_write);
+// swaps the HUGE/NOHUGE flags on [addr, addr + size), same failure cases as vmem_protect
+bool vmem_advise(Env* env, uintptr_t addr, size_t size, VMem_Flags flags);
+VMem_Fault vmem_segfault(Env* env, uintptr_t access_addr, bool is_write);
 
+// the caller holds the address space (shared is fine)
 void vmem_dump(Env* env);
 
 VMem_Cursor vmem_cursor_first(Env* env);
 VMem_Cursor vmem_cursor_next(VMem_Cursor cur);
 
+// Transparent huge pages: the first touch on a 2MiB block of anonymous memory
+// tries to back it with a whole 2MiB frame, if that doesn't work out the block
+// gets queued and the idle loop collapses it once it's filled up.
+typedef enum {
+    VMEM_THP_NEVER,
+    // only ranges with VMEM_PAGE_HUGE
+    VMEM_THP_MADVISE,
+    // everything but ranges with VMEM_PAGE_NOHUGE
+    VMEM_THP_ALWAYS,
+} VMem_THPMode;
+
+// SYS_vmem_stats copies these out as a VMemStats
+typedef struct {
+    _Atomic uint64_t thp_faults;
+    _Atomic uint64_t thp_fallbacks;
+    _Atomic uint64_t thp_promotions;
+    _Atomic uint64_t large_splits;
+    _Atomic uint64_t ra_hits;
+    _Atomic uint64_t ra_misses;
+    _Atomic uint64_t ra_pages;
+} VMem_Counters;
+
+// biggest readahead window in bytes
+extern size_t vmem_readahead_max;
+extern VMem_THPMode vmem_thp_mode;
+extern VMem_Counters vmem_counters;
+
+// tears down the queued dead envs & collapses some of the queued 2MiB
+// blocks, the idle loop calls this
+void vmem_idle(void);
+// hands back every page the VMO committed, it's not mapped anywhere anymore
+void vmem_vmo_release(KObject_VMO* vmo);
+// drops whatever the env had queued up, it's going away
+void vmem_thp_forget(Env* env);
+// someone's about to write into the page without going through the page
+// tables, if the block's being collapsed that gets called off.
+void vmem_thp_touch(Env* env, uintptr_t vaddr);
+// queues up the env's address space to get torn down by the idle loop, safe
+// to call from a fault handler
+void vmem_reap(Env* env);
+
 ////////////////////////////////
 // Kernel objects
 ////////////////////////////////
@@ -198,6 +488,12 @@ struct KObject {
     KObjectID id;
 };
 
+// fills in pages a VMO doesn't have yet (with vmo_supply), it has to supply at least
+// the one at offset but it's free to do more. false if it couldn't.
+typedef bool VMem_PagerFn(KObject_VMO* vmo, size_t offset);
+// called with pager_data once the VMO's last ref is gone
+typedef void VMem_PagerFreeFn(void* pager_data);
+
 // chunk of virtual memory which can be shared across environments
 struct KObject_VMO {
     KObject super; // tag = KOBJECT_VMO
@@ -207,6 +503,22 @@ struct KObject_VMO {
     // simple physical mapping, if paddr=0 then we use the working set
     uintptr_t paddr;
     VMem_WorkingSet pages;
+
+    // copy-on-write clones read through to the parent for any page they
+    // haven't written yet (so they might see the parent's writes until then).
+    KObject_VMO* parent;
+    size_t parent_offset;
+
+    // whoever made it holds one and every clone holds one on its parent
+    _Atomic(uint32_t) refs;
+    // how many descriptors point at it, a clone only gets mapped in one place
+    // at a time.
+    _Atomic(uint32_t) mappings;
+
+    // missing pages come from here instead of being zeroed
+    VMem_PagerFn* pager;
+    VMem_PagerFreeFn* pager_free;
+    void* pager_data;
 };
 
 // Ring buffer of stacks
@@ -240,6 +552,17 @@ extern int pci_dev_count;
 extern PCI_Device* pci_devs[PCI_MAX_DEVICES];
 
 KObject_VMO* vmo_create_physical(uintptr_t addr, size_t size, VMem_Flags flags);
+KObject_VMO* vmo_clone(KObject_VMO* src, size_t offset, size_t size);
+void vmo_ref(KObject_VMO* vmo);
+// the last ref frees it along with its pages, nobody can be holding a handle
+// to it or have it mapped by then.
+void vmo_unref(KObject_VMO* vmo);
+// pager_free can be NULL if there's nothing to clean up
+KObject_VMO* vmo_create_pager(size_t size, VMem_PagerFn* pager, VMem_PagerFreeFn* pager_free, void* pager_data);
+// page is a frame from frame_alloc, it's the VMO's now (or freed if there's already one)
+bool vmo_supply(KObject_VMO* vmo, size_t offset, void* page);
+// pager VMO over the file at offset in the initrd VMO, NULL if there's no file there
+KObject_VMO* initrd_open(KObject_VMO* initrd, size_t offset);
 
 KObject_Mailbox* mailbox_create(size_t max_requests);
 // return the thread we'll be using the respond
@@ -266,6 +589,7 @@ KObjectID store_put(KObject* obj);
 
 #define STORE_GET(x) store_get(&(x)->super)
 KObject* store_get(KObjectID id);
+void store_remove(KObject* obj);
 
 void store_iter(void fn(KObjectID id, KObject* obj));
 void store_dump_all(void);
@@ -293,8 +617,8 @@ struct Env {
         //   "backwards progress" requires everyone to acknowledge the changes. For instance, unmapping a page requires everyone
         //   to acknowledge it or else the data might be corrupted, miss an important segfault.
         RWLock lock;
-        //   when TLB locked, this is the only thread which isn't considered blocked.
-        _Atomic(Thread*) tlb_lock;
+        //   when TLB locked, this is the only core which isn't considered blocked.
+        _Atomic(PerCPU*) tlb_lock;
 
         // B+ tree for intervals
         VMem_Node* root;
@@ -307,13 +631,22 @@ struct Env {
 
         // TLB shootdown checkpoint
         _Alignas(64) atomic_u32 checkpoint_done;
+
+        // next in line for vmem_idle to tear down
+        Env* reap_next;
     } addr_space;
 
+    // set once, by env_mark_dead
+    _Atomic(bool) is_dead;
+
     NBHM access_rights;
 };
 
 Env* env_create(void);
 void env_kill(Env* env);
+// marks every thread as dead & queues up the address space to be torn down,
+// safe to call from a fault handler
+void env_mark_dead(Env* env);
 Thread* env_load_elf(Env* env, const u8* program, size_t program_size);
 
 void* env_get_handle(Env* env, KObjectID id, KAccessRights* rights);
@@ -354,12 +687,33 @@ void arch_handoff(int core_id);
 void arch_wake_up(int core_id);
 uintptr_t arch_canonical_addr(uintptr_t p);
 void arch_set_address_space(Env* env);
-void arch_pte_update(Env* env, uintptr_t access_addr, uintptr_t translated, VMem_Flags flags);
+// false if we couldn't get a frame for one of the page tables
+bool arch_pte_update(Env* env, uintptr_t access_addr, uintptr_t translated, VMem_Flags flags);
+// same as arch_pte_update, old_paddr gets the page it replaced (0 if there wasn't one)
+bool arch_pte_swap(Env* env, uintptr_t access_addr, uintptr_t translated, VMem_Flags flags, uintptr_t* old_paddr);
+// same as arch_pte_update but a PTE that's already present is left alone
+bool arch_pte_fill(Env* env, uintptr_t access_addr, uintptr_t translated, VMem_Flags flags);
+// maps a whole 2MiB or 1GiB page (both addresses aligned to it), false means
+// fall back to 4KiB pages.
+bool arch_pte_update_large(Env* env, uintptr_t access_addr, uintptr_t translated, size_t page_size, VMem_Flags flags);
+// rewrites whichever PTEs are already present in the range, true if any changed
+bool arch_pte_protect(Env* env, uintptr_t vaddr, size_t size, VMem_Flags flags);
+// clears the PTEs in the range, page tables which end up empty go into the
+// reclaim queue.
+void arch_pte_clear(Env* env, uintptr_t vaddr, size_t size, VMem_Reclaim* r);
 
 // broadcast to all cores running an Env that we've modified the address space
 void arch_tlb_shootdown(Env* env);
 void arch_backtrace(void);
 
+// disables interrupts, returns whether they were on before
+bool arch_irq_save(void);
+void arch_irq_restore(bool enabled);
+
+void arch_zero_page(void* page);
+// same as arch_zero_page but it doesn't drag the page into the cache
+void arch_zero_page_nt(void* page);
+
 CPUState new_thread_state(void* entrypoint, uintptr_t arg, uintptr_t stack, size_t stack_size, bool is_user);
 _Noreturn void do_context_switch(CPUState* state, uintptr_t addr_space);
 
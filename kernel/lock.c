@@ -21,6 +21,10 @@ bool rwlock_try_lock_shared(RWLock* lock) {
     return true;
 }
 
+bool rwlock_try_lock_exclusive(RWLock* lock) {
+    return atomic_compare_exchange_strong(lock, &(uint32_t){ 0 }, 1);
+}
+
 bool rwlock_is_exclusive(RWLock* lock) {
     return atomic_load_explicit(lock, memory_order_acquire) == 1;
 }
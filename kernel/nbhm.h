@@ -21,6 +21,9 @@
 //   void* NBHM_FN(put_if_null)(NBHM* hm, void* key, void* val);
 //   void NBHM_FN(resize_barrier)(NBHM* hm);
 //
+// If we can't get memory for a bigger table, put & put_if_null return NULL (the
+// value never got in) and nbhm_alloc hands back a map with a NULL curr.
+//
 #ifndef NBHM_H
 #define NBHM_H
 
@@ -167,7 +170,9 @@ static void nbhm_compute_size(NBHM_Table* table, size_t cap) {
 static NBHM nbhm_alloc(size_t initial_cap) {
     size_t cap = nbhm_compute_cap(initial_cap);
     NBHM_Table* table = EBR_VIRTUAL_ALLOC(sizeof(NBHM_Table) + cap*sizeof(NBHM_Entry));
-    nbhm_compute_size(table, cap);
+    if (table != NULL) {
+        nbhm_compute_size(table, cap);
+    }
     return (NBHM){ .curr = table };
 }
 
@@ -224,11 +229,13 @@ static void* NBHM_FN(migrate_item)(NBHM_Table* table, NBHM_Table* new_table, siz
         return NULL;
     }
 
-    // freeze the values by adding a prime bit.
+    // freeze the values by adding a prime bit. the tombstone has every bit set
+    // so it'd pass for primed if we didn't check for it.
     void* v = atomic_load_explicit(&table->data[i].val, memory_order_relaxed);
-    while (((uintptr_t) v & EBR_PRIME_BIT) == 0) {
+    while (v == NBHM_TOMBSTONE || ((uintptr_t) v & EBR_PRIME_BIT) == 0) {
         uintptr_t primed_v = (v == NBHM_TOMBSTONE ? 0 : (uintptr_t) v) | EBR_PRIME_BIT;
         if (atomic_compare_exchange_strong(&table->data[i].val, &v, (void*) primed_v)) {
+            v = (void*) primed_v;
             break;
         }
         // btw, CAS updated v
@@ -289,6 +296,10 @@ static NBHM_Table* NBHM_FN(resize)(NBHM_Table* table, size_t limit) {
     size_t new_cap = nbhm_compute_cap(limit*2);
 
     NBHM_Table* new_top = EBR_VIRTUAL_ALLOC(sizeof(NBHM_Table) + new_cap*sizeof(NBHM_Entry));
+    if (new_top == NULL) {
+        // we might still have room in the old table, the caller figures it out
+        return atomic_load(&table->next);
+    }
     nbhm_compute_size(new_top, new_cap);
 
     NBHM_Table* exp = NULL;
@@ -352,11 +363,18 @@ static void* NBHM_FN(put_if_match)(NBHM_Table* table, void* key, void* val, void
         // on a bigger table.
         if (next == NULL && !found) {
             next = NBHM_FN(resize)(table, limit);
+            if (next == NULL) {
+                // full and we couldn't grow it
+                return NULL;
+            }
         }
 
-        // Migration barrier, freeze old entry before inserting to new table
+        // Migration barrier, freeze old entry before inserting to new table,
+        // then we go again on the new one.
         if (next != NULL) {
-            return NBHM_FN(migrate_item)(table, next, i);
+            NBHM_FN(migrate_item)(table, next, i);
+            table = next;
+            continue;
         }
 
         // if the existing value is:
@@ -376,7 +394,7 @@ static void* NBHM_FN(put_if_match)(NBHM_Table* table, void* key, void* val, void
                 // and we should write to that later table. if not,
                 // we simply lost the race to update the value.
                 uintptr_t v_raw = (uintptr_t) v;
-                if (v_raw & EBR_PRIME_BIT) {
+                if (v != NBHM_TOMBSTONE && (v_raw & EBR_PRIME_BIT)) {
                     continue;
                 }
             }
@@ -439,8 +457,10 @@ static void* NBHM_FN(raw_lookup)(NBHM_Table* table, uint32_t h, void* key) {
                 break;
             } else if (NBHM_FN(cmp)(k, key)) {
                 // if we see a non-prime, then it's the latest revision
-                if (((uintptr_t) v & EBR_PRIME_BIT) == 0) {
-                    return v != NBHM_TOMBSTONE ? v : NULL;
+                if (v == NBHM_TOMBSTONE) {
+                    return NULL;
+                } else if (((uintptr_t) v & EBR_PRIME_BIT) == 0) {
+                    return v;
                 }
 
                 // found partial-copy
@@ -41,9 +41,13 @@ void store_alloc(void) {
     global_store = nbhm_alloc(4000);
 }
 
+// 0 if the store couldn't grow to fit it
 KObjectID store_put(KObject* obj) {
     KObjectID id = obj->id = ++OBJ_ID_CNT;
-    objstore_hm_put(&global_store, (void*) id, strip_ptr(obj));
+    if (objstore_hm_put(&global_store, (void*) id, strip_ptr(obj)) == NULL) {
+        obj->id = 0;
+        return 0;
+    }
     return id;
 }
 
@@ -52,6 +56,10 @@ KObject* store_get(KObjectID id) {
     return unstrip_ptr(p);
 }
 
+void store_remove(KObject* obj) {
+    objstore_hm_remove(&global_store, (void*) obj->id);
+}
+
 // TODO(NeGate): we want this data sorted...
 void store_iter(void fn(KObjectID id, KObject* obj)) {
     objstore_hm_resize_barrier(&global_store);
@@ -125,6 +133,11 @@ void store_dump_all(void) {
     // Publish all nodes
     size_t i = 0;
     KObject** objs = kheap_alloc(count * sizeof(KObject*));
+    if (objs == NULL) {
+        kprintf("not enough memory to list them\n\n");
+        return;
+    }
+
     nbhm_for(it, &global_store) {
         objs[i++] = unstrip_ptr(it->val);
     }
@@ -139,4 +152,5 @@ void store_dump_all(void) {
     }
 
     kprintf("\n");
+    kheap_free(objs, count * sizeof(KObject*));
 }
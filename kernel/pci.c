@@ -303,6 +303,7 @@ void pci_init(void) {
     ON_DEBUG(PCI)(kprintf("[pci] Scanning for devices!\n"));
 
     PCI_Device* dev = kheap_zalloc(sizeof(PCI_Device));
+    kassert(dev, "OOM");
     dev->super.tag = KOBJECT_DEV_PCI;
 
     if (pci_segment_group) {
@@ -331,6 +332,7 @@ void pci_init(void) {
 
                 // new alloc for the next device we find
                 dev = kheap_zalloc(sizeof(PCI_Device));
+                kassert(dev, "OOM");
                 dev->super.tag = KOBJECT_DEV_PCI;
             }
         }
@@ -349,6 +351,7 @@ void pci_init(void) {
 
                 // new alloc for the next device we find
                 dev = kheap_zalloc(sizeof(PCI_Device));
+                kassert(dev, "OOM");
                 dev->super.tag = KOBJECT_DEV_PCI;
             }
         }
@@ -17,6 +17,21 @@ void* memcpy(void* dest, const void* src, size_t n) {
     return dest;
 }
 
+void* memmove(void* dest, const void* src, size_t n) {
+    u8* d = (u8*)dest;
+    u8* s = (u8*)src;
+    if (d > s && d < s + n) {
+        for (size_t i = n; i--;) {
+            d[i] = s[i];
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            d[i] = s[i];
+        }
+    }
+    return dest;
+}
+
 int memcmp(const void* a, const void* b, size_t n) {
     u8* aa = (u8*)a;
     u8* bb = (u8*)b;
@@ -54,6 +54,12 @@ static bool egest_usermem(uintptr_t dst, void* src, size_t size) {
     return true;
 }
 
+// user ranges can't wrap around or reach into the kernel's half
+static bool user_range_ok(uintptr_t addr, size_t size) {
+    return addr + size >= addr && addr + size <= VMEM_USER_END;
+}
+
+// the caller holds the address space shared, the page stays put until they let go
 static uintptr_t translate_vaddr(Env* env, uintptr_t vaddr) {
     uintptr_t page_aligned = vaddr & -PAGE_SIZE;
     uintptr_t page_offset = (vaddr & PAGE_SIZE - 1);
@@ -73,9 +79,13 @@ static uintptr_t translate_vaddr(Env* env, uintptr_t vaddr) {
         return 0;
     }
 
+    // the page tables might say it's read-only but we don't go through them
+    vmem_thp_touch(env, page_aligned);
+
     VMem_WorkingSet* ws = &env->addr_space.working_set;
     uintptr_t in_space_addr = page_aligned;
-    if (desc->vmo != 0) {
+    // pinned pages are in the env's working set by vaddr, even for VMOs
+    if (desc->vmo != 0 && !(desc->flags & VMEM_PAGE_PINNED)) {
         // Translate address into VMO space
         size_t offset = page_aligned - start_addr;
         in_space_addr = desc->offset + offset;
@@ -86,13 +96,24 @@ static uintptr_t translate_vaddr(Env* env, uintptr_t vaddr) {
             return desc->vmo->paddr + in_space_addr + page_offset;
         }
 
-        // TODO(NeGate): implement pager behavior
         ws = &desc->vmo->pages;
     }
 
     uintptr_t paddr = vmem_translate(ws, in_space_addr);
     if (paddr == 0) {
-        paddr = vmem_try_commit(env, desc, page_aligned, start_addr, end_addr);
+        bool stale = false;
+        paddr = vmem_try_commit(env, desc, page_aligned, start_addr, end_addr, &stale);
+        if (stale) {
+            // we're probably about to write into it. like the fault handler we
+            // can't wait on the other cores while holding the lock, someone
+            // spinning on it might be the one who has to ack.
+            rwlock_unlock_shared(&env->addr_space.lock);
+            arch_tlb_shootdown(env);
+            rwlock_lock_shared(&env->addr_space.lock);
+
+            // it might've been unmapped while we weren't holding it
+            return translate_vaddr(env, vaddr);
+        }
     }
     return paddr ? paddr + page_offset : 0;
 }
@@ -103,9 +124,18 @@ static bool copy_across_spaces(Env* dst, uintptr_t dst_vaddr, const char* src_va
         // EoP is End-of-Page
         size_t eop_dst = (dst_vaddr + PAGE_SIZE) & -PAGE_SIZE;
         if (eop_dst > end_dst) { eop_dst = end_dst; }
-        // Copy subregion of the page
+        // Copy subregion of the page, munmap can't take it from under us while
+        // we're holding the lock.
+        rwlock_lock_shared(&dst->addr_space.lock);
         uintptr_t dst_paddr = translate_vaddr(dst, dst_vaddr);
-        memcpy(paddr2kaddr(dst_paddr), src_vaddr, eop_dst - dst_vaddr);
+        if (dst_paddr != 0) {
+            memcpy(paddr2kaddr(dst_paddr), src_vaddr, eop_dst - dst_vaddr);
+        }
+        rwlock_unlock_shared(&dst->addr_space.lock);
+
+        if (dst_paddr == 0) {
+            return false;
+        }
         // Advance to the next page
         src_vaddr += eop_dst - dst_vaddr;
         dst_vaddr = eop_dst;
@@ -196,25 +226,74 @@ SYS_FN(debug_log) {
     return 0;
 }
 
+SYS_FN(heap_stats) {
+    ON_DEBUG(SYSCALL)(kprintf("SYS_heap_stats(out=%p, max_cores=%d)\n", SYS_PARAM0, SYS_PARAM1));
+
+    // no buffer, just print it
+    if (SYS_PARAM0 == 0) {
+        kheap_dump();
+        return 0;
+    }
+
+    size_t count = boot_info->core_count;
+    if (count > SYS_PARAM1) {
+        count = SYS_PARAM1;
+    }
+    KCHECK(user_range_ok(SYS_PARAM0, count*sizeof(HeapCoreStats)), RESULT_BAD_PERMISSION);
+
+    FOR_N(i, 0, count) {
+        HeapCoreStats stats;
+        kheap_stats(i, &stats);
+        KCHECK(egest_usermem(SYS_PARAM0 + i*sizeof(HeapCoreStats), &stats, sizeof(HeapCoreStats)), RESULT_BAD_PERMISSION);
+    }
+    return count;
+}
+
+SYS_FN(vmem_stats) {
+    ON_DEBUG(SYSCALL)(kprintf("SYS_vmem_stats(out=%p)\n", SYS_PARAM0));
+
+    VMemStats stats = {
+        .thp_faults     = atomic_ldrlx(&vmem_counters.thp_faults),
+        .thp_fallbacks  = atomic_ldrlx(&vmem_counters.thp_fallbacks),
+        .thp_promotions = atomic_ldrlx(&vmem_counters.thp_promotions),
+        .large_splits   = atomic_ldrlx(&vmem_counters.large_splits),
+        .ra_hits        = atomic_ldrlx(&vmem_counters.ra_hits),
+        .ra_misses      = atomic_ldrlx(&vmem_counters.ra_misses),
+        .ra_pages       = atomic_ldrlx(&vmem_counters.ra_pages),
+    };
+    KCHECK(user_range_ok(SYS_PARAM0, sizeof(VMemStats)), RESULT_BAD_PERMISSION);
+    KCHECK(egest_usermem(SYS_PARAM0, &stats, sizeof(VMemStats)), RESULT_BAD_PERMISSION);
+    return 0;
+}
+
+// env_grant_rights hands back 0 if the handle table couldn't grow
+static uintptr_t grant_handle(Env* env, KAccessRights rights, KObject* obj) {
+    KObjectID id = env_grant_rights(env, rights, obj);
+    KCHECK(id, RESULT_NO_MEM);
+    return id;
+}
+
 SYS_FN(env_create) {
     ON_DEBUG(SYSCALL)(kprintf("SYS_env_create()\n"));
     Env* parent = cpu->current_thread->parent;
     Env* env    = env_create();
-    return env_grant_rights(parent, KACCESS_WRITE, &env->super);
+    KCHECK(env, RESULT_NO_MEM);
+    return grant_handle(parent, KACCESS_WRITE, &env->super);
 }
 
 extern KObject_Mailbox* kernel_root_mailbox;
 SYS_FN(get_root_mailbox) {
     ON_DEBUG(SYSCALL)(kprintf("SYS_get_root_mailbox()\n"));
     Env* parent = cpu->current_thread->parent;
-    return env_grant_rights(parent, KACCESS_WRITE, &kernel_root_mailbox->super);
+    return grant_handle(parent, KACCESS_WRITE, &kernel_root_mailbox->super);
 }
 
 SYS_FN(vmo_create) {
     ON_DEBUG(SYSCALL)(kprintf("SYS_vmo_create(paddr=%p, size=%d)\n", SYS_PARAM0, SYS_PARAM1));
     Env* env = cpu->current_thread->parent;
     KObject_VMO* vmo_ptr = vmo_create_physical(SYS_PARAM0, SYS_PARAM1, VMEM_PAGE_WRITE);
-    return env_grant_rights(env, KACCESS_WRITE, &vmo_ptr->super);
+    KCHECK(vmo_ptr, RESULT_NO_MEM);
+    return grant_handle(env, KACCESS_WRITE, &vmo_ptr->super);
 }
 
 SYS_FN(vmo_get_size) {
@@ -227,6 +306,45 @@ SYS_FN(vmo_get_size) {
     return vmo->size;
 }
 
+SYS_FN(vmo_clone) {
+    ON_DEBUG(SYSCALL)(kprintf("SYS_vmo_clone(vmo=%p, offset=%d, size=%d)\n", SYS_PARAM0, SYS_PARAM1, SYS_PARAM2));
+
+    size_t offset = SYS_PARAM1;
+    size_t size   = (SYS_PARAM2 + PAGE_SIZE - 1) & -PAGE_SIZE;
+    KCHECK((offset & (PAGE_SIZE - 1)) == 0, RESULT_BAD_ALIGN);
+    KCHECK(size, 0);
+
+    int res;
+    Env* env = cpu->current_thread->parent;
+    KObject_VMO* vmo;
+    KVALIDATE(GET_OBJ_WITH_RIGHTS(env, SYS_PARAM0, KOBJECT_VMO, 0, &vmo));
+    KCHECK(offset <= vmo->size && size <= vmo->size - offset, 0);
+
+    KObject_VMO* clone = vmo_clone(vmo, offset, size);
+    KCHECK(clone, RESULT_NO_MEM);
+
+    KObjectID id = env_grant_rights(env, KACCESS_WRITE, &clone->super);
+    if (id == 0) {
+        // nobody else has a handle to it, it can go right away
+        vmo_unref(clone);
+        return RESULT_NO_MEM;
+    }
+    return id;
+}
+
+SYS_FN(vmo_create_initrd) {
+    ON_DEBUG(SYSCALL)(kprintf("SYS_vmo_create_initrd(initrd=%p, offset=%d)\n", SYS_PARAM0, SYS_PARAM1));
+
+    int res;
+    Env* env = cpu->current_thread->parent;
+    KObject_VMO* initrd;
+    KVALIDATE(GET_OBJ_WITH_RIGHTS(env, SYS_PARAM0, KOBJECT_VMO, 0, &initrd));
+
+    KObject_VMO* vmo = initrd_open(initrd, SYS_PARAM1);
+    KCHECK(vmo, 0);
+    return grant_handle(env, KACCESS_WRITE, &vmo->super);
+}
+
 SYS_FN(mmap) {
     ON_DEBUG(SYSCALL)(kprintf("SYS_mmap(env=%p, vmo=%p, addr=%p, size=%d, prot=%x, offset=%d)\n", SYS_PARAM0, SYS_PARAM1, SYS_PARAM2, SYS_PARAM3, SYS_PARAM4, SYS_PARAM5));
 
@@ -236,6 +354,7 @@ SYS_FN(mmap) {
 
     uint32_t flags = 0;
     if (prot & PROT_WRITE) { flags |= VMEM_PAGE_WRITE; }
+    if (prot & PROT_EXEC)  { flags |= VMEM_PAGE_EXEC; }
 
     size_t page_aligned_size = (size + PAGE_SIZE - 1) & -PAGE_SIZE;
     KCHECK(page_aligned_size, 0);
@@ -254,12 +373,88 @@ SYS_FN(mmap) {
         KVALIDATE(GET_OBJ_WITH_RIGHTS(env, SYS_PARAM1, KOBJECT_VMO, 0, &vmo));
         flags |= vmo->flags;
 
+        // faults past the end of the VMO have nothing to commit, they'd just
+        // look like we ran out of memory.
+        KCHECK((offset & (PAGE_SIZE - 1)) == 0, RESULT_BAD_ALIGN);
+        KCHECK(offset <= vmo->size && page_aligned_size <= vmo->size - offset, RESULT_BAD_PERMISSION);
+
         if (map_env != env) {
-            env_grant_rights(map_env, 0, &vmo->super);
+            KCHECK(env_grant_rights(map_env, 0, &vmo->super), RESULT_NO_MEM);
         }
     }
 
-    return vmem_map(map_env, vmo, SYS_PARAM2, offset, page_aligned_size, flags, NULL);
+    // a fixed address unmaps whatever was there first
+    KCHECK(SYS_PARAM2 == 0 || user_range_ok(SYS_PARAM2, page_aligned_size), RESULT_BAD_PERMISSION);
+
+    // the shootdown waits until we've let go of the lock, the env's other
+    // threads might be spinning on it with interrupts off.
+    VMem_Reclaim r = { .env = map_env };
+    rwlock_lock_exclusive(&map_env->addr_space.lock);
+    uintptr_t mapped = 0;
+    if (SYS_PARAM2 == 0 || vmem_unmap(map_env, SYS_PARAM2, page_aligned_size, &r)) {
+        mapped = vmem_map(map_env, vmo, SYS_PARAM2, offset, page_aligned_size, flags, NULL);
+    }
+    rwlock_unlock_exclusive(&map_env->addr_space.lock);
+    vmem_reclaim_flush(&r);
+
+    KCHECK(mapped, RESULT_NO_MEM);
+    return mapped;
+}
+
+SYS_FN(mprotect) {
+    ON_DEBUG(SYSCALL)(kprintf("SYS_mprotect(env=%p, addr=%p, size=%d, prot=%x)\n", SYS_PARAM0, SYS_PARAM1, SYS_PARAM2, SYS_PARAM3));
+
+    uintptr_t addr = SYS_PARAM1;
+    size_t size    = SYS_PARAM2;
+    uint32_t prot  = SYS_PARAM3;
+    KCHECK((addr & (PAGE_SIZE - 1)) == 0, RESULT_BAD_ALIGN);
+
+    uint32_t flags = 0;
+    if (prot & PROT_WRITE) { flags |= VMEM_PAGE_WRITE; }
+    if (prot & PROT_EXEC)  { flags |= VMEM_PAGE_EXEC; }
+
+    size_t page_aligned_size = (size + PAGE_SIZE - 1) & -PAGE_SIZE;
+    KCHECK(page_aligned_size, 0);
+    KCHECK(user_range_ok(addr, page_aligned_size), RESULT_BAD_PERMISSION);
+
+    Env* env = cpu->current_thread->parent;
+
+    int res;
+    Env* map_env = env;
+    if (SYS_PARAM0) {
+        KVALIDATE(GET_OBJ_WITH_RIGHTS(env, SYS_PARAM0, KOBJECT_ENV, KACCESS_WRITE, &map_env));
+    }
+
+    KCHECK(vmem_protect(map_env, addr, page_aligned_size, flags), RESULT_NO_MEM);
+    return 0;
+}
+
+SYS_FN(madvise) {
+    ON_DEBUG(SYSCALL)(kprintf("SYS_madvise(env=%p, addr=%p, size=%d, advice=%d)\n", SYS_PARAM0, SYS_PARAM1, SYS_PARAM2, SYS_PARAM3));
+
+    uintptr_t addr  = SYS_PARAM1;
+    size_t size     = SYS_PARAM2;
+    uint32_t advice = SYS_PARAM3;
+    KCHECK((addr & (PAGE_SIZE - 1)) == 0, RESULT_BAD_ALIGN);
+
+    uint32_t flags = 0;
+    if (advice == MADV_HUGEPAGE)   { flags |= VMEM_PAGE_HUGE; }
+    if (advice == MADV_NOHUGEPAGE) { flags |= VMEM_PAGE_NOHUGE; }
+
+    size_t page_aligned_size = (size + PAGE_SIZE - 1) & -PAGE_SIZE;
+    KCHECK(page_aligned_size, 0);
+    KCHECK(user_range_ok(addr, page_aligned_size), RESULT_BAD_PERMISSION);
+
+    Env* env = cpu->current_thread->parent;
+
+    int res;
+    Env* map_env = env;
+    if (SYS_PARAM0) {
+        KVALIDATE(GET_OBJ_WITH_RIGHTS(env, SYS_PARAM0, KOBJECT_ENV, KACCESS_WRITE, &map_env));
+    }
+
+    KCHECK(vmem_advise(map_env, addr, page_aligned_size, flags), RESULT_NO_MEM);
+    return 0;
 }
 
 SYS_FN(mdump) {
@@ -272,7 +467,10 @@ SYS_FN(mdump) {
         KCHECK(env->super.tag == KOBJECT_ENV, RESULT_WRONG_HANDLE);
     }
 
+    // it walks the whole tree, nothing can be taking nodes out from under it
+    rwlock_lock_shared(&env->addr_space.lock);
     vmem_dump(env);
+    rwlock_unlock_shared(&env->addr_space.lock);
     return 0;
 }
 
@@ -280,7 +478,9 @@ SYS_FN(get_paddr) {
     ON_DEBUG(SYSCALL)(kprintf("SYS_get_paddr(vaddr=%p)\n", SYS_PARAM0));
 
     Env* env = cpu->current_thread->parent;
+    rwlock_lock_shared(&env->addr_space.lock);
     uintptr_t paddr = translate_vaddr(env, SYS_PARAM0);
+    rwlock_unlock_shared(&env->addr_space.lock);
     return paddr;
 }
 
@@ -299,27 +499,45 @@ SYS_FN(mpin) {
     }
 
     uintptr_t paddr;
+    rwlock_lock_exclusive(&env->addr_space.lock);
     uintptr_t mapped = vmem_map(env, vmo, 0, SYS_PARAM1, page_aligned_size, VMEM_PAGE_WRITE | VMEM_PAGE_PINNED, &paddr);
+    rwlock_unlock_exclusive(&env->addr_space.lock);
+    KCHECK(mapped, RESULT_NO_MEM);
 
     egest_usermem(SYS_PARAM3, &paddr, sizeof(uintptr_t));
     return mapped;
 }
 
 SYS_FN(munmap) {
-    ON_DEBUG(SYSCALL)(kprintf("SYS_munmap()\n"));
-    Env* env = cpu->current_thread->parent;
+    ON_DEBUG(SYSCALL)(kprintf("SYS_munmap(env=%p, addr=%p, size=%d)\n", SYS_PARAM0, SYS_PARAM1, SYS_PARAM2));
 
-    // we can't have multiple writers on the interval tree at once
-    // but we don't need a TLB shootdown until page writing.
-    rwlock_lock_exclusive(&env->addr_space.lock);
+    uintptr_t addr = SYS_PARAM1;
+    size_t size    = SYS_PARAM2;
+    KCHECK((addr & (PAGE_SIZE - 1)) == 0, RESULT_BAD_ALIGN);
 
-    // TODO(NeGate): actually remove the PTEs
+    size_t page_aligned_size = (size + PAGE_SIZE - 1) & -PAGE_SIZE;
+    KCHECK(page_aligned_size, 0);
+    KCHECK(user_range_ok(addr, page_aligned_size), RESULT_BAD_PERMISSION);
 
-    arch_tlb_shootdown(env);
+    Env* env = cpu->current_thread->parent;
 
-    // TODO(NeGate): actually recycle the memory from those PTEs
+    int res;
+    Env* map_env = env;
+    if (SYS_PARAM0) {
+        KVALIDATE(GET_OBJ_WITH_RIGHTS(env, SYS_PARAM0, KOBJECT_ENV, KACCESS_WRITE, &map_env));
+    }
 
-    rwlock_unlock_exclusive(&env->addr_space.lock);
+    // unmapping is backwards progress, nobody can fault on the range while
+    // we're tearing it down. the frames wait for the shootdown before they get
+    // reused, that happens once the lock's dropped since the other threads
+    // might be spinning on it with interrupts off.
+    VMem_Reclaim r = { .env = map_env };
+    rwlock_lock_exclusive(&map_env->addr_space.lock);
+    bool ok = vmem_unmap(map_env, addr, page_aligned_size, &r);
+    rwlock_unlock_exclusive(&map_env->addr_space.lock);
+    vmem_reclaim_flush(&r);
+
+    KCHECK(ok, RESULT_NO_MEM);
     return 0;
 }
 
@@ -344,10 +562,12 @@ SYS_FN(thread_create) {
         KCHECK(obj, RESULT_BAD_PERMISSION);
 
         // import argument as handle
-        env_grant_rights(t_env, KACCESS_WRITE, obj);
+        KCHECK(env_grant_rights(t_env, KACCESS_WRITE, obj), RESULT_NO_MEM);
     }
 
-    uintptr_t stack_ptr = vmem_map(t_env, 0, 0, 0, stack_size, VMEM_PAGE_WRITE, NULL);
+    rwlock_lock_exclusive(&t_env->addr_space.lock);
+    uintptr_t stack_ptr = vmem_map(t_env, 0, 0, 0, stack_size, VMEM_PAGE_WRITE | VMEM_MAP_TOP_DOWN, NULL);
+    rwlock_unlock_exclusive(&t_env->addr_space.lock);
     KCHECK(stack_ptr, RESULT_NO_MEM);
 
     Thread* thread = thread_create(t_env, fn, arg, stack_ptr, stack_size);
@@ -355,7 +575,7 @@ SYS_FN(thread_create) {
 
     // make an accessible handle for the thread
     thread_resume(thread, NULL);
-    return env_grant_rights(env, KACCESS_WRITE, &thread->super);
+    return grant_handle(env, KACCESS_WRITE, &thread->super);
 }
 
 SYS_FN(thread_setattr) {
@@ -386,7 +606,8 @@ SYS_FN(event_create) {
     ON_DEBUG(SYSCALL)(kprintf("SYS_event_create()\n"));
     Env* parent = cpu->current_thread->parent;
     KObject_Event* event = event_create();
-    return env_grant_rights(parent, 0, &event->super);
+    KCHECK(event, RESULT_NO_MEM);
+    return grant_handle(parent, 0, &event->super);
 }
 
 SYS_FN(event_wait) {
@@ -455,7 +676,7 @@ SYS_FN(pci_claim_device) {
         u32 key = (dev->vendor_id << 16ull) | dev->device_id;
 
         egest_usermem(SYS_PARAM1, &key, sizeof(u32));
-        return env_grant_rights(env, KACCESS_WRITE, &dev->super);
+        return grant_handle(env, KACCESS_WRITE, &dev->super);
     }
 
     return 0;
@@ -533,10 +754,8 @@ SYS_FN(mailbox_create) {
 
     Env* env = cpu->current_thread->parent;
     KObject_Mailbox* mailbox = mailbox_create(SYS_PARAM0);
-    if (mailbox == NULL) {
-        return 0;
-    }
-    return env_grant_rights(env, 0, &mailbox->super);
+    KCHECK(mailbox, RESULT_NO_MEM);
+    return grant_handle(env, 0, &mailbox->super);
 }
 
 static KHandle ingest_user_handle(uintptr_t ptr) {
@@ -1,4 +1,6 @@
 #include "threads.h"
+
+static KCache thread_cache = KCACHE_INIT("thread", Thread, NULL);
 
 static Server* get_sched(void) {
     return &cpu_get()->sched;
@@ -8,15 +10,34 @@ static Server* get_sched(void) {
 //
 // from here, the kernel may load an app into memory with the user-land loader
 // and we have executables.
+// undoes a half-built env_create
+static void env_free(Env* env) {
+    vmem_ws_free(&env->addr_space.working_set);
+    nbhm_free(&env->access_rights);
+    if (env->addr_space.hw_tables != NULL) {
+        frame_free(env->addr_space.hw_tables, 0);
+    }
+    kheap_free(env, sizeof(Env));
+}
+
 Env* env_create(void) {
     Env* env = kheap_zalloc(sizeof(Env));
+    if (env == NULL) {
+        return NULL;
+    }
+
     env->super.tag = KOBJECT_ENV;
-    env->addr_space.working_set = nbhm_alloc(100);
+    // shaped just like the page tables, it's only got the lower half to cover
+    vmem_ws_init(&env->addr_space.working_set, VMEM_USER_END, false);
     env->access_rights = nbhm_alloc(50);
+    env->addr_space.hw_tables = frame_alloc(0, FRAME_ZERO | FRAME_PAGE_TABLE);
+    if (env->access_rights.curr == NULL || env->addr_space.hw_tables == NULL || STORE_PUT(env) == 0) {
+        env_free(env);
+        return NULL;
+    }
 
     #ifdef __x86_64__
     // copy over the kernel's higher half pages bar for bar.
-    env->addr_space.hw_tables = kheap_alloc_page();
     for (size_t i = 512; (i--) > 256;) {
         u64 src_page = boot_info->kernel_pml4->entries[i];
         if (src_page == 0) { break; }
@@ -26,7 +47,6 @@ Env* env_create(void) {
     #error "TODO"
     #endif
 
-    STORE_PUT(env);
     kprintf("[env]  %p | HW Tables at %p\n", env, env->addr_space.hw_tables);
     return env;
 }
@@ -43,14 +63,37 @@ void env_kill(Env* env) {
     }
 
     env->first_in_env = env->last_in_env = NULL;
-    kheap_free_page(env->addr_space.hw_tables);
+    vmem_thp_forget(env);
+    frame_free(env->addr_space.hw_tables, 0);
     spin_unlock(&env->lock);
 }
 
+void env_mark_dead(Env* env) {
+    // a few threads might fault their way in here at once
+    if (atomic_exchange(&env->is_dead, true)) {
+        return;
+    }
+
+    // the scheduler reaps them once they come up
+    spin_lock(&env->lock);
+    for (Thread* t = env->first_in_env; t != NULL; t = t->next_in_env) {
+        t->client.is_dead = true;
+    }
+    spin_unlock(&env->lock);
+
+    // some of them might still be running elsewhere, the memory goes once the
+    // idle loop can get the address space to itself.
+    vmem_reap(env);
+}
+
 Thread* thread_create(Env* env, ThreadEntryFn* entrypoint, uintptr_t arg, uintptr_t stack, size_t stack_size) {
     bool is_user = env != NULL;
 
-    Thread* new_thread = kheap_alloc(sizeof(Thread));
+    Thread* new_thread = kcache_alloc(&thread_cache);
+    if (new_thread == NULL) {
+        return NULL;
+    }
+
     *new_thread = (Thread){
         .super = {
             .tag = KOBJECT_THREAD,
@@ -61,7 +104,10 @@ Thread* thread_create(Env* env, ThreadEntryFn* entrypoint, uintptr_t arg, uintpt
     };
     new_thread->client.weight = 10;
     new_thread->client.slice  = 1000;
-    STORE_PUT(new_thread);
+    if (STORE_PUT(new_thread) == 0) {
+        kcache_free(&thread_cache, new_thread);
+        return NULL;
+    }
 
     new_thread->client.id = new_thread->super.id;
     snprintf(new_thread->tag, 32, "Thread-%d", new_thread->client.id);
@@ -98,8 +144,6 @@ void thread_resume(Thread* thread, PerCPU* cpu) {
 }
 
 void thread_kill(Thread* thread) {
-    kheap_free(thread, sizeof(Thread));
-
     // TODO(NeGate): remove from schedule
     // ...
 
@@ -125,4 +169,6 @@ void thread_kill(Thread* thread) {
         // unlock env
         spin_unlock(&env->lock);
     }
+
+    kcache_free(&thread_cache, thread);
 }
@@ -28,12 +28,9 @@ struct Thread {
     Thread* calling_thread;
     uintptr_t saved_sp;
 
-    // Address space optimization, we track the last faulted address.
+    // Address space optimization, we track the last few fault streams.
     // If we keep faulting in an array like
-    struct {
-        uintptr_t base_addr;
-        uintptr_t next_addr;
-    } last_touch;
+    VMem_Readahead readahead;
 
     char tag[32];
 
@@ -2,7 +2,37 @@
 #include "threads.h"
 
 enum {
+    // NBHM keys can't be NULL
     VMEM_WORKING_SET_OFFSET = 1,
+    VMEM_PAGE_SHIFT = 12,
+
+    // nodes have at least 8 kids so this is plenty
+    VMEM_MAX_DEPTH = 16,
+
+    // frames per reclaim chunk, the chunk is exactly one page
+    VMEM_RECLAIM_CHUNK = PAGE_SIZE / sizeof(void*) - 1,
+};
+
+// where vmem_map looks when it gets to pick the address, the top is the end of
+// the lower half on x64.
+#define VMEM_SEARCH_BASE 0xA0000000ull
+#define VMEM_SEARCH_END  VMEM_USER_END
+#define VMEM_LARGE_PAGE  ((size_t) PAGE_SIZE << FRAME_SEGMENT_ORDER)
+
+// the bits vmem_protect gets to change, the rest stick with the descriptor
+#define VMEM_PROTECT_MASK (VMEM_PAGE_WRITE | VMEM_PAGE_EXEC | VMEM_PAGE_UNCACHED | VMEM_PAGE_WRITETHRU)
+// same deal for vmem_advise
+#define VMEM_ADVISE_MASK  (VMEM_PAGE_HUGE | VMEM_PAGE_NOHUGE)
+
+// leaves and internal nodes only differ in what the trailing array holds
+static KCache vmem_leaf_cache = {
+    .name = "vmem_leaf", .align = _Alignof(VMem_Node),
+    .obj_size = sizeof(VMem_Node) + VMEM_NODE_MAX_VALS*sizeof(VMem_PageDesc),
+};
+
+static KCache vmem_inner_cache = {
+    .name = "vmem_inner", .align = _Alignof(VMem_Node),
+    .obj_size = sizeof(VMem_Node) + VMEM_NODE_MAX_VALS*sizeof(VMem_Node*),
 };
 
 uint32_t vmem_addrhm_hash(const void* k) {
@@ -29,8 +59,185 @@ bool vmem_addrhm_cmp(const void* a, const void* b) {
 
 #define NBHM_FN(n) vmem_addrhm_ ## n
 #include <nbhm.h>
+
+////////////////////////////////
+// Working sets
+////////////////////////////////
+bool vmem_ws_init(VMem_WorkingSet* ws, size_t size, bool sparse) {
+    if (sparse) {
+        size_t init_pages = size / PAGE_SIZE;
+        if (init_pages < 4)   { init_pages = 4;   }
+        if (init_pages > 100) { init_pages = 100; }
+
+        *ws = (VMem_WorkingSet){ .sparse = nbhm_alloc(init_pages) };
+        return ws->sparse.curr != NULL;
+    }
+
+    // just enough levels to reach the last page, the root only shows up once
+    // something gets committed.
+    size_t last_page = size ? (size - 1) >> VMEM_PAGE_SHIFT : 0;
+    int height = 1;
+    while (height*VMEM_WS_FANOUT_LOG2 < 64 && (last_page >> (height*VMEM_WS_FANOUT_LOG2)) != 0) {
+        height++;
+    }
+
+    *ws = (VMem_WorkingSet){ .height = height };
+    return true;
+}
+
+static void vmem_ws_free_node(uintptr_t node, int level) {
+    if (level > 0) {
+        _Atomic(uintptr_t)* kids = (_Atomic(uintptr_t)*) node;
+        FOR_N(i, 0, VMEM_WS_FANOUT) {
+            uintptr_t kid = atomic_ldrlx(&kids[i]);
+            if (kid != 0) {
+                vmem_ws_free_node(kid, level - 1);
+            }
+        }
+    }
+    frame_free((void*) node, 0);
+}
+
+// only the tree goes away, whatever pages were in it are the caller's problem
+void vmem_ws_free(VMem_WorkingSet* ws) {
+    if (ws->height == 0) {
+        nbhm_free(&ws->sparse);
+        return;
+    }
+
+    uintptr_t root = atomic_ldrlx(&ws->root);
+    if (root != 0) {
+        vmem_ws_free_node(root, ws->height - 1);
+    }
+    ws->root = 0;
+}
+
+// which slot the key lands in at some level, the leaves are level 0
+static size_t vmem_ws_index(uintptr_t key, int level) {
+    return (key >> (VMEM_PAGE_SHIFT + level*VMEM_WS_FANOUT_LOG2)) & (VMEM_WS_FANOUT - 1);
+}
+
+// the leaf slot for the key, any missing nodes get put in if alloc is set. NULL
+// if there's no leaf (or we couldn't make one) or the key's past the tree. the
+// rest of the leaf's slots are right next to it.
+static _Atomic(uintptr_t)* vmem_ws_slot(VMem_WorkingSet* ws, uintptr_t key, bool alloc) {
+    kassert(ws->height > 0, "sparse working sets don't have slots");
+
+    size_t bits = VMEM_PAGE_SHIFT + ws->height*VMEM_WS_FANOUT_LOG2;
+    if (bits < 64 && (key >> bits) != 0) {
+        return NULL;
+    }
+
+    _Atomic(uintptr_t)* slot = &ws->root;
+    for (int level = ws->height; level--;) {
+        uintptr_t node = atomic_load_explicit(slot, memory_order_acquire);
+        if (node == 0) {
+            if (!alloc) {
+                return NULL;
+            }
+
+            void* new_node = frame_alloc(0, FRAME_ZERO);
+            if (new_node == NULL) {
+                return NULL;
+            }
+
+            // if we lose, we just walk into whoever won's node
+            if (atomic_compare_exchange_strong_explicit(slot, &node, (uintptr_t) new_node, memory_order_acq_rel, memory_order_acquire)) {
+                node = (uintptr_t) new_node;
+            } else {
+                frame_free(new_node, 0);
+            }
+        }
+        slot = &((_Atomic(uintptr_t)*) node)[vmem_ws_index(key, level)];
+    }
+    return slot;
+}
+
+uintptr_t vmem_translate(VMem_WorkingSet* ws, uintptr_t vaddr) {
+    if (ws->height == 0) {
+        return (uintptr_t) vmem_addrhm_get(&ws->sparse, (char*) (vaddr + VMEM_WORKING_SET_OFFSET));
+    }
+
+    _Atomic(uintptr_t)* slot = vmem_ws_slot(ws, vaddr, false);
+    return slot ? atomic_load_explicit(slot, memory_order_acquire) : 0;
+}
+
+// returns whichever page ended up there, 0 if the working set couldn't grow
+static uintptr_t vmem_ws_put_if_null(VMem_WorkingSet* ws, uintptr_t key, uintptr_t page) {
+    if (ws->height == 0) {
+        return (uintptr_t) vmem_addrhm_put_if_null(&ws->sparse, (void*) (key + VMEM_WORKING_SET_OFFSET), (void*) page);
+    }
+
+    _Atomic(uintptr_t)* slot = vmem_ws_slot(ws, key, true);
+    if (slot == NULL) {
+        return 0;
+    }
+
+    uintptr_t old = 0;
+    if (atomic_compare_exchange_strong_explicit(slot, &old, page, memory_order_acq_rel, memory_order_acquire)) {
+        return page;
+    }
+    return old;
+}
+
+static bool vmem_ws_set(VMem_WorkingSet* ws, uintptr_t key, uintptr_t page) {
+    if (ws->height == 0) {
+        return vmem_addrhm_put(&ws->sparse, (void*) (key + VMEM_WORKING_SET_OFFSET), (void*) page) != NULL;
+    }
+
+    _Atomic(uintptr_t)* slot = vmem_ws_slot(ws, key, true);
+    if (slot == NULL) {
+        return false;
+    }
+    atomic_store_explicit(slot, page, memory_order_release);
+    return true;
+}
+
+// takes the page out, returns whatever was there
+static uintptr_t vmem_ws_remove(VMem_WorkingSet* ws, uintptr_t key) {
+    if (ws->height == 0) {
+        return (uintptr_t) vmem_addrhm_remove(&ws->sparse, (void*) (key + VMEM_WORKING_SET_OFFSET));
+    }
+
+    // the leaf stays, a syscall might be walking through it without the lock
+    _Atomic(uintptr_t)* slot = vmem_ws_slot(ws, key, false);
+    return slot ? atomic_exchange_explicit(slot, 0, memory_order_acq_rel) : 0;
+}
+
+// commits count physically contiguous pages starting at key, it stops at the
+// first one which is already taken and returns how many made it. the tree only
+// gets walked once per leaf.
+static size_t vmem_ws_fill(VMem_WorkingSet* ws, uintptr_t key, uintptr_t paddr, size_t count) {
+    _Atomic(uintptr_t)* slot = NULL;
+    FOR_N(i, 0, count) {
+        uintptr_t page = paddr + i*PAGE_SIZE;
+        uintptr_t addr = key + i*PAGE_SIZE;
+        if (ws->height == 0) {
+            if (vmem_ws_put_if_null(ws, addr, page) != page) {
+                return i;
+            }
+            continue;
+        }
+
+        // crossing into the next leaf
+        if (slot == NULL || vmem_ws_index(addr, 0) == 0) {
+            slot = vmem_ws_slot(ws, addr, true);
+            if (slot == NULL) {
+                return i;
+            }
+        } else {
+            slot++;
+        }
+
+        uintptr_t old = 0;
+        if (!atomic_compare_exchange_strong_explicit(slot, &old, page, memory_order_acq_rel, memory_order_acquire)) {
+            return i;
+        }
+    }
+    return count;
+}
 
-static size_t vmem_node_bin_search(VMem_Node* node, uint32_t key) {
+static size_t vmem_node_bin_search(VMem_Node* node, uintptr_t key) {
     size_t left = 0, right = node->key_count;
     if (node->is_leaf) {
         while (left != right) {
@@ -61,6 +268,10 @@ static size_t vmem_node_bin_search(VMem_Node* node, uint32_t key) {
 
 VMem_Cursor vmem_cursor_first(Env* env) {
     VMem_Node* node = env->addr_space.root;
+    if (node == NULL) {
+        return (VMem_Cursor){ 0 };
+    }
+
     while (!node->is_leaf) {
         node = node->kids[0];
     }
@@ -108,13 +319,173 @@ VMem_Cursor vmem_node_lookup(Env* env, uintptr_t key) {
     }
 }
 
-void vmem_node_split_child(VMem_Node* x, VMem_Node* y, int idx) {
-    VMem_Node* z = kheap_alloc(sizeof(VMem_Node) + VMEM_NODE_MAX_VALS*(y->is_leaf ? sizeof(VMem_PageDesc) : sizeof(VMem_Node*)));
+////////////////////////////////
+// Gap index
+////////////////////////////////
+static VMem_Node* vmem_leftmost_leaf(VMem_Node* node) {
+    while (!node->is_leaf) {
+        node = node->kids[0];
+    }
+    return node;
+}
+
+static VMem_Node* vmem_rightmost_leaf(VMem_Node* node) {
+    while (!node->is_leaf) {
+        node = node->kids[node->key_count];
+    }
+    return node;
+}
+
+static void vmem_node_update(VMem_Node* node) {
+    int n = node->key_count;
+    size_t gap = 0;
+    if (node->is_leaf) {
+        for (int i = 1; i < n; i++) {
+            uintptr_t end = node->keys[i - 1] + node->vals[i - 1].size;
+            if (node->keys[i] - end > gap) {
+                gap = node->keys[i] - end;
+            }
+        }
+        node->max_end = n > 0 ? node->keys[n - 1] + node->vals[n - 1].size : 0;
+    } else {
+        // every separator is the first key on its right so the hole between two
+        // kids is separator - end of the left one.
+        for (int i = 0; i <= n; i++) {
+            VMem_Node* kid = node->kids[i];
+            if (kid->max_gap > gap) {
+                gap = kid->max_gap;
+            }
+            if (i < n && node->keys[i] - kid->max_end > gap) {
+                gap = node->keys[i] - kid->max_end;
+            }
+        }
+        node->max_end = node->kids[n]->max_end;
+    }
+    node->max_gap = gap;
+}
+
+// fixes up the gap info from the leaf holding key back up to the root
+static void vmem_node_refresh(Env* env, uintptr_t key) {
+    int depth = 0;
+    VMem_Node* path[VMEM_MAX_DEPTH];
+    for (VMem_Node* node = env->addr_space.root; node != NULL;) {
+        kassert(depth < VMEM_MAX_DEPTH, "vmem tree's too deep");
+        path[depth++] = node;
+        node = node->is_leaf ? NULL : node->kids[vmem_node_bin_search(node, key)];
+    }
+
+    while (depth--) {
+        vmem_node_update(path[depth]);
+    }
+}
+
+typedef struct {
+    size_t size, align;
+    uintptr_t lo, hi;
+    VMem_Fit fit;
+} VMem_GapQuery;
+
+static bool vmem_gap_fit(VMem_GapQuery* q, uintptr_t start, uintptr_t end, uintptr_t* out) {
+    if (start < q->lo) { start = q->lo; }
+    if (end > q->hi)   { end = q->hi; }
+    if (start >= end || end - start < q->size) {
+        return false;
+    }
+
+    uintptr_t addr;
+    if (q->fit == VMEM_FIT_TOP_DOWN) {
+        addr = (end - q->size) & -q->align;
+        if (addr < start) {
+            return false;
+        }
+    } else {
+        addr = (start + q->align - 1) & -q->align;
+        if (addr < start || addr > end - q->size) {
+            return false;
+        }
+    }
+
+    *out = addr;
+    return true;
+}
+
+// walks the kids & the holes between them in address order (or backwards for
+// top-down), skipping any subtree which doesn't have a big enough hole.
+static bool vmem_gap_search(VMem_Node* node, VMem_GapQuery* q, uintptr_t* out) {
+    if (node->max_gap < q->size) {
+        return false;
+    }
+
+    int n = node->key_count;
+    bool top_down = q->fit == VMEM_FIT_TOP_DOWN;
+    if (node->is_leaf) {
+        for (int j = 1; j < n; j++) {
+            int i = top_down ? n - j : j;
+            if (vmem_gap_fit(q, node->keys[i - 1] + node->vals[i - 1].size, node->keys[i], out)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // even steps are kids, odd ones are the holes between them
+    for (int j = 0; j < 2*n + 1; j++) {
+        int k = top_down ? 2*n - j : j;
+        int i = k / 2;
+        if (k & 1) {
+            if (vmem_gap_fit(q, node->kids[i]->max_end, node->keys[i], out)) {
+                return true;
+            }
+        } else {
+            VMem_Node* kid = node->kids[i];
+            if ((i > 0 && node->keys[i - 1] >= q->hi) || kid->max_end <= q->lo) {
+                continue;
+            }
+
+            if (vmem_gap_search(kid, q, out)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+uintptr_t vmem_find_gap(Env* env, size_t size, size_t align, uintptr_t lo, uintptr_t hi, VMem_Fit fit) {
+    VMem_GapQuery q = { size, align, lo, hi, fit };
+    VMem_Node* root = env->addr_space.root;
+
+    uintptr_t addr = 0;
+    if (root == NULL) {
+        vmem_gap_fit(&q, lo, hi, &addr);
+        return addr;
+    }
+
+    // there's also the space before the first range & after the last one
+    uintptr_t first = vmem_leftmost_leaf(root)->keys[0];
+    if (fit == VMEM_FIT_TOP_DOWN) {
+        if (vmem_gap_fit(&q, root->max_end, hi, &addr) || vmem_gap_search(root, &q, &addr) || vmem_gap_fit(&q, lo, first, &addr)) {
+            return addr;
+        }
+    } else {
+        if (vmem_gap_fit(&q, lo, first, &addr) || vmem_gap_search(root, &q, &addr) || vmem_gap_fit(&q, root->max_end, hi, &addr)) {
+            return addr;
+        }
+    }
+    return 0;
+}
+
+// returns false if we couldn't get a node, nothing's been touched then.
+bool vmem_node_split_child(VMem_Node* x, VMem_Node* y, int idx) {
+    VMem_Node* z = kcache_alloc(y->is_leaf ? &vmem_leaf_cache : &vmem_inner_cache);
+    if (z == NULL) {
+        return false;
+    }
+
     z->next      = NULL;
     z->is_leaf   = y->is_leaf;
     z->key_count = VMEM_NODE_DEGREE - 1;
 
-    for (int i = 0; i < VMEM_NODE_DEGREE; i++) {
+    for (int i = 0; i < VMEM_NODE_DEGREE - 1; i++) {
         z->keys[i] = y->keys[VMEM_NODE_DEGREE + i];
     }
 
@@ -129,7 +500,12 @@ void vmem_node_split_child(VMem_Node* x, VMem_Node* y, int idx) {
         }
     }
 
-    y->key_count = VMEM_NODE_DEGREE;
+    // leaves keep the separator (it's z's first key), inner nodes move their
+    // middle key up so every separator is the smallest key on its right.
+    int mid = y->is_leaf ? VMEM_NODE_DEGREE : VMEM_NODE_DEGREE - 1;
+    uintptr_t sep = y->keys[mid];
+
+    y->key_count = mid;
     z->next = y->next;
     y->next = z;
 
@@ -147,33 +523,308 @@ void vmem_node_split_child(VMem_Node* x, VMem_Node* y, int idx) {
     }
 
     // Copy the middle key of y to this node
-    x->keys[idx] = y->keys[VMEM_NODE_DEGREE];
+    x->keys[idx] = sep;
     x->key_count += 1;
+
+    // x is on the insert's path so it gets updated later, z might not be
+    vmem_node_update(y);
+    vmem_node_update(z);
+    return true;
 }
 
-void vmem_cursor_remove(Env* env, VMem_Node* node, int start, int count) {
-    if (node != NULL) {
-        // kprintf("REMOVE %d\n", count);
+////////////////////////////////
+// Removal
+////////////////////////////////
+// Nodes don't drop below VMEM_NODE_DEGREE-1 keys (except the root), every
+// separator is the first key of the subtree on its right. Removals hold the
+// address space exclusively and every lookup (faults, translate_vaddr) holds it
+// shared, so nobody's walking the nodes we take out and they go right back.
+static void vmem_node_free(VMem_Node* node) {
+    kcache_free(node->is_leaf ? &vmem_leaf_cache : &vmem_inner_cache, node);
+}
 
-        // shift down
-        node->key_count -= count;
-        FOR_N(i, start + count - 1, node->key_count) {
-            node->keys[i] = node->keys[i + count];
-            node->vals[i] = node->vals[i + count];
+static void vmem_subtree_free(VMem_Node* node) {
+    if (!node->is_leaf) {
+        FOR_N(i, 0, node->key_count + 1) {
+            vmem_subtree_free(node->kids[i]);
+        }
+    }
+    vmem_node_free(node);
+}
+
+static bool vmem_node_underfull(VMem_Node* node) {
+    return node->key_count < VMEM_NODE_DEGREE - 1;
+}
+
+// takes out kids[i] along with the separator to its left
+static void vmem_node_drop_kid(VMem_Node* node, int i) {
+    FOR_N(j, i, node->key_count) {
+        node->keys[j - 1] = node->keys[j];
+        node->kids[j]     = node->kids[j + 1];
+    }
+    node->key_count -= 1;
+}
+
+static void vmem_node_fix_kids(VMem_Node* node);
+
+// kids[i] and kids[i+1] get merged if they fit in one node, else the keys are
+// split evenly between them (which leaves both above the minimum).
+static void vmem_node_rebalance(VMem_Node* node, int i) {
+    VMem_Node* l = node->kids[i];
+    VMem_Node* r = node->kids[i + 1];
+    if (l->is_leaf) {
+        int total = l->key_count + r->key_count;
+        if (total <= VMEM_NODE_MAX_KEYS) {
+            FOR_N(j, 0, r->key_count) {
+                l->keys[l->key_count + j] = r->keys[j];
+                l->vals[l->key_count + j] = r->vals[j];
+            }
+            l->key_count = total;
+            l->next = r->next;
+
+            vmem_node_drop_kid(node, i + 1);
+            vmem_node_free(r);
+            vmem_node_update(l);
+            return;
+        }
+
+        int want = total / 2;
+        if (l->key_count > want) {
+            int d = l->key_count - want;
+            FOR_REV_N(j, 0, r->key_count) {
+                r->keys[j + d] = r->keys[j];
+                r->vals[j + d] = r->vals[j];
+            }
+            FOR_N(j, 0, d) {
+                r->keys[j] = l->keys[want + j];
+                r->vals[j] = l->vals[want + j];
+            }
+            l->key_count = want;
+            r->key_count += d;
+        } else {
+            int d = want - l->key_count;
+            FOR_N(j, 0, d) {
+                l->keys[l->key_count + j] = r->keys[j];
+                l->vals[l->key_count + j] = r->vals[j];
+            }
+            FOR_N(j, d, r->key_count) {
+                r->keys[j - d] = r->keys[j];
+                r->vals[j - d] = r->vals[j];
+            }
+            l->key_count = want;
+            r->key_count -= d;
+        }
+        node->keys[i] = r->keys[0];
+        vmem_node_update(l);
+        vmem_node_update(r);
+    } else {
+        // the separator comes down between them
+        int total = l->key_count + 1 + r->key_count;
+        if (total <= VMEM_NODE_MAX_KEYS) {
+            l->keys[l->key_count] = node->keys[i];
+            FOR_N(j, 0, r->key_count) {
+                l->keys[l->key_count + 1 + j] = r->keys[j];
+            }
+            FOR_N(j, 0, r->key_count + 1) {
+                l->kids[l->key_count + 1 + j] = r->kids[j];
+            }
+            l->key_count = total;
+            l->next = r->next;
+
+            vmem_node_drop_kid(node, i + 1);
+            vmem_node_free(r);
+
+            // whatever was underfull down the edges can lean on its new neighbors
+            vmem_node_fix_kids(l);
+            vmem_node_update(l);
+            return;
+        }
+
+        int want = total / 2;
+        if (l->key_count > want) {
+            int d = l->key_count - want;
+            FOR_REV_N(j, 0, r->key_count) {
+                r->keys[j + d] = r->keys[j];
+            }
+            FOR_REV_N(j, 0, r->key_count + 1) {
+                r->kids[j + d] = r->kids[j];
+            }
+            FOR_N(j, 0, d - 1) {
+                r->keys[j] = l->keys[want + 1 + j];
+            }
+            r->keys[d - 1] = node->keys[i];
+            FOR_N(j, 0, d) {
+                r->kids[j] = l->kids[want + 1 + j];
+            }
+            node->keys[i] = l->keys[want];
+            l->key_count = want;
+            r->key_count += d;
+        } else {
+            int d = want - l->key_count;
+            l->keys[l->key_count] = node->keys[i];
+            FOR_N(j, 0, d - 1) {
+                l->keys[l->key_count + 1 + j] = r->keys[j];
+            }
+            FOR_N(j, 0, d) {
+                l->kids[l->key_count + 1 + j] = r->kids[j];
+            }
+            node->keys[i] = r->keys[d - 1];
+            FOR_N(j, d, r->key_count) {
+                r->keys[j - d] = r->keys[j];
+            }
+            FOR_N(j, d, r->key_count + 1) {
+                r->kids[j - d] = r->kids[j];
+            }
+            l->key_count = want;
+            r->key_count -= d;
         }
+
+        vmem_node_fix_kids(l);
+        vmem_node_fix_kids(r);
+        vmem_node_update(l);
+        vmem_node_update(r);
     }
 }
 
+static void vmem_node_fix_kids(VMem_Node* node) {
+    if (node->is_leaf) {
+        return;
+    }
+
+    int i = 0;
+    while (i <= node->key_count && node->key_count > 0) {
+        if (!vmem_node_underfull(node->kids[i])) {
+            i++;
+            continue;
+        }
+
+        // lean on the right neighbor unless we're the last one
+        int l = i < node->key_count ? i : i - 1;
+        vmem_node_rebalance(node, l);
+        i = l;
+    }
+}
+
+// Drops every key in [lo, hi) from the subtree (which covers [node_lo, node_hi)).
+// Kids entirely inside the range get freed without walking their keys, we only
+// go down the two edges so it's O(log n) plus whatever we're removing. Returns
+// true if the node's got nothing left, the caller frees it then.
+static bool vmem_node_remove_range(VMem_Node* node, uintptr_t lo, uintptr_t hi, uintptr_t node_lo, uintptr_t node_hi) {
+    if (node->is_leaf) {
+        int n = node->key_count, first = 0;
+        while (first < n && node->keys[first] < lo) {
+            first++;
+        }
+
+        int last = first;
+        while (last < n && node->keys[last] < hi) {
+            last++;
+        }
+
+        // shift down
+        FOR_N(i, last, n) {
+            node->keys[first + i - last] = node->keys[i];
+            node->vals[first + i - last] = node->vals[i];
+        }
+        node->key_count = n - (last - first);
+        vmem_node_update(node);
+        return node->key_count == 0;
+    }
+
+    int n = node->key_count;
+    int a = vmem_node_bin_search(node, lo);
+    int b = vmem_node_bin_search(node, hi - 1);
+
+    // the kids that make it, along with their lowest key (if it changed)
+    int count = 0;
+    int orig[VMEM_NODE_MAX_VALS];
+    uintptr_t mins[VMEM_NODE_MAX_VALS];
+    VMem_Node* kids[VMEM_NODE_MAX_VALS];
+    FOR_N(i, 0, n + 1) {
+        VMem_Node* kid = node->kids[i];
+        uintptr_t kid_lo = i > 0 ? node->keys[i - 1] : node_lo;
+        if (i >= a && i <= b) {
+            uintptr_t kid_hi = i < n ? node->keys[i] : node_hi;
+            if (kid_lo >= lo && kid_hi <= hi) {
+                vmem_subtree_free(kid);
+                continue;
+            } else if (vmem_node_remove_range(kid, lo, hi, kid_lo, kid_hi)) {
+                // its kids are already gone
+                vmem_node_free(kid);
+                continue;
+            }
+
+            kid_lo = vmem_leftmost_leaf(kid)->keys[0];
+        }
+
+        orig[count] = i;
+        mins[count] = kid_lo;
+        kids[count] = kid;
+        count++;
+    }
+
+    if (count == 0) {
+        return true;
+    }
+
+    // stitch the leaves back together around the hole
+    FOR_N(k, 0, count - 1) {
+        if (orig[k + 1] >= a && orig[k] <= b) {
+            vmem_rightmost_leaf(kids[k])->next = vmem_leftmost_leaf(kids[k + 1]);
+        }
+    }
+
+    FOR_N(k, 0, count) {
+        node->kids[k] = kids[k];
+    }
+    FOR_N(k, 1, count) {
+        node->keys[k - 1] = mins[k];
+    }
+    node->key_count = count - 1;
+
+    vmem_node_fix_kids(node);
+    vmem_node_update(node);
+    return false;
+}
+
+static void vmem_remove_range(Env* env, uintptr_t lo, uintptr_t hi) {
+    VMem_Node* root = env->addr_space.root;
+    if (root == NULL || lo >= hi) {
+        return;
+    }
+
+    if (vmem_node_remove_range(root, lo, hi, 0, UINTPTR_MAX)) {
+        vmem_node_free(root);
+        env->addr_space.root = NULL;
+        return;
+    }
+
+    // the root's allowed to get small, it just can't be an inner node with
+    // only one kid
+    while (!root->is_leaf && root->key_count == 0) {
+        VMem_Node* kid = root->kids[0];
+        vmem_node_free(root);
+        root = kid;
+    }
+
+    vmem_rightmost_leaf(root)->next = NULL;
+    env->addr_space.root = root;
+}
+
 void vmem_node_remove(Env* env, uintptr_t key) {
-    VMem_Cursor cursor = vmem_node_lookup(env, key);
-    vmem_cursor_remove(env, cursor.node, cursor.index, 1);
+    vmem_remove_range(env, key, key + 1);
 }
 
-// insert range into B-tree
-VMem_PageDesc* vmem_node_insert(Env* env, uintptr_t key) {
+// insert range into B-tree, NULL if we ran out of memory. the splits we did on
+// the way down stay but the tree's still valid.
+static VMem_PageDesc* vmem_node_insert_slot(Env* env, uintptr_t key) {
     if (env->addr_space.root == NULL) {
         // new leaf root
-        VMem_Node* node = kheap_alloc(sizeof(VMem_Node) + sizeof(VMem_PageDesc)*VMEM_NODE_MAX_VALS);
+        VMem_Node* node = kcache_alloc(&vmem_leaf_cache);
+        if (node == NULL) {
+            return NULL;
+        }
+
         node->next      = NULL;
         node->is_leaf   = 1;
         node->key_count = 1;
@@ -185,7 +836,11 @@ VMem_PageDesc* vmem_node_insert(Env* env, uintptr_t key) {
 
         // rotate the root
         if (env->addr_space.root->key_count == VMEM_NODE_MAX_KEYS) {
-            VMem_Node* new_node = kheap_alloc(sizeof(VMem_Node) + VMEM_NODE_MAX_VALS*sizeof(VMem_Node*));
+            VMem_Node* new_node = kcache_alloc(&vmem_inner_cache);
+            if (new_node == NULL) {
+                return NULL;
+            }
+
             new_node->next      = NULL;
             new_node->is_leaf   = 0;
             new_node->key_count = 0;
@@ -194,12 +849,15 @@ VMem_PageDesc* vmem_node_insert(Env* env, uintptr_t key) {
             new_node->kids[0] = env->addr_space.root;
 
             // split the old root and move 1 key to the new root
-            vmem_node_split_child(new_node, env->addr_space.root, 0);
+            if (!vmem_node_split_child(new_node, env->addr_space.root, 0)) {
+                kcache_free(&vmem_inner_cache, new_node);
+                return NULL;
+            }
 
             // new root has two children now. decide which of the
             // two children is going to have new key
             int i = 0;
-            if (new_node->keys[0] < key) {
+            if (new_node->keys[0] <= key) {
                 i++;
             }
 
@@ -214,12 +872,14 @@ VMem_PageDesc* vmem_node_insert(Env* env, uintptr_t key) {
 
             if (kid->key_count == VMEM_NODE_MAX_KEYS) {
                 // If the child is full, then split it
-                vmem_node_split_child(node, kid, left);
+                if (!vmem_node_split_child(node, kid, left)) {
+                    return NULL;
+                }
 
                 // After split, the middle key of C[left] goes up and
                 // C[left] is splitted into two. See which of the two
                 // is going to have the new key
-                if (node->keys[left] < key) {
+                if (node->keys[left] <= key) {
                     kid = node->kids[left + 1];
                 }
             }
@@ -251,9 +911,18 @@ VMem_PageDesc* vmem_node_insert(Env* env, uintptr_t key) {
     }
 }
 
-void vmem_split(Env* env, VMem_Cursor cursor, uintptr_t vaddr) {
+VMem_PageDesc* vmem_node_insert(Env* env, uintptr_t key, VMem_PageDesc desc) {
+    VMem_PageDesc* slot = vmem_node_insert_slot(env, key);
+    if (slot != NULL) {
+        *slot = desc;
+        vmem_node_refresh(env, key);
+    }
+    return slot;
+}
+
+bool vmem_split(Env* env, VMem_Cursor cursor, uintptr_t vaddr) {
     if (cursor.node == NULL) {
-        return;
+        return true;
     }
 
     VMem_PageDesc* desc  = &cursor.node->vals[cursor.index];
@@ -264,58 +933,207 @@ void vmem_split(Env* env, VMem_Cursor cursor, uintptr_t vaddr) {
         VMem_PageDesc cpy = *desc;
 
         if (clip != 0 && clip != desc->size) {
-            desc->size = clip;
+            // Split into High-half, the insert can shuffle the leaves around
+            // so we look the low half back up after.
+            VMem_PageDesc hi = cpy;
+            hi.offset += clip;
+            hi.size   -= clip;
+            if (vmem_node_insert(env, vaddr, hi) == NULL) {
+                return false;
+            }
+
+            // still the same mapping, it's just in two pieces now
+            if (hi.vmo != NULL) {
+                atomic_fetch_add_explicit(&hi.vmo->mappings, 1, memory_order_relaxed);
+            }
 
-            // Split into High-half
-            VMem_PageDesc* hi = vmem_node_insert(env, vaddr);
-            *hi = cpy;
-            hi->offset += clip;
-            hi->size   -= clip;
+            VMem_Cursor lo = vmem_node_lookup(env, start_addr);
+            lo.node->vals[lo.index].size = clip;
+            vmem_node_refresh(env, start_addr);
         }
     }
+    return true;
 }
 
-void vmem_unmap(Env* env, uintptr_t vaddr, size_t size) {
-    ON_DEBUG(VMEM)(kprintf("[vmem] unmap(%p, %p, %#zx)\n", env, vaddr, size));
+////////////////////////////////
+// Reclaiming frames
+////////////////////////////////
+struct VMem_ReclaimChunk {
+    VMem_ReclaimChunk* next;
+    void* frames[VMEM_RECLAIM_CHUNK];
+};
 
-    VMem_Cursor bot_cursor = vmem_node_lookup(env, vaddr);
-    if (bot_cursor.node != NULL) {
-        VMem_Cursor top_cursor = vmem_node_lookup(env, vaddr + size);
-        vmem_split(env, top_cursor, vaddr + size);
-        vmem_split(env, bot_cursor, vaddr);
-
-        // Remove any descriptors from the middle of the range
-        VMem_Cursor cursor = vmem_node_lookup(env, vaddr);
-        ON_DEBUG(VMEM)(kprintf("[vmem] Unmap [%p - %p], Starting at %p\n", vaddr, vaddr + size - 1, vmem_cursor_key(cursor)));
-
-        cursor = vmem_cursor_next(bot_cursor);
-
-        // TODO(NeGate): this is easily some of the most
-        // dogshit handling i could do... let's optimize that in the future
-        while (cursor.node) {
-            size_t key_count = cursor.node->key_count;
-            size_t start_i   = cursor.index;
-            while (cursor.index < key_count) {
-                VMem_PageDesc* desc = &cursor.node->vals[cursor.index];
-                uintptr_t start_addr = cursor.node->keys[cursor.index];
-                uintptr_t end_addr   = start_addr + desc->size;
-                if (start_addr >= vaddr + size) {
-                    vmem_cursor_remove(env, cursor.node, start_i, cursor.index - start_i);
-                    return;
-                }
+void vmem_reclaim_push(VMem_Reclaim* r, void* frame) {
+    if (r->chunks == NULL || r->count == VMEM_RECLAIM_CHUNK) {
+        VMem_ReclaimChunk* chunk = kheap_alloc_page();
+        if (chunk == NULL) {
+            // no room for another chunk. nobody else holds a ref on the frames
+            // which come out of an address space so the buddy links in the
+            // descriptor aren't doing anything until it's freed.
+            frame_desc(frame)->next = r->overflow ? kaddr2paddr(r->overflow) / PAGE_SIZE : UINT32_MAX;
+            r->overflow = frame;
+            return;
+        }
 
-                ON_DEBUG(VMEM)(kprintf("[vmem] Desc unmap [%p - %p]\n", start_addr, end_addr - 1));
-                cursor.index++;
-            }
+        chunk->next = r->chunks;
+        r->chunks = chunk;
+        r->count = 0;
+    }
+    r->chunks->frames[r->count++] = frame;
+}
 
-            // Remove the remaining piece of the node
-            vmem_cursor_remove(env, cursor.node, start_i, cursor.node->key_count - start_i);
+void vmem_reclaim_flush(VMem_Reclaim* r) {
+    if (r->stale) {
+        arch_tlb_shootdown(r->env);
+        r->stale = false;
+    }
 
-            cursor.node = cursor.node->next;
-            cursor.index = 0;
+    // everything but the newest chunk is full
+    size_t count = r->count;
+    VMem_ReclaimChunk* chunk = r->chunks;
+    while (chunk != NULL) {
+        FOR_N(i, 0, count) {
+            frame_unref(chunk->frames[i]);
+        }
+
+        VMem_ReclaimChunk* next = chunk->next;
+        kheap_free_page(chunk);
+        chunk = next, count = VMEM_RECLAIM_CHUNK;
+    }
+
+    while (r->overflow != NULL) {
+        void* frame = r->overflow;
+        uint32_t next = frame_desc(frame)->next;
+        r->overflow = next != UINT32_MAX ? paddr2kaddr((uintptr_t) next * PAGE_SIZE) : NULL;
+        frame_unref(frame);
+    }
+
+    r->chunks = NULL;
+    r->count = 0;
+}
+
+// every descriptor pointing at a VMO counts as a mapping. clones only get one
+// since there's no reverse map, when a write copies a page into the clone the
+// other mappings would keep reading the parent's page. false if it's taken.
+static bool vmem_vmo_attach(KObject_VMO* vmo) {
+    if (vmo == NULL) {
+        return true;
+    } else if (vmo->parent != NULL) {
+        return atomic_compare_exchange_strong(&vmo->mappings, &(uint32_t){ 0 }, 1);
+    }
+
+    atomic_fetch_add_explicit(&vmo->mappings, 1, memory_order_relaxed);
+    return true;
+}
+
+static void vmem_vmo_detach(KObject_VMO* vmo) {
+    if (vmo != NULL) {
+        atomic_fetch_sub_explicit(&vmo->mappings, 1, memory_order_release);
+    }
+}
+
+// pulls the committed private pages out of the working set, VMOs keep theirs
+// since someone else might have them mapped.
+static void vmem_release_pages(Env* env, VMem_PageDesc* desc, uintptr_t start_addr, VMem_Reclaim* r) {
+    if (desc->vmo != NULL && !(desc->flags & VMEM_PAGE_PINNED)) {
+        return;
+    }
+
+    // pinned pages are normal frames too, whoever pinned them was told to stop
+    // using them once they're unmapped.
+    VMem_WorkingSet* ws = &env->addr_space.working_set;
+    uintptr_t end_addr = start_addr + desc->size;
+    for (uintptr_t addr = start_addr; addr < end_addr;) {
+        // nothing was ever committed in this leaf's range, skip all of it
+        _Atomic(uintptr_t)* slot = vmem_ws_slot(ws, addr, false);
+        if (slot == NULL) {
+            uintptr_t leaf_size = (uintptr_t) PAGE_SIZE << VMEM_WS_FANOUT_LOG2;
+            addr = (addr & -leaf_size) + leaf_size;
+            continue;
+        }
+
+        uintptr_t paddr = atomic_exchange_explicit(slot, 0, memory_order_acq_rel);
+        addr += PAGE_SIZE;
+
+        if (paddr != 0) {
+            vmem_reclaim_push(r, paddr2kaddr(paddr));
         }
     }
 }
+
+void vmem_vmo_release(KObject_VMO* vmo) {
+    VMem_WorkingSet* ws = &vmo->pages;
+    for (size_t offset = 0; offset < vmo->size;) {
+        uintptr_t paddr;
+        if (ws->height == 0) {
+            paddr = vmem_translate(ws, offset);
+            offset += PAGE_SIZE;
+        } else {
+            // nothing was ever committed in this leaf's range, skip all of it
+            _Atomic(uintptr_t)* slot = vmem_ws_slot(ws, offset, false);
+            if (slot == NULL) {
+                size_t leaf_size = (size_t) PAGE_SIZE << VMEM_WS_FANOUT_LOG2;
+                offset = (offset & -leaf_size) + leaf_size;
+                continue;
+            }
+
+            paddr = atomic_exchange_explicit(slot, 0, memory_order_acq_rel);
+            offset += PAGE_SIZE;
+        }
+
+        if (paddr != 0) {
+            frame_unref(paddr2kaddr(paddr));
+        }
+    }
+}
+
+// after this every descriptor overlapping [vaddr, end) also starts and ends in it
+static bool vmem_split_range(Env* env, uintptr_t vaddr, uintptr_t end) {
+    VMem_Cursor top_cursor = vmem_node_lookup(env, end);
+    if (!vmem_split(env, top_cursor, end)) {
+        return false;
+    }
+
+    // the split might've moved the bottom one
+    VMem_Cursor bot_cursor = vmem_node_lookup(env, vaddr);
+    return vmem_split(env, bot_cursor, vaddr);
+}
+
+bool vmem_unmap(Env* env, uintptr_t vaddr, size_t size, VMem_Reclaim* r) {
+    ON_DEBUG(VMEM)(kprintf("[vmem] unmap(%p, %p, %#zx)\n", env, vaddr, size));
+
+    // there might not be anything below vaddr but that doesn't mean there's
+    // nothing inside the range.
+    uintptr_t end = vaddr + size;
+    if (!vmem_split_range(env, vaddr, end)) {
+        return false;
+    }
+
+    // every descriptor inside the range starts in [vaddr, vaddr + size) now
+    ON_DEBUG(VMEM)(kprintf("[vmem] Unmap [%p - %p]\n", vaddr, end - 1));
+
+    // PTEs go first, nothing can go in the reclaim queue while it's still mapped
+    arch_pte_clear(env, vaddr, size, r);
+
+    // first descriptor starting at or after vaddr
+    VMem_Cursor cursor = vmem_node_lookup(env, vaddr);
+    if (cursor.node == NULL) {
+        cursor = vmem_cursor_first(env);
+    } else if (cursor.node->keys[cursor.index] < vaddr) {
+        cursor = vmem_cursor_next(cursor);
+    }
+
+    while (cursor.node != NULL && cursor.node->keys[cursor.index] < end) {
+        VMem_PageDesc* desc = &cursor.node->vals[cursor.index];
+        if (desc->valid) {
+            vmem_release_pages(env, desc, cursor.node->keys[cursor.index], r);
+            vmem_vmo_detach(desc->vmo);
+        }
+        cursor = vmem_cursor_next(cursor);
+    }
+    vmem_remove_range(env, vaddr, end);
+    return true;
+}
 
 void vmem_dump(Env* env) {
     kprintf("MEM DUMP %p\n", env);
@@ -345,61 +1163,99 @@ void vmem_dump(Env* env) {
     kprintf("\n");
 }
 
-uintptr_t vmem_map(Env* env, KObject_VMO* vmo, uintptr_t vaddr, size_t offset, size_t size, VMem_Flags flags, uintptr_t* out_paddr) {
-    kassert((size & (PAGE_SIZE-1)) == 0, "must be page-aligned (%d)", size);
+// pinned memory is one physically contiguous run of plain 4KiB frames, unmap
+// hands them back one at a time like any other page.
+static char* vmem_pinned_alloc(size_t size) {
+    size_t pages = size / PAGE_SIZE;
+    int order = pages > 1 ? 64 - __builtin_clzll(pages - 1) : 0;
+    if (order > FRAME_MAX_ORDER) {
+        return NULL;
+    }
 
-    // walk all regions until we find a gap big enough (SLOW!!!)
-    if (vaddr == 0) {
-        vaddr = 0xA0000000;
-        VMem_Cursor cursor = vmem_node_lookup(env, vaddr);
+    char* kaddr = frame_alloc(order, FRAME_USER);
+    if (kaddr == NULL) {
+        return NULL;
+    }
 
-        // we only want addresses past vaddr so skip one if we're behind it
-        if (cursor.node && cursor.node->keys[cursor.index] < vaddr) {
-            cursor.index++;
-            if (cursor.index >= cursor.node->key_count) {
-                cursor.index = 0;
-                cursor.node  = cursor.node->next;
-            }
-        }
+    // we only needed the front of it
+    frame_split(kaddr);
+    FOR_N(i, pages, 1ull << order) {
+        frame_free(kaddr + i*PAGE_SIZE, 0);
+    }
+    return kaddr;
+}
 
-        int i = cursor.index;
-        while (cursor.node) {
-            kassert(cursor.node->is_leaf, "fuck");
-            int key_count = cursor.node->key_count;
-            for (; i < key_count; i++) {
-                uintptr_t free_space = cursor.node->keys[i] - vaddr;
-                if (free_space > size) {
-                    ON_DEBUG(VMEM)(kprintf("[vmem] found %d bytes between %p and %p\n", free_space, vaddr, cursor.node->keys[i]));
-                    goto done;
-                }
+static void vmem_pinned_free(char* kaddr, size_t size) {
+    for (size_t i = 0; i < size; i += PAGE_SIZE) {
+        frame_free(kaddr + i, 0);
+    }
+}
 
-                // last known address which is free
-                vaddr = cursor.node->keys[i] + cursor.node->vals[i].size;
-            }
+uintptr_t vmem_map(Env* env, KObject_VMO* vmo, uintptr_t vaddr, size_t offset, size_t size, VMem_Flags flags, uintptr_t* out_paddr) {
+    kassert((size & (PAGE_SIZE-1)) == 0, "must be page-aligned (%d)", size);
 
-            cursor.node = cursor.node->next;
-            i = 0;
+    VMem_Fit fit = flags & VMEM_MAP_TOP_DOWN ? VMEM_FIT_TOP_DOWN : VMEM_FIT_BOTTOM_UP;
+    flags &= ~VMEM_MAP_TOP_DOWN;
+
+    if (vaddr == 0) {
+        // anything big enough for a large page gets aligned for one
+        size_t align = size >= VMEM_LARGE_PAGE ? VMEM_LARGE_PAGE : PAGE_SIZE;
+        vaddr = vmem_find_gap(env, size, align, VMEM_SEARCH_BASE, VMEM_SEARCH_END, fit);
+        if (vaddr == 0) {
+            return 0;
         }
     } else {
         // Clear out the pages in this range
-        vmem_unmap(env, vaddr, size);
+        VMem_Reclaim r = { .env = env };
+        bool ok = vmem_unmap(env, vaddr, size, &r);
+        vmem_reclaim_flush(&r);
+        if (!ok) {
+            return 0;
+        }
     }
 
-    done:
     ON_DEBUG(VMEM)(kprintf("[vmem] map(%p, %#zx) = %p\n", env, size, vaddr));
 
-    VMem_PageDesc* desc = vmem_node_insert(env, vaddr);
-    *desc = (VMem_PageDesc){ .valid = 1, .flags = flags, .vmo = vmo, .offset = offset, .size = size };
+    if (!vmem_vmo_attach(vmo)) {
+        return 0;
+    }
 
+    char* kaddr = NULL;
     if (flags & VMEM_PAGE_PINNED) {
-        // commit all the pages now
-        char* kaddr = kheap_alloc(size);
-        kassert(((uintptr_t) kaddr & (PAGE_SIZE - 1)) == 0, "BAD ALIGN! %p", kaddr);
+        // grab the backing memory before it goes in the tree, that way there's
+        // nothing to undo if we can't.
+        kaddr = vmem_pinned_alloc(size);
+        if (kaddr == NULL) {
+            vmem_vmo_detach(vmo);
+            return 0;
+        }
+    }
+
+    VMem_PageDesc desc = { .valid = 1, .flags = flags, .vmo = vmo, .offset = offset, .size = size };
+    if (vmem_node_insert(env, vaddr, desc) == NULL) {
+        if (kaddr != NULL) {
+            vmem_pinned_free(kaddr, size);
+        }
+        vmem_vmo_detach(vmo);
+        return 0;
+    }
 
+    if (flags & VMEM_PAGE_PINNED) {
+        // commit all the pages now
         memset(kaddr, 0, size);
 
-        FOR_N(i, 0, size / PAGE_SIZE) {
-            vmem_commit_page(env, vaddr + i*PAGE_SIZE, kaddr + i*PAGE_SIZE);
+        VMem_WorkingSet* ws = &env->addr_space.working_set;
+        size_t filled = vmem_ws_fill(ws, vaddr, kaddr2paddr(kaddr), size / PAGE_SIZE);
+        if (filled != size / PAGE_SIZE) {
+            // the working set couldn't grow, nothing's been mapped yet so we
+            // just take it all back out.
+            FOR_N(i, 0, filled) {
+                vmem_ws_remove(ws, vaddr + i*PAGE_SIZE);
+            }
+            vmem_node_remove(env, vaddr);
+            vmem_pinned_free(kaddr, size);
+            vmem_vmo_detach(vmo);
+            return 0;
         }
 
         *out_paddr = kaddr2paddr(kaddr);
@@ -408,33 +1264,735 @@ uintptr_t vmem_map(Env* env, KObject_VMO* vmo, uintptr_t vaddr, size_t offset, s
     return vaddr;
 }
 
+////////////////////////////////
+// Protection changes
+////////////////////////////////
+typedef struct {
+    // some part of the range isn't mapped
+    bool hole;
+    // the range starts or ends in the middle of a descriptor
+    bool split;
+    // some descriptor is losing access
+    bool downgrade;
+} VMem_ProtectScan;
+
+// "backwards progress" as described on Env.addr_space, a stale TLB entry would
+// still let a core do something the new flags don't allow. the caching bits count
+// either way since there's no fault to pick those up.
+//
+// TODO(NeGate): EXEC goes in here once the PTEs carry NX.
+static bool vmem_flags_downgrade(VMem_Flags old_flags, VMem_Flags new_flags) {
+    return (old_flags & ~new_flags & VMEM_PAGE_WRITE) || ((old_flags ^ new_flags) & (VMEM_PAGE_UNCACHED | VMEM_PAGE_WRITETHRU));
+}
+
+static VMem_ProtectScan vmem_protect_scan(Env* env, uintptr_t addr, uintptr_t end, VMem_Flags flags) {
+    VMem_ProtectScan scan = { 0 };
+
+    uintptr_t at = addr;
+    VMem_Cursor cursor = vmem_node_lookup(env, addr);
+    while (at < end) {
+        if (cursor.node == NULL) {
+            scan.hole = true;
+            break;
+        }
+
+        VMem_PageDesc* desc  = &cursor.node->vals[cursor.index];
+        uintptr_t start_addr = cursor.node->keys[cursor.index];
+        uintptr_t end_addr   = start_addr + desc->size;
+        if (!desc->valid || start_addr > at || end_addr <= at) {
+            scan.hole = true;
+            break;
+        }
+
+        if (start_addr < addr || end_addr > end) {
+            scan.split = true;
+        }
+
+        if (vmem_flags_downgrade(desc->flags, (desc->flags & ~VMEM_PROTECT_MASK) | flags)) {
+            scan.downgrade = true;
+        }
+
+        at = end_addr;
+        cursor = vmem_cursor_next(cursor);
+    }
+    return scan;
+}
+
+// the descriptors have to line up with [addr, end) already, returns true if
+// any of the PTEs lost access (and thus need a shootdown).
+static bool vmem_protect_apply(Env* env, uintptr_t addr, uintptr_t end, VMem_Flags flags) {
+    bool stale = false;
+
+    VMem_Cursor cursor = vmem_node_lookup(env, addr);
+    while (cursor.node != NULL && cursor.node->keys[cursor.index] < end) {
+        VMem_PageDesc* desc  = &cursor.node->vals[cursor.index];
+        uintptr_t start_addr = cursor.node->keys[cursor.index];
+
+        VMem_Flags old_flags = desc->flags;
+        desc->flags = (old_flags & ~VMEM_PROTECT_MASK) | flags;
+
+        // gaining access is left for the faults to pick up, only the committed
+        // pages which are losing it get rewritten now.
+        if (vmem_flags_downgrade(old_flags, desc->flags) && arch_pte_protect(env, start_addr, desc->size, desc->flags)) {
+            stale = true;
+        }
+        cursor = vmem_cursor_next(cursor);
+    }
+    return stale;
+}
+
 bool vmem_protect(Env* env, uintptr_t addr, size_t size, VMem_Flags flags) {
-    return false;
+    kassert(((addr | size) & (PAGE_SIZE-1)) == 0, "must be page-aligned (%p, %#zx)", addr, size);
+    ON_DEBUG(VMEM)(kprintf("[vmem] protect(%p, %p, %#zx, %#x)\n", env, addr, size, flags));
+
+    flags &= VMEM_PROTECT_MASK;
+    uintptr_t end = addr + size;
+
+    // only adding access is forward progress, anyone with the old PTEs just faults
+    // and picks up the new flags. if nothing needs splitting we can do it next to
+    // the faults, the env lock keeps the other forward progress changes from
+    // racing us on the descriptors.
+    rwlock_lock_shared(&env->addr_space.lock);
+    spin_lock(&env->lock);
+    VMem_ProtectScan scan = vmem_protect_scan(env, addr, end, flags);
+    bool forward = !scan.hole && !scan.split && !scan.downgrade;
+    if (forward) {
+        vmem_protect_apply(env, addr, end, flags);
+    }
+    spin_unlock(&env->lock);
+    rwlock_unlock_shared(&env->addr_space.lock);
+
+    if (scan.hole) {
+        return false;
+    } else if (forward) {
+        return true;
+    }
+
+    // splits need the tree to ourselves, taking access away also needs everyone
+    // to drop their TLB entries before we're done. that waits until we've let
+    // go of the lock, the other threads might be spinning on it with interrupts
+    // off and they'd never take the IPI.
+    rwlock_lock_exclusive(&env->addr_space.lock);
+
+    // things might've moved while it wasn't locked
+    scan = vmem_protect_scan(env, addr, end, flags);
+    bool ok = !scan.hole;
+    if (ok && scan.split) {
+        ok = vmem_split_range(env, addr, end);
+    }
+
+    bool stale = ok && vmem_protect_apply(env, addr, end, flags);
+    rwlock_unlock_exclusive(&env->addr_space.lock);
+
+    if (stale) {
+        // one round of IPIs for the whole range
+        arch_tlb_shootdown(env);
+    }
+    return ok;
 }
 
-void vmem_commit_page(Env* env, uintptr_t vaddr, void* kaddr) {
-    vmem_addrhm_put(&env->addr_space.working_set, (void*) (vaddr + VMEM_WORKING_SET_OFFSET), (void*) kaddr2paddr(kaddr));
+bool vmem_commit_page(Env* env, uintptr_t vaddr, void* kaddr) {
+    return vmem_ws_set(&env->addr_space.working_set, vaddr, kaddr2paddr(kaddr));
 }
 
-void vmem_add_range(Env* env, KObject_VMO* vmo, uintptr_t vaddr, size_t offset, size_t vsize, VMem_Flags flags) {
+bool vmem_add_range(Env* env, KObject_VMO* vmo, uintptr_t vaddr, size_t offset, size_t vsize, VMem_Flags flags) {
     kassert((vaddr & (PAGE_SIZE-1)) == 0, "must be page-aligned (%d)", vaddr);
     kassert((vsize & (PAGE_SIZE-1)) == 0, "must be page-aligned (%d)", vsize);
 
-    vmem_unmap(env, vaddr, vsize);
+    VMem_Reclaim r = { .env = env };
+    bool ok = vmem_unmap(env, vaddr, vsize, &r);
+    vmem_reclaim_flush(&r);
+    if (!ok) {
+        return false;
+    }
+
+    if (!vmem_vmo_attach(vmo)) {
+        return false;
+    }
 
-    VMem_PageDesc* desc = vmem_node_insert(env, vaddr);
-    *desc = (VMem_PageDesc){ .valid = 1, .flags = flags, .vmo = vmo, .offset = offset, .size = vsize };
+    VMem_PageDesc desc = { .valid = 1, .flags = flags, .vmo = vmo, .offset = offset, .size = vsize };
+    if (vmem_node_insert(env, vaddr, desc) == NULL) {
+        vmem_vmo_detach(vmo);
+        return false;
+    }
+    return true;
 }
 
-uintptr_t vmem_translate(VMem_WorkingSet* ws, uintptr_t vaddr) {
-    return (uintptr_t) vmem_addrhm_get(ws, (char*) (vaddr + VMEM_WORKING_SET_OFFSET));
+// tries to cover the access with a single 1GiB or 2MiB page, it only works if the
+// large page lands inside the descriptor and whatever's backing it is physically
+// contiguous (paddr is where access_addr's page lives).
+static bool vmem_try_commit_large(Env* env, VMem_PageDesc* desc, uintptr_t access_addr, uintptr_t paddr, uintptr_t start_addr, uintptr_t end_addr) {
+    static const size_t large_sizes[] = { 1ull << 30, VMEM_LARGE_PAGE };
+    FOR_N(i, 0, ELEM_COUNT(large_sizes)) {
+        size_t size = large_sizes[i];
+        uintptr_t block = access_addr & -size;
+        uintptr_t block_paddr = paddr - (access_addr - block);
+        if (block < start_addr || end_addr - block < size || (block_paddr & (size - 1)) != 0) {
+            continue;
+        }
+
+        if (arch_pte_update_large(env, block, block_paddr, size, desc->flags)) {
+            ON_DEBUG(VMEM)(kprintf("[vmem] large page %p (%zu KiB) => %p\n", block, size / 1024, block_paddr));
+            return true;
+        }
+    }
+    return false;
 }
-
-uintptr_t vmem_try_commit(Env* env, VMem_PageDesc* desc, uintptr_t access_addr, uintptr_t start_addr, uintptr_t end_addr) {
+
+////////////////////////////////
+// Transparent huge pages
+////////////////////////////////
+VMem_THPMode vmem_thp_mode = VMEM_THP_ALWAYS;
+VMem_Counters vmem_counters;
+
+// 2MiB blocks waiting for the collapser, the faults push & the idle loop pops.
+// if it's full we just don't bother, the block comes up again on the next fault.
+typedef struct {
+    Env* env;
+    uintptr_t block;
+} VMem_THPCandidate;
+
+static Lock vmem_thp_lock;
+static size_t vmem_thp_count;
+static VMem_THPCandidate vmem_thp_queue[64];
+
+// at most one block gets copied into a fresh 2MiB frame at a time. the copy
+// runs with interrupts on and without the address space lock, so the old pages
+// are read-only until it's done and anyone committing into the block (a write
+// fault, translate_vaddr) calls it off.
+typedef struct {
+    _Atomic(Env*) env;
+    uintptr_t block;
+    char* frame;
+    // the core doing the copy, it's the only one who touches the fields below
+    PerCPU* owner;
+    _Atomic(size_t) copied;
+    _Atomic(bool) cancelled;
+    // what the block was backed by, if any of these changed the copy's no good
+    uintptr_t pages[VMEM_LARGE_PAGE / PAGE_SIZE];
+} VMem_THPCopy;
+
+static VMem_THPCopy vmem_thp_copy;
+
+static bool vmem_thp_allowed(VMem_PageDesc* desc) {
+    if (desc->vmo != NULL || (desc->flags & (VMEM_PAGE_PINNED | VMEM_PAGE_NOHUGE))) {
+        return false;
+    }
+    return vmem_thp_mode == VMEM_THP_ALWAYS || (vmem_thp_mode == VMEM_THP_MADVISE && (desc->flags & VMEM_PAGE_HUGE));
+}
+
+// false if the queue's full
+static bool vmem_thp_enqueue(Env* env, uintptr_t block) {
+    spin_lock(&vmem_thp_lock);
+    bool dup = false;
+    FOR_N(i, 0, vmem_thp_count) {
+        if (vmem_thp_queue[i].env == env && vmem_thp_queue[i].block == block) {
+            dup = true;
+            break;
+        }
+    }
+
+    bool full = vmem_thp_count == ELEM_COUNT(vmem_thp_queue);
+    if (!dup && !full) {
+        vmem_thp_queue[vmem_thp_count++] = (VMem_THPCandidate){ env, block };
+    }
+    spin_unlock(&vmem_thp_lock);
+    return !full;
+}
+
+void vmem_thp_forget(Env* env) {
+    spin_lock(&vmem_thp_lock);
+    size_t j = 0;
+    FOR_N(i, 0, vmem_thp_count) {
+        if (vmem_thp_queue[i].env != env) {
+            vmem_thp_queue[j++] = vmem_thp_queue[i];
+        }
+    }
+    vmem_thp_count = j;
+
+    if (vmem_thp_copy.env == env) {
+        vmem_thp_copy.cancelled = true;
+    }
+    spin_unlock(&vmem_thp_lock);
+}
+
+void vmem_thp_touch(Env* env, uintptr_t vaddr) {
+    if (atomic_ldrlx(&vmem_thp_copy.env) != env) {
+        return;
+    }
+
+    spin_lock(&vmem_thp_lock);
+    if (vmem_thp_copy.env == env && vmem_thp_copy.block == (vaddr & -VMEM_LARGE_PAGE)) {
+        vmem_thp_copy.cancelled = true;
+    }
+    spin_unlock(&vmem_thp_lock);
+}
+
+// first touch on a 2MiB block of anonymous memory, if nothing in it has been
+// committed yet the whole thing gets one frame & one PDE. returns 0 if the
+// regular 4KiB path should handle it.
+static uintptr_t vmem_try_commit_thp(Env* env, VMem_PageDesc* desc, uintptr_t access_addr, uintptr_t start_addr, uintptr_t end_addr) {
+    uintptr_t block = access_addr & -VMEM_LARGE_PAGE;
+    if (!vmem_thp_allowed(desc) || block < start_addr || end_addr - block < VMEM_LARGE_PAGE) {
+        return 0;
+    }
+
+    // the block is exactly one leaf of the working set, if there's no leaf
+    // there's nothing committed.
+    VMem_WorkingSet* ws = &env->addr_space.working_set;
+    _Atomic(uintptr_t)* leaf = vmem_ws_slot(ws, block, false);
+    if (leaf != NULL) {
+        FOR_N(i, 0, VMEM_LARGE_PAGE / PAGE_SIZE) {
+            if (atomic_ldrlx(&leaf[i]) != 0) {
+                // it's already got 4KiB pages, the collapser can take it once it fills up
+                vmem_thp_enqueue(env, block);
+                return 0;
+            }
+        }
+    }
+
+    char* frame = frame_alloc(FRAME_SEGMENT_ORDER, FRAME_ZERO | FRAME_USER);
+    if (frame == NULL) {
+        atomic_fetch_add_explicit(&vmem_counters.thp_fallbacks, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    // from here it's 512 normal frames which just happen to be next to each
+    // other, unmap & friends don't need to know it was ever a large page.
+    frame_split(frame);
+
+    uintptr_t paddr = kaddr2paddr(frame);
+    size_t committed = vmem_ws_fill(ws, block, paddr, VMEM_LARGE_PAGE / PAGE_SIZE);
+
+    if (committed < VMEM_LARGE_PAGE / PAGE_SIZE) {
+        // lost a race with some other fault in the block (or the working set
+        // couldn't grow), whatever made it in is still a fine 4KiB page.
+        FOR_N(i, committed, VMEM_LARGE_PAGE / PAGE_SIZE) {
+            frame_free(frame + i*PAGE_SIZE, 0);
+        }
+        atomic_fetch_add_explicit(&vmem_counters.thp_fallbacks, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    if (!arch_pte_update_large(env, block, paddr, VMEM_LARGE_PAGE, desc->flags)) {
+        // there's a page table in the way, everything's committed & contiguous
+        // so the collapser only has to swap the PDE.
+        vmem_thp_enqueue(env, block);
+        atomic_fetch_add_explicit(&vmem_counters.thp_fallbacks, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    ON_DEBUG(VMEM)(kprintf("[vmem] THP %p => %p\n", block, paddr));
+    atomic_fetch_add_explicit(&vmem_counters.thp_faults, 1, memory_order_relaxed);
+    return paddr + (access_addr - block);
+}
+
+// the descriptor covering the whole block, NULL if it's not up for a THP anymore
+static VMem_PageDesc* vmem_collapse_desc(Env* env, uintptr_t block) {
+    VMem_Cursor cursor = vmem_node_lookup(env, block);
+    if (cursor.node == NULL) {
+        return NULL;
+    }
+
+    // it might've been unmapped or advised against since it got queued
+    VMem_PageDesc* desc  = &cursor.node->vals[cursor.index];
+    uintptr_t start_addr = cursor.node->keys[cursor.index];
+    uintptr_t end_addr   = start_addr + desc->size;
+    if (!desc->valid || !vmem_thp_allowed(desc) || block < start_addr || end_addr - block < VMEM_LARGE_PAGE) {
+        return NULL;
+    }
+    return desc;
+}
+
+// promotes a fully committed 2MiB block of 4KiB pages, the caller holds the
+// address space exclusively and flushes r once they've let go of it. if the
+// pages aren't contiguous already they're made read-only and the block goes
+// into vmem_thp_copy, the copy itself happens without the lock.
+static void vmem_collapse(Env* env, uintptr_t block, VMem_Reclaim* r) {
+    VMem_PageDesc* desc = vmem_collapse_desc(env, block);
+    if (desc == NULL) {
+        return;
+    }
+
+    _Atomic(uintptr_t)* leaf = vmem_ws_slot(&env->addr_space.working_set, block, false);
+    if (leaf == NULL) {
+        return;
+    }
+
+    uintptr_t base = atomic_ldrlx(&leaf[0]);
+    bool contiguous = base != 0 && (base & (VMEM_LARGE_PAGE - 1)) == 0;
+    FOR_N(i, 0, VMEM_LARGE_PAGE / PAGE_SIZE) {
+        uintptr_t page = atomic_ldrlx(&leaf[i]);
+        if (page == 0) {
+            return;
+        }
+        contiguous &= page == base + i*PAGE_SIZE;
+    }
+
+    if (contiguous) {
+        // the frames are already where the large page wants them (the THP fault
+        // couldn't get the PDE), only the page table has to go. if this doesn't
+        // work out the faults put the 4KiB pages back.
+        arch_pte_clear(env, block, VMEM_LARGE_PAGE, r);
+        if (arch_pte_update_large(env, block, base, VMEM_LARGE_PAGE, desc->flags)) {
+            ON_DEBUG(VMEM)(kprintf("[vmem] collapsed %p => %p\n", block, base));
+            atomic_fetch_add_explicit(&vmem_counters.thp_promotions, 1, memory_order_relaxed);
+        }
+        return;
+    }
+
+    char* frame = frame_alloc(FRAME_SEGMENT_ORDER, FRAME_USER);
+    if (frame == NULL) {
+        return;
+    }
+
+    // nobody gets to write to the old pages while we're copying them, the
+    // shootdown happens when r gets flushed.
+    if (arch_pte_protect(env, block, VMEM_LARGE_PAGE, desc->flags & ~VMEM_PAGE_WRITE)) {
+        r->stale = true;
+    }
+
+    spin_lock(&vmem_thp_lock);
+    vmem_thp_copy.block  = block;
+    vmem_thp_copy.frame  = frame;
+    vmem_thp_copy.owner  = cpu_get();
+    vmem_thp_copy.copied = 0;
+    vmem_thp_copy.cancelled = false;
+    FOR_N(i, 0, VMEM_LARGE_PAGE / PAGE_SIZE) {
+        vmem_thp_copy.pages[i] = atomic_ldrlx(&leaf[i]);
+    }
+    atomic_store_explicit(&vmem_thp_copy.env, env, memory_order_release);
+    spin_unlock(&vmem_thp_lock);
+}
+
+// interrupts are on for this one, if one comes in the idle loop starts over
+// and we pick it back up from the last page we finished.
+static void vmem_collapse_copy(void) {
+    VMem_THPCopy* c = &vmem_thp_copy;
+    size_t i;
+    while (i = atomic_ldrlx(&c->copied), i < VMEM_LARGE_PAGE / PAGE_SIZE && !atomic_ldrlx(&c->cancelled)) {
+        // the old page might've been freed under us, it's still in the kernel's
+        // mappings so the worst we get is garbage which vmem_collapse_finish
+        // won't take.
+        memcpy(c->frame + i*PAGE_SIZE, paddr2kaddr(c->pages[i]), PAGE_SIZE);
+        atomic_store_explicit(&c->copied, i + 1, memory_order_release);
+    }
+}
+
+// swaps the copy in for the old pages, the caller holds the address space
+// exclusively. false if the block changed since we started, the old pages
+// get their write access back on the next fault.
+static bool vmem_collapse_finish(Env* env, VMem_Reclaim* r) {
+    VMem_THPCopy* c = &vmem_thp_copy;
+    VMem_PageDesc* desc = atomic_ldrlx(&c->cancelled) ? NULL : vmem_collapse_desc(env, c->block);
+    if (desc == NULL) {
+        return false;
+    }
+
+    _Atomic(uintptr_t)* leaf = vmem_ws_slot(&env->addr_space.working_set, c->block, false);
+    if (leaf == NULL) {
+        return false;
+    }
+
+    FOR_N(i, 0, VMEM_LARGE_PAGE / PAGE_SIZE) {
+        if (atomic_ldrlx(&leaf[i]) != c->pages[i]) {
+            return false;
+        }
+    }
+
+    arch_pte_clear(env, c->block, VMEM_LARGE_PAGE, r);
+    frame_split(c->frame);
+    FOR_N(i, 0, VMEM_LARGE_PAGE / PAGE_SIZE) {
+        atomic_store_explicit(&leaf[i], kaddr2paddr(c->frame + i*PAGE_SIZE), memory_order_release);
+        vmem_reclaim_push(r, paddr2kaddr(c->pages[i]));
+    }
+
+    // same as above, the faults fill in the 4KiB pages if the PDE didn't go in
+    uintptr_t base = kaddr2paddr(c->frame);
+    if (arch_pte_update_large(env, c->block, base, VMEM_LARGE_PAGE, desc->flags)) {
+        ON_DEBUG(VMEM)(kprintf("[vmem] collapsed %p => %p (copied)\n", c->block, base));
+        atomic_fetch_add_explicit(&vmem_counters.thp_promotions, 1, memory_order_relaxed);
+    }
+    return true;
+}
+
+// dead envs waiting on the idle loop, env_mark_dead pushes them from fault
+// handlers so the lock's only ever taken with interrupts off.
+static Lock vmem_reap_lock;
+static Env* vmem_reap_list;
+
+void vmem_reap(Env* env) {
+    bool irq = arch_irq_save();
+    spin_lock(&vmem_reap_lock);
+    env->addr_space.reap_next = vmem_reap_list;
+    vmem_reap_list = env;
+    spin_unlock(&vmem_reap_lock);
+    arch_irq_restore(irq);
+}
+
+// unmaps the env's first descriptor (the gaps too), PTEs, pages and page tables
+// go with it. returns true once there's nothing left.
+static bool vmem_reap_step(Env* env, VMem_Reclaim* r) {
+    VMem_Cursor cursor = vmem_cursor_first(env);
+    if (cursor.node == NULL) {
+        return true;
+    }
+
+    uintptr_t start_addr = cursor.node->keys[cursor.index];
+    size_t size = cursor.node->vals[cursor.index].size;
+    vmem_unmap(env, start_addr, size, r);
+    if (env->addr_space.root != NULL) {
+        return false;
+    }
+
+    // the pages are gone and whoever looks into the working set holds the
+    // lock, so the tree can go too.
+    vmem_ws_free(&env->addr_space.working_set);
+    return true;
+}
+
+// finishes the copy this core started, false if the address space was busy
+// and it has to wait until we're idle again.
+static bool vmem_collapse_resume(Env* env) {
+    vmem_collapse_copy();
+
+    bool irq = arch_irq_save();
+    bool cancelled = atomic_ldrlx(&vmem_thp_copy.cancelled);
+    bool locked = !cancelled && rwlock_try_lock_exclusive(&env->addr_space.lock);
+    if (!cancelled && !locked) {
+        arch_irq_restore(irq);
+        return false;
+    }
+
+    // if it got called off the env might be on its way out, we don't touch it
+    VMem_Reclaim r = { .env = env };
+    bool swapped = locked && vmem_collapse_finish(env, &r);
+    if (locked) {
+        rwlock_unlock_exclusive(&env->addr_space.lock);
+    }
+
+    if (!swapped) {
+        frame_free(vmem_thp_copy.frame, 0);
+    }
+
+    spin_lock(&vmem_thp_lock);
+    vmem_thp_copy.env = NULL;
+    spin_unlock(&vmem_thp_lock);
+
+    vmem_reclaim_flush(&r);
+    arch_irq_restore(irq);
+    return true;
+}
+
+// called from the idle loop with interrupts on, like frame_idle we hold them
+// off for one descriptor or block at a time. the 2MiB copies are the exception,
+// those run with them on (see vmem_thp_copy).
+void vmem_idle(void) {
+    for (;;) {
+        bool irq = arch_irq_save();
+        spin_lock(&vmem_reap_lock);
+        Env* env = vmem_reap_list;
+        if (env != NULL) {
+            vmem_reap_list = env->addr_space.reap_next;
+        }
+        spin_unlock(&vmem_reap_lock);
+
+        if (env == NULL) {
+            arch_irq_restore(irq);
+            break;
+        }
+
+        // its threads might still be faulting, we'll try again next time we're idle
+        VMem_Reclaim r = { .env = env };
+        bool done = false, locked = rwlock_try_lock_exclusive(&env->addr_space.lock);
+        if (locked) {
+            vmem_thp_forget(env);
+            done = vmem_reap_step(env, &r);
+            rwlock_unlock_exclusive(&env->addr_space.lock);
+        }
+        vmem_reclaim_flush(&r);
+
+        if (!done) {
+            vmem_reap(env);
+        }
+        arch_irq_restore(irq);
+
+        if (!locked) {
+            break;
+        }
+    }
+
+    for (;;) {
+        bool irq = arch_irq_save();
+        spin_lock(&vmem_thp_lock);
+        Env* copying = vmem_thp_copy.env;
+        bool ours = copying != NULL && vmem_thp_copy.owner == cpu_get();
+        if ((copying != NULL && !ours) || (copying == NULL && vmem_thp_count == 0)) {
+            // nothing to do or some other core's in the middle of a copy
+            spin_unlock(&vmem_thp_lock);
+            arch_irq_restore(irq);
+            break;
+        }
+
+        if (ours) {
+            spin_unlock(&vmem_thp_lock);
+            arch_irq_restore(irq);
+            if (!vmem_collapse_resume(copying)) {
+                break;
+            }
+            continue;
+        }
+
+        VMem_THPCandidate c = vmem_thp_queue[--vmem_thp_count];
+        spin_unlock(&vmem_thp_lock);
+
+        // someone's busy with the address space, we'll try again next time we're idle
+        VMem_Reclaim r = { .env = c.env };
+        bool locked = rwlock_try_lock_exclusive(&c.env->addr_space.lock);
+        if (locked) {
+            vmem_collapse(c.env, c.block, &r);
+            rwlock_unlock_exclusive(&c.env->addr_space.lock);
+        } else {
+            vmem_thp_enqueue(c.env, c.block);
+        }
+
+        // the other cores might be spinning on the lock, we don't wait on them
+        // while we're holding it.
+        vmem_reclaim_flush(&r);
+        arch_irq_restore(irq);
+
+        if (!locked) {
+            break;
+        }
+    }
+}
+
+bool vmem_advise(Env* env, uintptr_t addr, size_t size, VMem_Flags flags) {
+    kassert(((addr | size) & (PAGE_SIZE-1)) == 0, "must be page-aligned (%p, %#zx)", addr, size);
+    ON_DEBUG(VMEM)(kprintf("[vmem] advise(%p, %p, %#zx, %#x)\n", env, addr, size, flags));
+
+    flags &= VMEM_ADVISE_MASK;
+    uintptr_t end = addr + size;
+
+    // none of this touches the PTEs (existing large pages stay put) but it
+    // might need splits.
+    rwlock_lock_exclusive(&env->addr_space.lock);
+    bool ok = !vmem_protect_scan(env, addr, end, 0).hole && vmem_split_range(env, addr, end);
+    if (ok) {
+        VMem_Cursor cursor = vmem_node_lookup(env, addr);
+        while (cursor.node != NULL && cursor.node->keys[cursor.index] < end) {
+            VMem_PageDesc* desc = &cursor.node->vals[cursor.index];
+            desc->flags = (desc->flags & ~VMEM_ADVISE_MASK) | flags;
+            cursor = vmem_cursor_next(cursor);
+        }
+    }
+    rwlock_unlock_exclusive(&env->addr_space.lock);
+
+    // whatever's already filled in can get promoted without waiting on a fault
+    if (ok && (flags & VMEM_PAGE_HUGE)) {
+        uintptr_t block = (addr + VMEM_LARGE_PAGE - 1) & -VMEM_LARGE_PAGE;
+        while (block < end && end - block >= VMEM_LARGE_PAGE && vmem_thp_enqueue(env, block)) {
+            block += VMEM_LARGE_PAGE;
+        }
+    }
+    return ok;
+}
+
+// demand-zero memory which hasn't been written to yet reads from this, it's
+// mapped read-only so the first write faults & gets a page of its own.
+static _Alignas(4096) const uint8_t VMEM_ZERO_PAGE[4096];
+
+static uintptr_t vmem_zero_paddr(void) {
+    // it's in the kernel image, not the identity map
+    return ((uintptr_t) VMEM_ZERO_PAGE - boot_info->elf_virtual_ptr) + boot_info->elf_physical_ptr;
+}
+
+// puts the page into the working set unless someone beat us to it (then ours is
+// freed), returns whichever one stuck or 0 if the working set couldn't grow.
+static uintptr_t vmem_ws_put(VMem_WorkingSet* ws, uintptr_t key, void* page) {
+    uintptr_t new_page = kaddr2paddr(page);
+    uintptr_t actual_page = vmem_ws_put_if_null(ws, key, new_page);
+    if (actual_page != new_page) {
+        frame_free(page, 0);
+    }
+    return actual_page;
+}
+
+// commits a fresh page into the working set, it's a copy of src_page (or zeroed
+// if that's 0). returns 0 if we're out of memory.
+static uintptr_t vmem_ws_commit(VMem_WorkingSet* ws, uintptr_t key, uintptr_t src_page) {
+    void* page = frame_alloc(0, src_page ? FRAME_USER : FRAME_ZERO | FRAME_USER);
+    if (page == NULL) {
+        return 0;
+    }
+
+    if (src_page) {
+        memcpy(page, paddr2kaddr(src_page), PAGE_SIZE);
+    }
+    return vmem_ws_put(ws, key, page);
+}
+
+bool vmo_supply(KObject_VMO* vmo, size_t offset, void* page) {
+    return vmem_ws_put(&vmo->pages, offset, page) != 0;
+}
+
+// commits a page in a VMO which isn't a clone, pagers fill it in and the rest
+// just get zeroes.
+static uintptr_t vmem_vmo_commit(KObject_VMO* vmo, size_t offset) {
+    if (vmo->pager == NULL) {
+        return vmem_ws_commit(&vmo->pages, offset, 0);
+    }
+
+    ON_DEBUG(VMEM)(kprintf("[vmem] paging in OBJ-%d (VMO:%p)\n", vmo->super.id, offset));
+    if (!vmo->pager(vmo, offset)) {
+        return 0;
+    }
+    return vmem_translate(&vmo->pages, offset);
+}
+
+// walks up the clones until someone has the page, if nobody does the root
+// commits one so every clone reading through keeps seeing the same frame.
+// returns 0 if we're out of memory.
+static uintptr_t vmem_vmo_source(KObject_VMO* vmo, size_t offset) {
+    for (;;) {
+        if (vmo->paddr) {
+            return vmo->paddr + offset;
+        }
+
+        uintptr_t page = vmem_translate(&vmo->pages, offset);
+        if (page != 0) {
+            return page;
+        } else if (vmo->parent == NULL) {
+            return vmem_vmo_commit(vmo, offset);
+        }
+
+        offset += vmo->parent_offset;
+        vmo = vmo->parent;
+    }
+}
+
+uintptr_t vmem_try_commit(Env* env, VMem_PageDesc* desc, uintptr_t access_addr, uintptr_t start_addr, uintptr_t end_addr, bool* stale) {
+    // if the collapser's copying this block it's about to be out of date
+    vmem_thp_touch(env, access_addr);
+
     // Find the page's working set
     VMem_WorkingSet* ws = &env->addr_space.working_set;
     uintptr_t in_space_addr = access_addr;
-    if (desc->vmo != 0) {
+    if (desc->flags & VMEM_PAGE_PINNED) {
+        // pinned pages went into the working set by vaddr back in vmem_map (even
+        // when there's a VMO) and they're all from one frame_alloc, so whatever's
+        // in the descriptor is physically contiguous.
+        uintptr_t page = vmem_translate(ws, access_addr & -PAGE_SIZE);
+        if (page == 0) {
+            return 0;
+        }
+
+        if (!vmem_try_commit_large(env, desc, access_addr & -PAGE_SIZE, page, start_addr, end_addr) &&
+            !arch_pte_update(env, access_addr & -PAGE_SIZE, page, desc->flags)) {
+            return 0;
+        }
+        return page;
+    } else if (desc->vmo != 0) {
         // Translate address into VMO space
         size_t offset = (access_addr & -PAGE_SIZE) - start_addr;
         in_space_addr = desc->offset + offset;
@@ -446,41 +2004,152 @@ uintptr_t vmem_try_commit(Env* env, VMem_PageDesc* desc, uintptr_t access_addr,
             // physical addresses don't get cached in the working set, we're
             // better off just not putting entries into a hash map.
             uintptr_t new_page = vmo->paddr + in_space_addr;
-            arch_pte_update(env, access_addr & -PAGE_SIZE, new_page, desc->flags);
-            return 0;
+            if (!vmem_try_commit_large(env, desc, access_addr & -PAGE_SIZE, new_page, start_addr, end_addr) &&
+                !arch_pte_update(env, access_addr & -PAGE_SIZE, new_page, desc->flags)) {
+                return 0;
+            }
+            return new_page;
         }
 
-        // TODO(NeGate): implement pager behavior
         ws = &vmo->pages;
     } else {
         ON_DEBUG(VMEM)(kprintf("[vmem] first touch on private page (%p)\n", access_addr));
+
+        uintptr_t page = vmem_try_commit_thp(env, desc, access_addr & -PAGE_SIZE, start_addr, end_addr);
+        if (page != 0) {
+            return page;
+        }
     }
 
     // attempt to commit page in working set
-    uintptr_t actual_page = (uintptr_t) vmem_addrhm_get(ws, (void*) (in_space_addr + VMEM_WORKING_SET_OFFSET));
+    uintptr_t actual_page = vmem_translate(ws, in_space_addr);
     if (actual_page == 0) {
-        void* page = kheap_alloc_page();
-        uintptr_t new_page = kaddr2paddr(page);
+        KObject_VMO* vmo = desc->vmo;
+        if (vmo == NULL) {
+            actual_page = vmem_ws_commit(ws, in_space_addr, 0);
+        } else if (vmo->parent == NULL) {
+            actual_page = vmem_vmo_commit(vmo, in_space_addr);
+        } else {
+            // clones start off as a copy of whatever they were reading through to
+            uintptr_t src_page = vmem_vmo_source(vmo->parent, in_space_addr + vmo->parent_offset);
+            actual_page = src_page ? vmem_ws_commit(ws, in_space_addr, src_page) : 0;
+        }
 
-        actual_page = (uintptr_t) vmem_addrhm_put_if_null(ws, (void*) (in_space_addr + VMEM_WORKING_SET_OFFSET), (void*) new_page);
-        if (actual_page != new_page) {
-            kheap_free_page(paddr2kaddr(new_page));
+        if (actual_page == 0) {
+            return 0;
         }
     }
 
-    arch_pte_update(env, access_addr & -PAGE_SIZE, actual_page, desc->flags);
+    uintptr_t old_page;
+    if (!arch_pte_swap(env, access_addr & -PAGE_SIZE, actual_page, desc->flags, &old_page)) {
+        return 0;
+    }
+
+    // a read might've left the zero page (or a clone's parent page) here,
+    // anyone who saw it has to let go of it before the writes start.
+    if (old_page != 0 && old_page != actual_page) {
+        *stale = true;
+    }
     return actual_page;
 }
+
+// what a read fault can map read-only instead of committing anything, the zero
+// page for demand-zero memory nobody's written to and the parent's page for a
+// clone which hasn't written it. 0 means there's nothing to share.
+static uintptr_t vmem_shared_page(Env* env, VMem_PageDesc* desc, uintptr_t addr, uintptr_t start_addr) {
+    if (desc->flags & VMEM_PAGE_PINNED) {
+        return 0;
+    } else if (desc->vmo == NULL) {
+        return vmem_translate(&env->addr_space.working_set, addr) == 0 ? vmem_zero_paddr() : 0;
+    }
+
+    // clones are only mapped in one place (see vmem_vmo_attach), if the page
+    // gets copied into it it's through this mapping and the write swaps our PTE.
+    KObject_VMO* vmo = desc->vmo;
+    size_t offset = desc->offset + (addr - start_addr);
+    if (vmo->parent == NULL || vmem_translate(&vmo->pages, offset) != 0) {
+        return 0;
+    }
+    return vmem_vmo_source(vmo->parent, offset + vmo->parent_offset);
+}
+
+// commits one page for a fault, reads try to share a page first.
+static bool vmem_fault_commit(Env* env, VMem_PageDesc* desc, uintptr_t addr, uintptr_t start_addr, uintptr_t end_addr, bool is_write, bool* stale) {
+    uintptr_t shared = is_write ? 0 : vmem_shared_page(env, desc, addr, start_addr);
+    if (shared != 0) {
+        // if someone committed a real page since we looked, theirs stays
+        return arch_pte_fill(env, addr, shared, desc->flags & ~VMEM_PAGE_WRITE);
+    }
+    return vmem_try_commit(env, desc, addr, start_addr, end_addr, stale) != 0;
+}
 
-static _Alignas(4096) const uint8_t VMEM_ZERO_PAGE[4096];
-bool vmem_segfault(Env* env, uintptr_t access_addr, bool is_write) {
+size_t vmem_readahead_max = 128*1024;
+
+// which of the thread's streams the fault belongs to, NULL if it's not part of
+// one yet (it might be the start of one).
+static VMem_Stream* vmem_readahead_stream(VMem_Readahead* ra, uintptr_t access_addr) {
+    uint32_t now = ++ra->clock;
+    uint32_t max_window = vmem_readahead_max / PAGE_SIZE;
+
+    // right where one of them expected it?
+    VMem_Stream* s = NULL;
+    FOR_N(i, 0, VMEM_RA_STREAMS) {
+        if (ra->streams[i].stride != 0 && ra->streams[i].next_addr == access_addr) {
+            s = &ra->streams[i];
+            s->window = s->window*2 < max_window ? s->window*2 : max_window;
+            break;
+        }
+    }
+
+    // second fault a stride away from a lone one, the closest wins
+    if (s == NULL) {
+        uintptr_t best = VMEM_RA_MAX_STRIDE + 1;
+        FOR_N(i, 0, VMEM_RA_STREAMS) {
+            VMem_Stream* it = &ra->streams[i];
+            if (it->stride != 0 || it->next_addr == 0) {
+                continue;
+            }
+
+            uintptr_t dist = access_addr > it->next_addr ? access_addr - it->next_addr : it->next_addr - access_addr;
+            if (dist != 0 && dist < best) {
+                best = dist, s = it;
+            }
+        }
+
+        if (s != NULL) {
+            s->stride = access_addr - s->next_addr;
+            s->window = VMEM_RA_MIN_WINDOW < max_window ? VMEM_RA_MIN_WINDOW : max_window;
+        }
+    }
+
+    if (s == NULL) {
+        // nothing we know, it replaces the stalest stream
+        ON_DEBUG(VMEM)(kprintf("[vmem] prefetch miss %p\n", access_addr));
+        atomic_fetch_add_explicit(&vmem_counters.ra_misses, 1, memory_order_relaxed);
+
+        s = &ra->streams[0];
+        FOR_N(i, 1, VMEM_RA_STREAMS) {
+            if (ra->streams[i].last_used < s->last_used) {
+                s = &ra->streams[i];
+            }
+        }
+        *s = (VMem_Stream){ .next_addr = access_addr, .last_used = now };
+        return NULL;
+    }
+
+    atomic_fetch_add_explicit(&vmem_counters.ra_hits, 1, memory_order_relaxed);
+    s->last_used = now;
+    return s;
+}
+
+VMem_Fault vmem_segfault(Env* env, uintptr_t access_addr, bool is_write) {
     // we don't care where in the page it's located
     access_addr &= -PAGE_SIZE;
 
     VMem_Cursor cursor = vmem_node_lookup(env, access_addr);
     if (cursor.node == NULL) {
         // literally no pages
-        return false;
+        return VMEM_FAULT_SEGV;
     }
 
     // check if we're in range
@@ -489,40 +2158,44 @@ bool vmem_segfault(Env* env, uintptr_t access_addr, bool is_write) {
     uintptr_t end_addr   = start_addr + desc->size;
     if (!desc->valid || access_addr < start_addr || access_addr >= end_addr) {
         // we're in the gap between page descriptor
-        return false;
+        return VMEM_FAULT_SEGV;
+    }
+
+    // writing to read-only memory is a real fault, on writable memory it might just
+    // be a PTE from before an mprotect and the commit below rewrites it.
+    if (is_write && !(desc->flags & VMEM_PAGE_WRITE)) {
+        return VMEM_FAULT_SEGV;
     }
 
-    size_t pages_to_commit = 1;
     Thread* thread = cpu_get()->current_thread;
-    if (access_addr == thread->last_touch.next_addr) {
-        size_t readahead = access_addr - thread->last_touch.base_addr;
-        if (readahead > 32*1024) {
-            readahead = 32*1024;
-        }
+    VMem_Stream* stream = vmem_readahead_stream(&thread->readahead, access_addr);
 
-        size_t dist_to_end = end_addr - access_addr;
-        if (readahead > dist_to_end) {
-            readahead = dist_to_end;
+    bool stale = false;
+    if (!vmem_fault_commit(env, desc, access_addr, start_addr, end_addr, is_write, &stale)) {
+        return VMEM_FAULT_NO_MEM;
+    }
+
+    if (stream != NULL) {
+        // readahead is just a guess, it stops at the end of the range and if
+        // we're short on memory we don't bother.
+        size_t committed = 0;
+        uintptr_t addr = access_addr + stream->stride;
+        while (committed < stream->window && addr >= start_addr && addr < end_addr) {
+            if (!vmem_fault_commit(env, desc, addr, start_addr, end_addr, is_write, &stale)) {
+                stream->window = VMEM_RA_MIN_WINDOW;
+                break;
+            }
+            committed += 1, addr += stream->stride;
         }
 
-        if (dist_to_end == 0) {
+        ON_DEBUG(VMEM)(kprintf("[vmem] prefetch hit  %p, commit ahead %zu pages (stride=%zd)\n", access_addr, committed, stream->stride));
+        atomic_fetch_add_explicit(&vmem_counters.ra_pages, committed, memory_order_relaxed);
+        if (committed == 0) {
             // If we can't prefetch anymore, kill the readahead
-            ON_DEBUG(VMEM)(kprintf("[vmem] prefetch miss %p\n", access_addr));
-            thread->last_touch.base_addr = thread->last_touch.next_addr = 0;
+            *stream = (VMem_Stream){ 0 };
         } else {
-            ON_DEBUG(VMEM)(kprintf("[vmem] prefetch hit  %p, commit ahead %zu pages (base=%p, dist=%zu)\n", access_addr, readahead / PAGE_SIZE, thread->last_touch.base_addr, readahead));
-            thread->last_touch.next_addr = access_addr + readahead;
-            pages_to_commit = readahead / PAGE_SIZE;
+            stream->next_addr = addr;
         }
-    } else {
-        ON_DEBUG(VMEM)(kprintf("[vmem] prefetch miss %p\n", access_addr));
-        thread->last_touch.base_addr = access_addr;
-        thread->last_touch.next_addr = access_addr + PAGE_SIZE;
     }
-
-    // kprintf("%p %zu (%p %p)\n", access_addr, pages_to_commit, start_addr, end_addr);
-    FOR_N(i, 0, pages_to_commit) {
-        vmem_try_commit(env, desc, access_addr + i*PAGE_SIZE, start_addr, end_addr);
-    }
-    return true;
+    return stale ? VMEM_FAULT_OK_FLUSH : VMEM_FAULT_OK;
 }
@@ -0,0 +1,453 @@
+// Runs the kernel heap as a normal Linux process so we can benchmark & stress
+// it without booting anything.
+//
+// heap_host [threads] [memory MiB]
+//
+// kernel/heap.c gets compiled straight into this file, every "core" is a
+// pthread (cpu_get_index reads a thread local) and "physical memory" is one
+// big mmap, identity_map_ptr points at it so paddr2kaddr & friends just work.
+// Objects get stamped on alloc & checked on free so overlapping blocks or
+// lost frees show up as failures instead of silently passing.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <x86intrin.h>
+
+// beans.h has its own PROT_* & MADV_* enums
+static const int HOST_PROT_RW = PROT_READ | PROT_WRITE;
+#undef PROT_NONE
+#undef PROT_READ
+#undef PROT_WRITE
+#undef PROT_EXEC
+#undef MADV_NORMAL
+#undef MADV_HUGEPAGE
+#undef MADV_NOHUGEPAGE
+
+// kernel.h wants a void sched_yield, libc already has one
+#define sched_yield kernel_sched_yield
+#include <kernel.h>
+#undef sched_yield
+#include <sched.h>
+
+// printf.h reroutes these into the kernel's printf
+#undef printf
+#undef vprintf
+#undef snprintf
+
+////////////////////////////////
+// Kernel shim
+////////////////////////////////
+BootInfo* boot_info;
+static BootInfo host_boot_info;
+static __thread int host_core;
+
+void kprintf(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+void arch_backtrace(void) {}
+PerCPU* cpu_get(void) { return &boot_info->cores[host_core]; }
+size_t cpu_get_index(void) { return host_core; }
+uint64_t get_time_ticks(void) { return __rdtsc(); }
+
+bool arch_irq_save(void) { return false; }
+void arch_irq_restore(bool enabled) {}
+void arch_zero_page(void* page) { memset(page, 0, PAGE_SIZE); }
+void arch_zero_page_nt(void* page) { memset(page, 0, PAGE_SIZE); }
+
+// we've got more threads than cores most of the time, spinning without
+// yielding would just burn the lock holder's timeslice.
+void spin_lock(Lock* lock) {
+    uint32_t expected = 0;
+    while (!atomic_compare_exchange_weak(lock, &expected, 1)) {
+        expected = 0;
+        sched_yield();
+    }
+}
+
+void spin_unlock(Lock* lock) {
+    atomic_store_explicit(lock, 0, memory_order_release);
+}
+
+MapFileEntry* map_entry_get(uint32_t rva) { return NULL; }
+// no frame allocator here and we never release boot memory
+void frame_donate(void* ptr, size_t count) {}
+
+// Just build it as part of the bigger unit
+#include "../kernel/heap.c"
+
+////////////////////////////////
+// Harness
+////////////////////////////////
+enum {
+    // per thread, objects past this don't get a latency sample
+    MAX_SAMPLES = 1 << 20,
+    // producer -> consumer queue
+    RING_SIZE = 1024,
+};
+
+typedef struct {
+    uint32_t size;
+    void* ptr;
+} Obj;
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t head;
+    _Alignas(64) _Atomic uint64_t tail;
+    Obj data[RING_SIZE];
+} Ring;
+
+typedef struct {
+    int core;
+    uint64_t rng;
+
+    uint64_t ops;
+    uint64_t failures;
+    // allocations which came back NULL, they're still timed
+    uint64_t ooms;
+    size_t sample_count;
+    uint32_t* samples;
+
+    // producer/consumer pairs
+    Ring* ring;
+    bool producer;
+} Worker;
+
+typedef struct {
+    const char* name;
+    void (*fn)(Worker* w);
+    // only ran when there's an even number of threads
+    bool pairs;
+} Bench;
+
+static int thread_count = 4;
+static size_t mem_size = 1024ull << 20;
+static double tsc_per_ns;
+static pthread_barrier_t start_barrier;
+
+// scaled by the thread count so each bench takes roughly the same time
+static size_t bench_iters = 1 << 20;
+
+static uint64_t next_rand(Worker* w) {
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+static void record(Worker* w, uint64_t start) {
+    uint64_t t = __rdtsc() - start;
+    if (w->sample_count < MAX_SAMPLES) {
+        w->samples[w->sample_count++] = t > UINT32_MAX ? UINT32_MAX : t;
+    }
+    w->ops += 1;
+}
+
+// the first & last word of every object hold its address & size, anything
+// else scribbling on it (or the heap handing it out twice) breaks that. the
+// smallest objects only have room for the first one.
+static void stamp(Obj* obj) {
+    uint64_t tag = (uintptr_t) obj->ptr ^ obj->size;
+    memcpy(obj->ptr, &tag, sizeof(tag));
+    if (obj->size >= 2*sizeof(tag)) {
+        memcpy((char*) obj->ptr + obj->size - sizeof(tag), &tag, sizeof(tag));
+    }
+}
+
+static void check(Worker* w, Obj* obj) {
+    uint64_t tag = (uintptr_t) obj->ptr ^ obj->size;
+    uint64_t a, b = tag;
+    memcpy(&a, obj->ptr, sizeof(a));
+    if (obj->size >= 2*sizeof(tag)) {
+        memcpy(&b, (char*) obj->ptr + obj->size - sizeof(b), sizeof(b));
+    }
+    if (a != tag || b != tag) {
+        if (w->failures++ == 0) {
+            fprintf(stderr, "core %d: object %p (%u bytes) got stomped on\n", w->core, obj->ptr, obj->size);
+        }
+    }
+}
+
+static void obj_alloc(Worker* w, Obj* obj, uint32_t size) {
+    uint64_t start = __rdtsc();
+    obj->ptr  = kheap_alloc(size);
+    record(w, start);
+
+    obj->size = size;
+    if (obj->ptr == NULL) {
+        w->ooms += 1;
+        return;
+    }
+    stamp(obj);
+}
+
+static void obj_free(Worker* w, Obj* obj) {
+    // the alloc ran out of memory, there's nothing to give back
+    if (obj->ptr == NULL) {
+        return;
+    }
+    check(w, obj);
+
+    uint64_t start = __rdtsc();
+    kheap_free(obj->ptr, obj->size);
+    record(w, start);
+    obj->ptr = NULL;
+}
+
+// mostly small stuff with the occasional page or two
+static uint32_t random_size(Worker* w) {
+    uint64_t r = next_rand(w);
+    switch (r % 16) {
+        case 0:  return PAGE_SIZE + (r >> 8) % (4*PAGE_SIZE);
+        case 1:  return 8 + (r >> 8) % 4088;
+        default: return 8 + (r >> 8) % 504;
+    }
+}
+
+// random frees & allocs over a window of live objects, hits every size class
+static void bench_churn(Worker* w) {
+    enum { LIVE = 4096 };
+    Obj* objs = calloc(LIVE, sizeof(Obj));
+    FOR_N(i, 0, LIVE) {
+        obj_alloc(w, &objs[i], random_size(w));
+    }
+
+    FOR_N(i, 0, bench_iters) {
+        Obj* obj = &objs[next_rand(w) % LIVE];
+        obj_free(w, obj);
+        obj_alloc(w, obj, random_size(w));
+    }
+
+    FOR_N(i, 0, LIVE) {
+        obj_free(w, &objs[i]);
+    }
+    free(objs);
+}
+
+// one side allocates, the other frees so every free goes through the
+// owner's thread_free list.
+static void bench_cross_free(Worker* w) {
+    Ring* ring = w->ring;
+    if (w->producer) {
+        FOR_N(i, 0, bench_iters) {
+            Obj obj;
+            obj_alloc(w, &obj, random_size(w));
+
+            uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == RING_SIZE) {
+                sched_yield();
+            }
+            ring->data[tail % RING_SIZE] = obj;
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        }
+    } else {
+        FOR_N(i, 0, bench_iters) {
+            uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+                sched_yield();
+            }
+            Obj obj = ring->data[head % RING_SIZE];
+            atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+            obj_free(w, &obj);
+        }
+    }
+}
+
+// everyone grabs big var & span allocations until most of the segments are
+// gone, then frees the neighbor's half so the pools have to get refilled
+// (and stolen from) the hard way.
+static Obj* exhaust_objs[MAX_CORES];
+static size_t exhaust_counts[MAX_CORES];
+static pthread_barrier_t exhaust_barrier;
+
+static void bench_exhaust(Worker* w) {
+    // leave some slack for the other benches' leftovers & metadata
+    size_t budget = ((kheap_segment_count() * SEGMENT_SIZE) / 4) * 3 / thread_count;
+    size_t cap    = budget / (64*1024) + 1;
+    Obj* objs     = calloc(cap, sizeof(Obj));
+    exhaust_objs[w->core] = objs;
+
+    FOR_N(round, 0, 8) {
+        size_t used = 0, count = 0;
+        for (;;) {
+            uint32_t size = 64*1024 + next_rand(w) % (3*SEGMENT_SIZE);
+            size_t rounded = size > SEGMENT_SIZE ? (size + SEGMENT_SIZE - 1) & -SEGMENT_SIZE : size;
+            if (used + rounded > budget || count == cap) {
+                break;
+            }
+            obj_alloc(w, &objs[count++], size);
+            used += rounded;
+        }
+        exhaust_counts[w->core] = count;
+        pthread_barrier_wait(&exhaust_barrier);
+
+        // free our neighbor's stuff
+        int victim = (w->core + 1) % thread_count;
+        Obj* theirs = exhaust_objs[victim];
+        FOR_N(i, 0, exhaust_counts[victim]) {
+            obj_free(w, &theirs[i]);
+        }
+        pthread_barrier_wait(&exhaust_barrier);
+    }
+    free(objs);
+}
+
+static Bench benches[] = {
+    { "churn",      bench_churn      },
+    { "cross-free", bench_cross_free, true },
+    { "exhaust",    bench_exhaust    },
+};
+
+static int cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static Bench* curr_bench;
+static void* bench_main(void* arg) {
+    Worker* w = arg;
+    host_core = w->core;
+    pthread_barrier_wait(&start_barrier);
+    curr_bench->fn(w);
+    return NULL;
+}
+
+static bool run_bench(Bench* b, Worker* workers) {
+    if (b->pairs && thread_count % 2) {
+        printf("%-12s skipped (needs an even number of threads)\n", b->name);
+        return true;
+    }
+
+    static Ring rings[MAX_CORES / 2];
+    FOR_N(i, 0, thread_count) {
+        Worker* w = &workers[i];
+        w->ops = w->failures = w->ooms = w->sample_count = 0;
+        w->ring = &rings[i / 2];
+        w->producer = (i % 2) == 0;
+        atomic_store(&w->ring->head, 0);
+        atomic_store(&w->ring->tail, 0);
+    }
+
+    curr_bench = b;
+    pthread_barrier_init(&start_barrier, NULL, thread_count + 1);
+    pthread_barrier_init(&exhaust_barrier, NULL, thread_count);
+
+    pthread_t threads[MAX_CORES];
+    FOR_N(i, 0, thread_count) {
+        pthread_create(&threads[i], NULL, bench_main, &workers[i]);
+    }
+
+    double start = now_ns();
+    pthread_barrier_wait(&start_barrier);
+    FOR_N(i, 0, thread_count) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_ns() - start;
+
+    pthread_barrier_destroy(&start_barrier);
+    pthread_barrier_destroy(&exhaust_barrier);
+
+    // merge everyone's samples for the percentiles
+    uint64_t ops = 0, failures = 0, ooms = 0;
+    size_t sample_count = 0;
+    FOR_N(i, 0, thread_count) {
+        ops += workers[i].ops;
+        failures += workers[i].failures;
+        ooms += workers[i].ooms;
+        sample_count += workers[i].sample_count;
+    }
+
+    uint32_t* samples = malloc(sample_count * sizeof(uint32_t));
+    size_t j = 0;
+    FOR_N(i, 0, thread_count) {
+        memcpy(&samples[j], workers[i].samples, workers[i].sample_count * sizeof(uint32_t));
+        j += workers[i].sample_count;
+    }
+    qsort(samples, sample_count, sizeof(uint32_t), cmp_u32);
+
+    double p50 = samples[sample_count / 2] / tsc_per_ns;
+    double p99 = samples[(sample_count * 99) / 100] / tsc_per_ns;
+    double max = samples[sample_count - 1] / tsc_per_ns;
+    printf("%-12s %12.0f ops/s %9.0f ns p50 %9.0f ns p99 %9.0f ns max", b->name, ops / (elapsed / 1e9), p50, p99, max);
+    if (ooms) {
+        printf(" %6llu OOMs", (unsigned long long) ooms);
+    }
+    printf(" %s\n", failures ? "FAILED" : "");
+    free(samples);
+    return failures == 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) { thread_count = atoi(argv[1]); }
+    if (argc > 2) { mem_size = strtoull(argv[2], NULL, 10) << 20; }
+    if (thread_count < 1 || thread_count > MAX_CORES) {
+        fprintf(stderr, "error: thread count has to be between 1 and %d\n", MAX_CORES);
+        return 1;
+    }
+
+    // tsc -> ns, we only care about rough numbers
+    double ns_start = now_ns();
+    uint64_t tsc_start = __rdtsc();
+    while (now_ns() - ns_start < 50e6) {}
+    tsc_per_ns = (__rdtsc() - tsc_start) / (now_ns() - ns_start);
+
+    // fake physical memory, the heap wants segments to be 2MiB aligned
+    char* raw = mmap(NULL, mem_size + SEGMENT_SIZE, HOST_PROT_RW, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) {
+        fprintf(stderr, "error: couldn't map %zu MiB\n", mem_size >> 20);
+        return 1;
+    }
+
+    boot_info = &host_boot_info;
+    boot_info->identity_map_ptr = ((uintptr_t) raw + SEGMENT_SIZE - 1) & -(uintptr_t) SEGMENT_SIZE;
+    boot_info->core_count = thread_count;
+    FOR_N(i, 0, thread_count) {
+        boot_info->cores[i].self = &boot_info->cores[i];
+        boot_info->cores[i].lapic_id = i;
+    }
+
+    // first MiB is off limits, same as a real PC
+    static MemRegion regions[2];
+    regions[0] = (MemRegion){ MEM_REGION_RESERVED, 0, 0x100000 / PAGE_SIZE };
+    regions[1] = (MemRegion){ MEM_REGION_USABLE, 0x100000, (mem_size - 0x100000) / PAGE_SIZE };
+    boot_info->mem_map = (MemMap){ 2, 2, regions };
+
+    kheap_init(&boot_info->mem_map);
+    kheap_multicore(thread_count);
+
+    bench_iters = (1 << 22) / thread_count;
+
+    Worker* workers = calloc(thread_count, sizeof(Worker));
+    FOR_N(i, 0, thread_count) {
+        workers[i].core    = i;
+        workers[i].rng     = (i + 1) * 0x9E3779B97F4A7C15ull;
+        workers[i].samples = malloc(MAX_SAMPLES * sizeof(uint32_t));
+    }
+
+    printf("%d threads, %zu MiB, %zu segments\n", thread_count, mem_size >> 20, kheap_segment_count());
+
+    bool ok = true;
+    FOR_N(i, 0, ELEM_COUNT(benches)) {
+        ok &= run_bench(&benches[i], workers);
+    }
+
+    if (getenv("HEAP_DUMP")) {
+        kheap_dump();
+    }
+    return ok ? 0 : 1;
+}
@@ -14,6 +14,7 @@
 
 // Just build it as part of the bigger unit
 #include <lz4.c>
+#include <initrd.h>
 
 #ifdef _WIN32
 #define fileno _fileno
@@ -21,13 +22,6 @@
 #define stat _stat64
 #endif
 
-typedef struct {
-    uint32_t data_len;
-    uint32_t unpacked_len;
-    char path[24];
-    char data[];
-} FileEntry;
-
 static const char ZEROES[16];
 int main(int argc, char** argv) {
     if (argc <= 1) {
@@ -68,13 +62,31 @@ int main(int argc, char** argv) {
         fread(input, 1, len, file);
         fclose(file);
 
-        // LZ4 compress
-        char* data = malloc(len);
-        int packed_len = LZ4_compress_default(input, data, len, len);
-        if (packed_len == 0) {
-            printf("Failed to compress!!! %s\n", name);
-            continue;
+        // LZ4 compress, every block on its own so the kernel can unpack
+        // whichever one a page fault lands in.
+        size_t block_count = (len + INITRD_BLOCK_SIZE - 1) / INITRD_BLOCK_SIZE;
+        size_t table_len = block_count * sizeof(uint32_t);
+        char* data = malloc(table_len + block_count*LZ4_compressBound(INITRD_BLOCK_SIZE));
+        uint32_t* block_ends = (uint32_t*) data;
+
+        size_t packed_len = 0;
+        for (size_t j = 0; j < block_count; j++) {
+            size_t block_len = len - j*INITRD_BLOCK_SIZE;
+            if (block_len > INITRD_BLOCK_SIZE) { block_len = INITRD_BLOCK_SIZE; }
+
+            char* src = input + j*INITRD_BLOCK_SIZE;
+            char* dst = data + table_len + packed_len;
+            int block_packed = LZ4_compress_default(src, dst, block_len, block_len - 1);
+            if (block_packed <= 0) {
+                // didn't get any smaller, just store it
+                memcpy(dst, src, block_len);
+                block_packed = block_len;
+            }
+
+            packed_len += block_packed;
+            block_ends[j] = packed_len;
         }
+        packed_len += table_len;
         size_t cap = (packed_len + 16) & -16ull; // round_up(len + 1, 16)
 
         FileEntry header = { .data_len = packed_len, .unpacked_len = len };
@@ -88,7 +100,7 @@ int main(int argc, char** argv) {
 
         file_len += sizeof(FileEntry) + cap;
         unpacked_len += sizeof(FileEntry) + ((len + 16) & -16ull);
-        printf("Added '%s' (%zu => %d bytes)\n", name, len, packed_len);
+        printf("Added '%s' (%zu => %zu bytes)\n", name, len, packed_len);
     }
     printf("Reduction %zu => %zu bytes (%.2f%%)\n", unpacked_len, file_len, (file_len / (double) unpacked_len) * 100.0);
 
@@ -1,6 +1,7 @@
 #include <beans.h>
 #include <common.h>
 #include <elf.h>
+#include <initrd.h>
 #include "../kernel/printf.c"
 
 void* memset(void* buffer, int c, size_t n) {
@@ -35,20 +36,6 @@ void* memmove(void* dest, const void* src, size_t n) {
     return dest;
 }
 
-// Just build it as part of the bigger unit
-#define LZ4_memset(dst, src, n) memset(dst, src, n)
-#define LZ4_memcpy(dst, src, n) memcpy(dst, src, n)
-#define LZ4_memmove(dst, src, n) memmove(dst, src, n)
-#define LZ4_FREESTANDING 1
-#include <lz4.c>
-
-typedef struct {
-    uint32_t data_len;
-    uint32_t unpacked_len;
-    char path[24];
-    char data[];
-} FileEntry;
-
 typedef struct {
     uint32_t key;
     size_t path_len;
@@ -57,6 +44,52 @@ typedef struct {
 
 static DriverEntry drivers[256];
 
+static KHandle initrd_vmo;
+static FileEntry* initrd_base;
+
+// syscalls hand back negative RESULT codes (or 0) when they fail, user
+// addresses and handles are never negative.
+static bool sys_failed(int64_t x) {
+    return x <= 0;
+}
+
+// opened files stick around so every env running the same one shares its
+// pages (the segments are just clones of it). the kernel unpacks them as
+// they're touched, we never see the compressed data.
+typedef struct {
+    FileEntry* file;
+    KHandle vmo;
+    char* contents;
+} ImageEntry;
+
+static int image_count;
+static ImageEntry images[32];
+
+static ImageEntry* load_image(FileEntry* file) {
+    for (int i = 0; i < image_count; i++) {
+        if (images[i].file == file) {
+            return &images[i];
+        }
+    }
+
+    if (image_count == ELEM_COUNT(images)) {
+        return NULL;
+    }
+
+    KHandle vmo = vmo_create_initrd(initrd_vmo, (char*) file - (char*) initrd_base);
+    if (vmo == 0) {
+        return NULL;
+    }
+
+    char* contents = mmap(0, vmo, 0, file->unpacked_len, PROT_READ, 0);
+    if (sys_failed((int64_t) contents)) {
+        printf("[init] error: couldn't map %s (%d)\n", file->path, (int) (int64_t) contents);
+        return NULL;
+    }
+    images[image_count] = (ImageEntry){ file, vmo, contents };
+    return &images[image_count++];
+}
+
 static KHandle log_stream;
 static char* log_buffer;
 static int log_used;
@@ -136,12 +169,13 @@ static DriverEntry* get_driver(uint32_t key) {
 }
 
 static bool parse_driver_list(FileEntry* file) {
-    char* src = mmap(0, 0, 0, file->unpacked_len, PROT_READ | PROT_WRITE, 0);
-    int res = LZ4_decompress_safe(file->data, src, file->data_len, file->unpacked_len);
-    if (file->unpacked_len != res) {
+    ImageEntry* image = load_image(file);
+    if (image == NULL) {
         return false;
     }
 
+    const char* src = image->contents;
+
     int state = 0;
     while (*src) {
         // skip whitespace
@@ -194,8 +228,7 @@ static FileEntry* find_file(FileEntry* initrd, size_t path_len, const char* path
             return initrd;
         }
 
-        size_t padded_len = (initrd->data_len + 16) & -16ull;
-        initrd = (FileEntry*) (((char*) initrd) + sizeof(FileEntry) + padded_len);
+        initrd = initrd_next(initrd);
     }
     return NULL;
 }
@@ -205,12 +238,13 @@ static bool exec(FileEntry* file, KHandle arg) {
         return false;
     }
 
-    char* contents = mmap(0, 0, 0, file->unpacked_len, PROT_READ | PROT_WRITE, 0);
-    int res = LZ4_decompress_safe(file->data, contents, file->data_len, file->unpacked_len);
-    if (file->unpacked_len != res) {
+    ImageEntry* image = load_image(file);
+    if (image == NULL) {
         return false;
     }
 
+    char* contents = image->contents;
+
     Elf64_Ehdr* elf_header = (Elf64_Ehdr*) contents;
     size_t segment_size = elf_header->e_phentsize;
     size_t segment_header_bounds = elf_header->e_phoff + elf_header->e_phnum*segment_size;
@@ -238,9 +272,17 @@ static bool exec(FileEntry* file, KHandle arg) {
 
     // Create environment
     KHandle child_env = syscall(SYS_env_create);
+    if (sys_failed((int) child_env)) {
+        printf("[init] error: couldn't create an env for %s\n", file->path);
+        return false;
+    }
 
     // Place ELF into env
     char* elf_vmap = mmap(child_env, 0, 0, hi - lo, PROT_READ | PROT_WRITE | MEM_PLACEHOLDER, 0);
+    if (sys_failed((int64_t) elf_vmap)) {
+        printf("[init] error: couldn't reserve %s's address space (%d)\n", file->path, (int) (int64_t) elf_vmap);
+        return false;
+    }
     for (size_t i = 0; i < elf_header->e_phnum; i++) {
         Elf64_Phdr* segment = (Elf64_Phdr*) (segments + i*segment_size);
         if (segment->p_type != PT_LOAD) {
@@ -249,18 +291,58 @@ static bool exec(FileEntry* file, KHandle arg) {
 
         uintptr_t vaddr  = (segment->p_vaddr & -page_size) - lo;
         uintptr_t offset = segment->p_vaddr & (page_size - 1);
-        uintptr_t memsz  = segment->p_memsz + offset;
-        memsz = (memsz + page_size - 1) & -page_size;
-
-        // TODO(NeGate): we should coalesce the section VMOs
-        KHandle section_vmo = syscall(SYS_vmo_create, 0, memsz);
-        char* dst = mmap(0, section_vmo, 0, memsz, PROT_READ | PROT_WRITE, 0);
-        if (segment->p_filesz > 0) {
-            memcpy(dst + offset, &contents[segment->p_offset], segment->p_filesz);
+        uintptr_t memsz  = (segment->p_memsz + offset + page_size - 1) & -page_size;
+        uintptr_t filesz = segment->p_filesz ? (segment->p_filesz + offset + page_size - 1) & -page_size : 0;
+
+        uint32_t prot = PROT_READ;
+        if (segment->p_flags & PF_W) { prot |= PROT_WRITE; }
+        if (segment->p_flags & PF_X) { prot |= PROT_EXEC; }
+
+        // the file part is a clone of the image, the child only gets its own
+        // copy of the pages it writes to.
+        if (filesz > 0) {
+            if ((segment->p_offset & (page_size - 1)) != offset) {
+                printf("[init] error: segment isn't page aligned in the file\n");
+                return false;
+            }
+
+            // a failed clone has to stop us here, mapping a 0 handle would
+            // quietly give the child demand-zero memory instead of its code.
+            KHandle section_vmo = vmo_clone(image->vmo, segment->p_offset & -page_size, filesz);
+            if (sys_failed((int) section_vmo)) {
+                printf("[init] error: couldn't clone segment %zu of %s (%d)\n", i, file->path, (int) section_vmo);
+                return false;
+            }
+
+            // the rest of the last page is whatever came next in the file, if
+            // it's meant to be bss it has to be zeroed.
+            size_t tail = filesz - (offset + segment->p_filesz);
+            if (tail > 0 && segment->p_memsz > segment->p_filesz) {
+                char* dst = mmap(0, section_vmo, 0, filesz, PROT_READ | PROT_WRITE, 0);
+                if (sys_failed((int64_t) dst)) {
+                    printf("[init] error: couldn't map segment %zu of %s (%d)\n", i, file->path, (int) (int64_t) dst);
+                    return false;
+                }
+                memset(dst + filesz - tail, 0, tail);
+                munmap(0, dst, filesz);
+            }
+
+            // Map into child environment
+            char* mapped = mmap(child_env, section_vmo, (uintptr_t) elf_vmap + vaddr, filesz, prot, 0);
+            if (sys_failed((int64_t) mapped)) {
+                printf("[init] error: couldn't map segment %zu into %s (%d)\n", i, file->path, (int) (int64_t) mapped);
+                return false;
+            }
         }
 
-        // Map into child environment
-        mmap(child_env, section_vmo, (uintptr_t) elf_vmap + vaddr, memsz, PROT_READ | PROT_WRITE, 0);
+        // the rest of the bss is just demand-zero memory
+        if (memsz > filesz) {
+            char* bss = mmap(child_env, 0, (uintptr_t) elf_vmap + vaddr + filesz, memsz - filesz, prot, 0);
+            if (sys_failed((int64_t) bss)) {
+                printf("[init] error: couldn't map the bss of %s (%d)\n", file->path, (int) (int64_t) bss);
+                return false;
+            }
+        }
     }
 
     // Spin up the main thread
@@ -272,6 +354,8 @@ static bool exec(FileEntry* file, KHandle arg) {
 int _start(KHandle bootstrap_vmo) {
     size_t initrd_size = vmo_get_size(bootstrap_vmo);
     FileEntry* initrd  = mmap(0, bootstrap_vmo, 0, initrd_size, PROT_READ | PROT_WRITE, 0);
+    initrd_vmo  = bootstrap_vmo;
+    initrd_base = initrd;
 
     // Scan the drivers.txt, construct hashmap for driver mappings
     printf("InitRD:\n");
@@ -286,8 +370,7 @@ int _start(KHandle bootstrap_vmo) {
         }
 
         // Advance files
-        size_t padded_len = (file->data_len + 16) & -16ull;
-        file = (FileEntry*) (((char*) file) + sizeof(FileEntry) + padded_len);
+        file = initrd_next(file);
     }
 
     // Find the first set of connected PCI devices